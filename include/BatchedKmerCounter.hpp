@@ -0,0 +1,96 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef BATCHED_KMER_COUNTER_HPP
+#define BATCHED_KMER_COUNTER_HPP
+
+#include <array>
+#include <cstdint>
+
+#include "PerfectHashIndex.hpp"
+#include "CountDBNew.hpp"
+#include "PartitionedCounts.hpp"
+
+/**
+*  Accumulates kmers (possibly from many reads) into fixed-size batches and
+*  counts each batch in three passes: hash every kmer, verify the (prefetched)
+*  key slots, then increment the (prefetched) counters.  If the counts use
+*  the interleaved layout, the second pass also brings in the counters.  Compared to calling
+*  index() and inc() once per kmer, this keeps many independent memory
+*  requests in flight at once, which is what bounds counting throughput when
+*  the index is much larger than the cache.
+*
+*  Each counting thread owns its own BatchedKmerCounter; flush() must be
+*  called once the thread has no more kmers to push.  If a PartitionedCounts
+*  writer is provided, the ids are handed to it rather than being atomically
+*  incremented in place.
+**/
+template <typename KmerT>
+class BatchedKmerCounterT {
+  using Kmer = KmerT;
+  using Index = PerfectHashIndexT<KmerT>;
+  using CountDB = CountDBNewT<KmerT>;
+  using Writer = typename PartitionedCountsT<KmerT>::Writer;
+
+  public:
+   static constexpr size_t BatchSize = 64;
+
+   BatchedKmerCounterT( Index& index, CountDB& counts, Writer* writer = nullptr ) :
+      index_(index), counts_(counts), writer_(writer), numMers_(0), numUnmapped_(0) {}
+
+   inline void push(Kmer k) {
+     mers_[numMers_++] = k;
+     if (numMers_ == BatchSize) { flush(); }
+   }
+
+   inline void push(const Kmer* mers, size_t n) {
+     for (size_t i = 0; i < n; ++i) { push(mers[i]); }
+   }
+
+   void flush() {
+     counts_.lookup(&mers_[0], numMers_, &ids_[0]);
+     for (size_t i = 0; i < numMers_; ++i) {
+       numUnmapped_ += (ids_[i] == index_.INVALID);
+     }
+     if (writer_) {
+       writer_->add(&ids_[0], numMers_);
+     } else {
+       counts_.incAtIndices(&ids_[0], numMers_);
+     }
+     numMers_ = 0;
+   }
+
+   inline uint64_t numUnmapped() { return numUnmapped_; }
+
+  private:
+   Index& index_;
+   CountDB& counts_;
+   Writer* writer_;
+   std::array<Kmer, BatchSize> mers_;
+   std::array<size_t, BatchSize> ids_;
+   size_t numMers_;
+   uint64_t numUnmapped_;
+};
+
+using BatchedKmerCounter = BatchedKmerCounterT<uint64_t>;
+
+#endif // BATCHED_KMER_COUNTER_HPP
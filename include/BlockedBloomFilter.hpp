@@ -0,0 +1,141 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef BLOCKED_BLOOM_FILTER_HPP
+#define BLOCKED_BLOOM_FILTER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+#include "KmerWord.hpp"
+
+/**
+*  A blocked Bloom filter over a set of kmer keys (64 or 128-bit words, see
+*  KmerWord.hpp).  It is used to reject kmers that are not in an index before
+*  they are hashed and their key slot is fetched; most of the kmers in a read
+*  set with a low mapping rate never touch the index at all.
+*
+*  Every key selects a single 64-byte (cache line) block, and sets (and is
+*  tested against) NumHashes bits within that block, so a query touches one
+*  cache line.  With 8 bits per key, about 2.4% of the kmers that are not in
+*  the filter pass it.  Like KmerMPHF, the filter is built into a flat
+*  buffer that is written to (and mapped from) the index file, and queries
+*  work directly on that buffer.
+**/
+class BlockedBloomFilter {
+  public:
+   static constexpr uint64_t WordsPerBlock = 8;
+   // each bit position takes 9 of the 64 bits of the second hash
+   static constexpr uint64_t MaxHashes = 7;
+
+   struct Header {
+    uint64_t numKeys;
+    uint64_t numBlocks;
+    uint64_t numHashes;
+   };
+   // The blocks start on a cache line boundary (relative to the buffer)
+   static constexpr size_t HeaderBytes = ((sizeof(Header) + 63) / 64) * 64;
+
+   /**
+   *  Build a filter of (about) bitsPerKey bits per key over keys.
+   **/
+   template <typename Key, typename Alloc>
+   static std::vector<char> build(const std::vector<Key, Alloc>& keys, uint32_t bitsPerKey) {
+    using BlockedRange = tbb::blocked_range<size_t>;
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    header.numKeys = keys.size();
+    uint64_t numBits = static_cast<uint64_t>(bitsPerKey) * keys.size();
+    header.numBlocks = std::max(uint64_t(1), (numBits + 511) / 512);
+    // the optimal number of hashes is ln(2) * (bits / key)
+    uint64_t numHashes = static_cast<uint64_t>(std::lround(bitsPerKey * std::log(2.0)));
+    const uint64_t maxHashes = MaxHashes;
+    header.numHashes = std::min(maxHashes, std::max(uint64_t(1), numHashes));
+
+    std::vector<std::atomic<uint64_t>> words(header.numBlocks * WordsPerBlock);
+    for (auto& w : words) { w.store(0, std::memory_order_relaxed); }
+    tbb::parallel_for(BlockedRange(size_t(0), keys.size()),
+      [&](const BlockedRange& range) -> void {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+          uint64_t block = block_(keys[i], header.numBlocks) * WordsPerBlock;
+          uint64_t bits = sailfish::kmers::hashWord(keys[i], BitSeed);
+          for (uint64_t j = 0; j < header.numHashes; ++j, bits >>= 9) {
+            words[block + ((bits & 511) >> 6)].fetch_or(uint64_t(1) << (bits & 63));
+          }
+        }
+    });
+
+    std::vector<char> packed(HeaderBytes + words.size() * sizeof(uint64_t), 0);
+    std::memcpy(&packed[0], &header, sizeof(header));
+    uint64_t* blocks = reinterpret_cast<uint64_t*>(&packed[HeaderBytes]);
+    for (size_t w = 0; w < words.size(); ++w) { blocks[w] = words[w].load(); }
+    return packed;
+   }
+
+   /**
+   *  False if key is certainly not one of the keys the filter was built
+   *  over; true if it (probably) is.
+   **/
+   template <typename Key>
+   static inline bool mayContain(const char* packed, Key key) {
+    const Header* header = reinterpret_cast<const Header*>(packed);
+    const uint64_t* block = reinterpret_cast<const uint64_t*>(packed + HeaderBytes) + 
+                            block_(key, header->numBlocks) * WordsPerBlock;
+    uint64_t bits = sailfish::kmers::hashWord(key, BitSeed);
+    bool present{true};
+    for (uint64_t j = 0; j < header->numHashes; ++j, bits >>= 9) {
+      present &= ((block[(bits & 511) >> 6] >> (bits & 63)) & 1) != 0;
+    }
+    return present;
+   }
+
+   // prefetch the block that key falls into
+   template <typename Key>
+   static inline void prefetch(const char* packed, Key key) {
+    const Header* header = reinterpret_cast<const Header*>(packed);
+    const uint64_t* blocks = reinterpret_cast<const uint64_t*>(packed + HeaderBytes);
+    __builtin_prefetch(blocks + block_(key, header->numBlocks) * WordsPerBlock);
+   }
+
+  private:
+   // seeds unrelated to those used by KmerMPHF's levels
+   static constexpr uint64_t BlockSeed = 0xD6E8FEB86659FD93ULL;
+   static constexpr uint64_t BitSeed = 0xA0761D6478BD642FULL;
+
+   // The block that key falls into
+   template <typename Key>
+   static inline uint64_t block_(Key key, uint64_t numBlocks) {
+    uint64_t h = sailfish::kmers::hashWord(key, BlockSeed);
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(h) * numBlocks) >> 64);
+   }
+};
+
+#endif // BLOCKED_BLOOM_FILTER_HPP
@@ -32,6 +32,7 @@
 #include <unordered_set>
 #include <mutex>
 #include <thread>
+#include <future>
 #include <sstream>
 #include <exception>
 #include <random>
@@ -737,12 +738,13 @@ private:
    * This function should be called before performing any optimization procedure.
    * It builds all of the necessary data-structures which are used during the transcript
    * quantification procedure.
-   * @param  klutfname [The name of the file containing the kmer lookup table.]
-   * @param  tlutfname [The name of the file containing the transcript lookup table.]
+   * @param  klut [The kmer lookup table, which may still be loading.]
+   * @param  transcriptLengths [The transcript lengths from the transcript lookup table,
+   *                            which may still be loading.]
    */
     void initialize_(
-        const std::string& klutfname,
-        const std::string& tlutfname,
+        std::future<KmerIDMap>& klut,
+        std::future<std::vector<LUTTools::Length>>& transcriptLengths,
         const bool discardZeroCountKmers) {
 
         // So we can concisely identify each transcript
@@ -772,16 +774,16 @@ private:
         );
         */
 
-        // Get the kmer look-up-table from file
-        LUTTools::readKmerLUT(klutfname, transcriptsForKmer_);
-
         boost::dynamic_bitset<> isActiveKmer(numKmers);
 
-        for (auto kid : boost::irange(size_t{0}, numKmers)) {
-          if ( !discardZeroCountKmers or readHash_.atIndex(kid) != 0) {
-            isActiveKmer[kid] = 1;
-          }
+        if (discardZeroCountKmers) {
+          readHash_.forEachNonzero([&isActiveKmer](size_t kid) -> void { isActiveKmer[kid] = 1; });
+        } else {
+          isActiveKmer.set();
         }
+
+        // Wait for the kmer look-up-table
+        transcriptsForKmer_ = klut.get();
         // DYNAMIC_BITSET is *NOT* concurrent?!?!
         // determine which kmers are active
         // tbb::parallel_for(size_t(0), numKmers, 
@@ -799,17 +801,22 @@ private:
         kmerGroupBiases_.resize(transcriptsForKmer_.size(), 1.0);
 
         // Get transcript lengths
-        std::ifstream ifile(tlutfname, std::ios::binary);
-        size_t numRecords {0};
-        ifile.read(reinterpret_cast<char *>(&numRecords), sizeof(numRecords));
-        std::cerr << "Transcript LUT contained " << numRecords << " records\n";
-        for (auto i : boost::irange(size_t(0), numRecords)) {
-            auto ti = LUTTools::readTranscriptInfo(ifile);
-            // copy over the length, then we're done.
-            transcripts_[ti->transcriptID].length = ti->length;
-            transcripts_[ti->transcriptID].effectiveLength = ti->length - merSize + 1;
+        auto lengths = transcriptLengths.get();
+        std::cerr << "Transcript LUT contained " << lengths.size() << " records\n";
+        // A transcript with no record in the LUT has a length of 0 there; it keeps
+        // a length (and effective length) of 0, so its mean is never computed.
+        size_t numMissing {0};
+        for (auto tid : boost::irange(size_t(0), transcripts_.size())) {
+            if (tid >= lengths.size() or lengths[tid] == 0) { ++numMissing; continue; }
+            transcripts_[tid].length = lengths[tid];
+            // a transcript shorter than a kmer still has (at least) one position
+            transcripts_[tid].effectiveLength =
+                std::max(static_cast<int64_t>(lengths[tid]) - static_cast<int64_t>(merSize) + 1, int64_t(1));
+        }
+        if (numMissing > 0) {
+            std::cerr << "WARNING: the transcript LUT has no length for " << numMissing
+                      << " of " << transcripts_.size() << " transcripts; they will not be quantified\n";
         }
-        ifile.close();
         // --- done ---
 
        // tbb::parallel_for( size_t(0), size_t(transcripts_.size()),
@@ -853,7 +860,7 @@ private:
             for (auto tid = range.begin(); tid != range.end(); ++tid) {
               auto& ti = this->transcripts_[tid];
               for (auto& binmer : ti.binMers) {
-                if (binmer.second > promiscuousKmerCutoff_) {
+                if (binmer.second > promiscuousKmerCutoff_ and ti.effectiveLength > 1) {
                   ti.effectiveLength -= 1.0;
                 }
               }
@@ -867,7 +874,9 @@ private:
         std::for_each( genePromiscuousKmers_.begin(), genePromiscuousKmers_.end(),
             [this]( KmerID kmerId ) -> void { 
                 for ( auto tid : transcriptsForKmer_[kmerId] ) {
-                    transcripts_[tid].effectiveLength -= 1.0;
+                    if (transcripts_[tid].effectiveLength > 1) {
+                        transcripts_[tid].effectiveLength -= 1.0;
+                    }
                 }
             });
 
@@ -1065,9 +1074,29 @@ public:
                            const std::string& tlutfname,
                            size_t numIt, 
                            double minMean) {
+        auto klut = std::async(std::launch::async, [&klutfname]() -> KmerIDMap {
+            KmerIDMap transcriptsForKmer;
+            LUTTools::readKmerLUT(klutfname, transcriptsForKmer);
+            return transcriptsForKmer;
+        });
+        auto transcriptLengths = std::async(std::launch::async, [&tlutfname]() -> std::vector<LUTTools::Length> {
+            return LUTTools::readTranscriptLengths(tlutfname);
+        });
+        return optimize(klut, transcriptLengths, numIt, minMean);
+    }
+
+    /**
+     * Optimize with lookup tables that are (possibly) still being loaded; the
+     * solver starts building its structures from the read counts, and waits
+     * for each table only when it needs it.
+     */
+    KmerQuantity optimize(std::future<KmerIDMap>& klut,
+                           std::future<std::vector<LUTTools::Length>>& transcriptLengths,
+                           size_t numIt, 
+                           double minMean) {
 
         const bool discardZeroCountKmers = true;
-        initialize_(klutfname, tlutfname, discardZeroCountKmers);
+        initialize_(klut, transcriptLengths, discardZeroCountKmers);
 
         KmerQuantity globalError {0.0};
         bool done {false};
@@ -0,0 +1,132 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef COMPACT_COUNTS_HPP
+#define COMPACT_COUNTS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "tbb/concurrent_hash_map.h"
+#include "HugePageAllocator.hpp"
+
+/**
+*  An array of counters, each a single CellT (uint8_t or uint16_t) wide.
+*  Nearly all kmer counts are 0 or small, so they fit in a cell; a cell
+*  that would overflow instead saturates at its maximum value, and the part
+*  of the count beyond that maximum is kept in a (concurrent) overflow map.
+*  The count of i is therefore cell i if that is below the maximum, and the
+*  maximum plus the overflow of i otherwise.
+*
+*  Counters may be incremented concurrently by any number of threads.
+**/
+template <typename CellT>
+class CompactCountsT {
+  using Cell = std::atomic<CellT>;
+  using CellVector = std::vector<Cell, sailfish::HugePageAllocator<Cell>>;
+  using OverflowMap = tbb::concurrent_hash_map<size_t, uint32_t>;
+
+  public:
+   static constexpr CellT Saturated = std::numeric_limits<CellT>::max();
+   static constexpr uint32_t CellBits = 8 * sizeof(CellT);
+
+   explicit CompactCountsT(size_t numCounts = 0) : cells_(numCounts), overflow_(new OverflowMap) {}
+
+   CompactCountsT(CompactCountsT&& other) = default;
+   CompactCountsT& operator=(CompactCountsT&& other) = default;
+
+   inline size_t size() const { return cells_.size(); }
+
+   inline uint32_t get(size_t i) const {
+    CellT c = cells_[i].load(std::memory_order_relaxed);
+    if (c != Saturated) { return c; }
+    OverflowMap::const_accessor a;
+    return overflow_->find(a, i) ? Saturated + a->second : Saturated;
+   }
+
+   // add amt to count i
+   inline void add(size_t i, uint32_t amt = 1) {
+    CellT cur = cells_[i].load(std::memory_order_relaxed);
+    while (cur != Saturated) {
+      uint32_t next = static_cast<uint32_t>(cur) + amt;
+      CellT cell = (next < Saturated) ? static_cast<CellT>(next) : Saturated;
+      if (cells_[i].compare_exchange_weak(cur, cell, std::memory_order_relaxed)) {
+        if (next <= Saturated) { return; }
+        amt = next - Saturated;
+        break;
+      }
+    }
+    addOverflow_(i, amt);
+   }
+
+   // add amt to count i, which no other thread writes (see PartitionedCounts)
+   inline void addOwned(size_t i, uint32_t amt = 1) {
+    CellT cur = cells_[i].load(std::memory_order_relaxed);
+    if (cur == Saturated) { addOverflow_(i, amt); return; }
+    uint32_t next = static_cast<uint32_t>(cur) + amt;
+    cells_[i].store((next < Saturated) ? static_cast<CellT>(next) : Saturated, std::memory_order_relaxed);
+    if (next > Saturated) { addOverflow_(i, next - Saturated); }
+   }
+
+   inline const char* data() const { return reinterpret_cast<const char*>(cells_.data()); }
+   inline char* data() { return reinterpret_cast<char*>(cells_.data()); }
+   inline size_t bytes() const { return sizeof(Cell) * cells_.size(); }
+
+   // The (id, overflow) pairs of the saturated counts, sorted by id
+   std::vector<std::pair<uint64_t, uint32_t>> overflow() const {
+    std::vector<std::pair<uint64_t, uint32_t>> entries(overflow_->begin(), overflow_->end());
+    std::sort(entries.begin(), entries.end());
+    return entries;
+   }
+
+   // Set the overflow of count i, whose cell must be saturated
+   void setOverflow(size_t i, uint32_t amt) {
+    OverflowMap::accessor a;
+    overflow_->insert(a, i);
+    a->second = amt;
+   }
+
+  private:
+   inline void addOverflow_(size_t i, uint32_t amt) {
+    if (amt == 0) { return; }
+    OverflowMap::accessor a;
+    overflow_->insert(a, i);
+    a->second += amt;
+   }
+
+   static_assert(sizeof(Cell) == sizeof(CellT), "counter cells must be packed");
+
+   CellVector cells_;
+   // held by pointer, since the map itself can't be moved
+   std::unique_ptr<OverflowMap> overflow_;
+};
+
+template <typename CellT> constexpr CellT CompactCountsT<CellT>::Saturated;
+template <typename CellT> constexpr uint32_t CompactCountsT<CellT>::CellBits;
+
+#endif // COMPACT_COUNTS_HPP
@@ -0,0 +1,297 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef COMPRESSED_FILE_HPP
+#define COMPRESSED_FILE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "zlib.h"
+#ifdef HAVE_ZSTD
+#include "zstd.h"
+#endif
+
+namespace sailfish {
+namespace compressed {
+
+/**
+*  A container for (large) index files that are read from slow, e.g.
+*  network, storage.  The contents of the original file are split into
+*  frames of FrameSize bytes, each of which is compressed on its own, so that
+*  they can be decompressed in parallel.  The container begins with a
+*  Header, followed by a table with a FrameInfo for each frame, and then the
+*  compressed frames themselves.  Since the header records the size of the
+*  original file, and the table the position of every frame within it, the
+*  whole file can be decompressed straight into a single buffer.
+*
+*  Frames are compressed with zstd when Sailfish is built with it, and with
+*  zlib otherwise.
+**/
+enum class Codec : uint32_t { ZLIB = 0, ZSTD = 1 };
+
+struct Header {
+  // "SFZIP" followed by the format version; none of the uncompressed
+  // formats begins with these bytes
+  static constexpr uint64_t Magic = 0x00000150495A4653ULL;
+  static constexpr uint64_t FrameSize = uint64_t(1) << 22;
+
+  uint64_t magic;
+  uint32_t codec;
+  uint32_t reserved;
+  uint64_t rawSize;
+  uint64_t numFrames;
+};
+
+struct FrameInfo {
+  // the position of the compressed frame within the container
+  uint64_t offset;
+  uint64_t compressedSize;
+  uint64_t rawSize;
+};
+
+#ifdef HAVE_ZSTD
+constexpr Codec DefaultCodec = Codec::ZSTD;
+#else
+constexpr Codec DefaultCodec = Codec::ZLIB;
+#endif
+
+inline const char* codecName(Codec codec) { return (codec == Codec::ZSTD) ? "zstd" : "zlib"; }
+
+inline bool isCompressed(const char* base, size_t size) {
+  return size >= sizeof(Header) and reinterpret_cast<const Header*>(base)->magic == Header::Magic;
+}
+
+// Compress the n bytes at src into a frame of its own
+inline std::vector<char> compressFrame(Codec codec, const char* src, size_t n) {
+  std::vector<char> frame;
+  if (codec == Codec::ZSTD) {
+#ifdef HAVE_ZSTD
+    frame.resize(ZSTD_compressBound(n));
+    size_t size = ZSTD_compress(&frame[0], frame.size(), src, n, 9);
+    if (ZSTD_isError(size)) { throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(size)); }
+    frame.resize(size);
+#else
+    throw std::runtime_error("Sailfish was built without zstd support");
+#endif
+  } else {
+    uLongf size = compressBound(n);
+    frame.resize(size);
+    if (compress2(reinterpret_cast<Bytef*>(&frame[0]), &size, 
+                  reinterpret_cast<const Bytef*>(src), n, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      throw std::runtime_error("zlib could not compress a frame");
+    }
+    frame.resize(size);
+  }
+  return frame;
+}
+
+// Decompress a frame into dst, which has room for exactly the frame's raw size
+inline void decompressFrame(Codec codec, const char* src, const FrameInfo& info, char* dst) {
+  if (codec == Codec::ZSTD) {
+#ifdef HAVE_ZSTD
+    size_t size = ZSTD_decompress(dst, info.rawSize, src, info.compressedSize);
+    if (ZSTD_isError(size) or size != info.rawSize) { throw std::runtime_error("corrupt zstd frame"); }
+#else
+    throw std::runtime_error("this file is compressed with zstd, but Sailfish was built without it");
+#endif
+  } else {
+    uLongf size = info.rawSize;
+    if (uncompress(reinterpret_cast<Bytef*>(dst), &size, 
+                   reinterpret_cast<const Bytef*>(src), info.compressedSize) != Z_OK or 
+        size != info.rawSize) {
+      throw std::runtime_error("corrupt zlib frame");
+    }
+  }
+}
+
+// The size of the original file's frame f, in a container whose original file is rawSize bytes
+inline uint64_t frameRawSize(uint64_t rawSize, uint64_t f) {
+  const uint64_t frameSize = Header::FrameSize;
+  return std::min(frameSize, rawSize - f * frameSize);
+}
+
+/**
+*  The size of the original file held in the container at base (of the
+*  given size).  This checks that the container is whole first: its frame
+*  table must fit in it, each frame must lie within it, and the frames must
+*  cover the original file exactly, i.e. every frame but the last holds
+*  FrameSize bytes, and the last holds the rest.  Throws if it isn't.
+**/
+inline uint64_t rawSize(const char* base, size_t size) {
+  if (size < sizeof(Header)) { throw std::runtime_error("truncated compressed file header"); }
+  const Header* header = reinterpret_cast<const Header*>(base);
+  if (header->magic != Header::Magic) { throw std::runtime_error("not a compressed file"); }
+  if (header->codec != static_cast<uint32_t>(Codec::ZLIB) and header->codec != static_cast<uint32_t>(Codec::ZSTD)) {
+    throw std::runtime_error("unknown codec " + std::to_string(header->codec));
+  }
+  // (written so that it can't overflow)
+  if (header->numFrames > (size - sizeof(Header)) / sizeof(FrameInfo)) {
+    throw std::runtime_error("truncated compressed file");
+  }
+  const uint64_t frameSize = Header::FrameSize;
+  uint64_t numFrames = header->rawSize / frameSize + (header->rawSize % frameSize != 0);
+  if (header->numFrames != numFrames) {
+    throw std::runtime_error("the frames of the compressed file don't cover the original");
+  }
+  const FrameInfo* frames = reinterpret_cast<const FrameInfo*>(base + sizeof(Header));
+  for (uint64_t f = 0; f < numFrames; ++f) {
+    const FrameInfo& info = frames[f];
+    if (info.rawSize != frameRawSize(header->rawSize, f)) {
+      throw std::runtime_error("frame " + std::to_string(f) + " of the compressed file has the wrong size");
+    }
+    if (info.offset > size or info.compressedSize > size - info.offset) {
+      throw std::runtime_error("truncated compressed file");
+    }
+  }
+  return header->rawSize;
+}
+
+/**
+*  Decompress the container at base (of the given size) into out, which must
+*  have room for rawSize(base, size) bytes, using numThreads threads.
+**/
+inline void decompress(const char* base, size_t size, char* out, uint32_t numThreads) {
+  rawSize(base, size);
+  const Header* header = reinterpret_cast<const Header*>(base);
+  const FrameInfo* frames = reinterpret_cast<const FrameInfo*>(base + sizeof(Header));
+  Codec codec = static_cast<Codec>(header->codec);
+
+  std::atomic<uint64_t> nextFrame{0};
+  std::vector<std::exception_ptr> errors(numThreads);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < numThreads; ++t) {
+    threads.emplace_back([&, t]() -> void {
+      try {
+        for (uint64_t f = nextFrame++; f < header->numFrames; f = nextFrame++) {
+          const FrameInfo& info = frames[f];
+          decompressFrame(codec, base + info.offset, info, out + f * Header::FrameSize);
+        }
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  for (auto& t : threads) { t.join(); }
+  for (auto& e : errors) { if (e) { std::rethrow_exception(e); } }
+}
+
+/**
+*  Read the first n bytes of the original file held in the (compressed)
+*  file fname into out; only the first frame is decompressed.  Returns the
+*  number of bytes read.  Like decompress, this throws if the sizes that
+*  the container records for the frame don't fit in it.
+**/
+inline size_t readPrefix(const std::string& fname, char* out, size_t n) {
+  FILE* in = fopen(fname.c_str(), "r");
+  if (in == nullptr) { throw std::runtime_error("could not open " + fname); }
+  struct stat st;
+  uint64_t fileSize = (fstat(fileno(in), &st) == 0) ? st.st_size : 0;
+  Header header;
+  FrameInfo info;
+  std::vector<char> compressed, frame;
+  bool ok = fread(&header, sizeof(header), 1, in) == 1 and header.magic == Header::Magic and 
+            header.numFrames > 0 and fread(&info, sizeof(info), 1, in) == 1;
+  if (ok and (info.rawSize != frameRawSize(header.rawSize, 0) or 
+              info.offset > fileSize or info.compressedSize > fileSize - info.offset)) {
+    fclose(in);
+    throw std::runtime_error(fname + " is a corrupt compressed file");
+  }
+  if (ok) {
+    compressed.resize(info.compressedSize);
+    frame.resize(info.rawSize);
+    ok = fseek(in, info.offset, SEEK_SET) == 0 and
+         fread(compressed.data(), 1, compressed.size(), in) == compressed.size();
+  }
+  fclose(in);
+  if (!ok) { return 0; }
+  decompressFrame(static_cast<Codec>(header.codec), compressed.data(), info, frame.data());
+  size_t numRead = std::min(n, frame.size());
+  std::memcpy(out, frame.data(), numRead);
+  return numRead;
+}
+
+/**
+*  Compress the size bytes at src (the contents of some file) into the
+*  container, written to fname, using numThreads threads.  Returns the size
+*  of the container.
+**/
+inline uint64_t compress(const char* src, size_t size, const std::string& fname, 
+                         uint32_t numThreads, Codec codec = DefaultCodec) {
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = Header::Magic;
+  header.codec = static_cast<uint32_t>(codec);
+  header.rawSize = size;
+  header.numFrames = (size + Header::FrameSize - 1) / Header::FrameSize;
+
+  std::vector<std::vector<char>> frames(header.numFrames);
+  std::atomic<uint64_t> nextFrame{0};
+  std::vector<std::exception_ptr> errors(numThreads);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < numThreads; ++t) {
+    threads.emplace_back([&, t]() -> void {
+      try {
+        for (uint64_t f = nextFrame++; f < header.numFrames; f = nextFrame++) {
+          frames[f] = compressFrame(codec, src + f * Header::FrameSize, frameRawSize(size, f));
+        }
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  for (auto& t : threads) { t.join(); }
+  for (auto& e : errors) { if (e) { std::rethrow_exception(e); } }
+
+  std::vector<FrameInfo> table(header.numFrames);
+  uint64_t offset = sizeof(Header) + sizeof(FrameInfo) * header.numFrames;
+  for (uint64_t f = 0; f < header.numFrames; ++f) {
+    table[f].offset = offset;
+    table[f].compressedSize = frames[f].size();
+    table[f].rawSize = frameRawSize(size, f);
+    offset += frames[f].size();
+  }
+
+  FILE* out = fopen(fname.c_str(), "w");
+  if (out == nullptr) { throw std::runtime_error("could not open " + fname + " for writing"); }
+  fwrite(&header, sizeof(header), 1, out);
+  if (header.numFrames > 0) { fwrite(table.data(), sizeof(FrameInfo), table.size(), out); }
+  for (auto& frame : frames) { fwrite(frame.data(), 1, frame.size(), out); }
+  if (fclose(out) != 0) { throw std::runtime_error("could not write " + fname); }
+  return offset;
+}
+
+}
+}
+
+#endif // COMPRESSED_FILE_HPP
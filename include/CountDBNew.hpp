@@ -28,58 +28,217 @@
 #include <fstream>
 #include <limits>
 #include <algorithm>
+#include <cmath>
 #include <memory>
+#include <thread>
+#include <cstring>
+#include <stdexcept>
+#include <string>
 
 #include <sys/mman.h>
 
 #include "tbb/concurrent_hash_map.h"
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
 #include "PerfectHashIndex.hpp"
+#include "HugePageAllocator.hpp"
+#include "CompactCounts.hpp"
+#include "ParallelRead.hpp"
+#include "KmerWord.hpp"
+
+/**
+*  The header of a counts (.sfc) file written from compact counts, or in
+*  the sparse encoding.  With the dense encoding, it is followed by the
+*  numCounts cells, each cellBits wide.  With the sparse encoding, it is
+*  followed by
+*
+*    - the number of nonzero counts and the size of the id list in bytes
+*      (each a uint64_t)
+*    - for every block of SparseBlockSize nonzero counts, the id of its
+*      first count and the offset of the block in the id list (uint64_t's)
+*    - the id list: the ids of the nonzero counts, in increasing order, as
+*      LEB128 varints of the difference from the previous id (or from the
+*      first id of the block)
+*    - the cells of the nonzero counts, each cellBits wide
+*
+*  Either way, the cells are followed by numOverflow (id, overflow) pairs
+*  of uint64_t, sorted by id, for the saturated cells of compact counts.
+*
+*  A counts file with 32-bit counters has no header; it holds the total read
+*  length and the number of reads (each a uint64_t), followed by a uint32_t
+*  count per kmer id.  Since its size is exactly determined by the number of
+*  kmers, it can't be confused with a compact file even if the read length
+*  happens to equal the magic number.
+**/
+struct SFCHeader {
+  // "SFCNT" followed by the format version
+  static constexpr uint64_t Magic = 0x000001544E434653ULL;
+  // the encodings of the cells
+  static constexpr uint32_t Dense = 0;
+  static constexpr uint32_t Sparse = 1;
+  static constexpr uint64_t SparseBlockSize = 1 << 16;
+
+  uint64_t magic;
+  uint64_t length;
+  uint64_t numLengths;
+  uint64_t numCounts;
+  uint32_t cellBits;
+  uint32_t encoding;
+  uint64_t numOverflow;
+};
 
 /**
 *  This class provides low-overhead access to the counts of various
 *  kmers in a hash-like format (though internally it is represented)
-*  without hashing.
+*  without hashing.  The kmers are packed into words of type KmerT (see
+*  KmerWord.hpp); CountDBNew (below) holds the counts of kmers of up to 32
+*  bases.
+*
+*  By default, the counts are kept in an array of their own, indexed by the
+*  kmer ids of the index; counting a kmer then touches the perfect hash, the
+*  index's key array and the count array.  With the interleaved layout, each
+*  slot holds a copy of the key (or of its fingerprint, for an index of
+*  fingerprints) next to its counter, so that verifying a lookup and
+*  incrementing the count touch a single cache line.  The layout is purely
+*  internal: the interface, and the file written by dumpCountsToFile, are
+*  the same either way.
+*
+*  Alternatively, the counts can be kept in 8- or 16-bit cells that
+*  saturate into an overflow map (see CompactCounts.hpp), which cuts the
+*  memory the counters occupy (and the size of the counts file) by 2-4x;
+*  the counts themselves are the same.  Independently of how the counts are
+*  kept, they can be written in a sparse encoding, which stores just the
+*  nonzero counts (see SFCHeader).
 **/
-class CountDBNew {
-  using Kmer = uint64_t;
+template <typename KmerT>
+class CountDBNewT {
+  using Kmer = KmerT;
+  using Index = PerfectHashIndexT<KmerT>;
   using Count = uint32_t;
   using AtomicCount = std::atomic<Count>;
   using Length = uint64_t;
   using AtomicLength = std::atomic<Length>;
   using AtomicLengthCount = std::atomic<Length>;
+  using CountVector = std::vector<AtomicCount, sailfish::HugePageAllocator<AtomicCount>>;
+
+  // The slots of the interleaved layout; both kinds evenly divide a cache line
+  struct KeySlot { Kmer key; AtomicCount count; };
+  struct FingerprintSlot { uint32_t fingerprint; AtomicCount count; };
+  using KeySlotVector = std::vector<KeySlot, sailfish::HugePageAllocator<KeySlot>>;
+  using FingerprintSlotVector = std::vector<FingerprintSlot, sailfish::HugePageAllocator<FingerprintSlot>>;
+
+  enum class Layout { SEPARATE, KEYS, FINGERPRINTS, COMPACT8, COMPACT16 };
 
   public:
    // We'll return this invalid id if a kmer is not found in our DB
    size_t INVALID = std::numeric_limits<size_t>::max();
 
-   CountDBNew( std::shared_ptr<PerfectHashIndex>& index ) : 
-      index_(index), counts_( std::vector< AtomicCount >( index->numKeys() ) ),
-      length_(0), numLengths_(0) {}
+   /**
+   *  Counts for the kmers of index.  If interleaved is true, the counts are
+   *  stored in the interleaved layout (described above); this costs a
+   *  second copy of the keys.  Dense and Elias-Fano indices have no keys to
+   *  verify, so their counts are always stored separately.  If countBits is
+   *  8 or 16, the counts are stored in compact cells of that width instead
+   *  (and interleaved is ignored).
+   **/
+   CountDBNewT( std::shared_ptr<Index>& index, bool interleaved = false, uint32_t countBits = 32 ) : 
+      index_(index), layout_(layoutFor_(*index, interleaved, countBits)),
+      counts_( (layout_ == Layout::SEPARATE) ? index->numKeys() : 0 ),
+      keySlots_( (layout_ == Layout::KEYS) ? index->numKeys() : 0 ),
+      fingerprintSlots_( (layout_ == Layout::FINGERPRINTS) ? index->numKeys() : 0 ),
+      compact8_( (layout_ == Layout::COMPACT8) ? index->numKeys() : 0 ),
+      compact16_( (layout_ == Layout::COMPACT16) ? index->numKeys() : 0 ),
+      fingerprintMask_(0), length_(0), numLengths_(0), haveNonzeroIds_(false) {
+    static_assert(64 % sizeof(KeySlot) == 0 and 64 % sizeof(FingerprintSlot) == 0,
+                  "interleaved slots must not straddle cache lines");
+    size_t numKeys = index->numKeys();
+    if (layout_ == Layout::KEYS) {
+      const Kmer* keys = index->kmers();
+      for (size_t i = 0; i < numKeys; ++i) { keySlots_[i].key = keys[i]; }
+    } else if (layout_ == Layout::FINGERPRINTS) {
+      uint32_t bits = index->fingerprintBits();
+      fingerprintMask_ = (bits == 32) ? std::numeric_limits<uint32_t>::max() : ((uint32_t(1) << bits) - 1);
+      for (size_t i = 0; i < numKeys; ++i) { fingerprintSlots_[i].fingerprint = index->storedFingerprint(i); }
+    }
+   }
 
-   CountDBNew( CountDBNew&& other ) {
+   CountDBNewT( CountDBNewT&& other ) {
     counts_ = std::move(other.counts_);
+    keySlots_ = std::move(other.keySlots_);
+    fingerprintSlots_ = std::move(other.fingerprintSlots_);
+    compact8_ = std::move(other.compact8_);
+    compact16_ = std::move(other.compact16_);
+    layout_ = other.layout_;
+    fingerprintMask_ = other.fingerprintMask_;
     index_ = other.index_;
     length_ = other.length_.load();
     numLengths_ = other.numLengths_.load();
+    nonzeroIds_ = std::move(other.nonzeroIds_);
+    haveNonzeroIds_ = other.haveNonzeroIds_;
    }
 
-   static CountDBNew fromFile( const std::string& fname, std::shared_ptr<PerfectHashIndex>& index ) {
+   /**
+   *  Load the counts written by dumpCountsToFile.  The counts are read by
+   *  numThreads threads, in parallel chunks; compact counts are loaded into
+   *  compact cells of the same width.
+   **/
+   static CountDBNewT fromFile( const std::string& fname, std::shared_ptr<Index>& index,
+                                uint32_t numThreads = 1 ) {
     std::ifstream in(fname, std::ios::in | std::ios::binary );
+    if (!in.good()) { throw std::runtime_error("could not open " + fname); }
+    in.seekg(0, std::ios::end);
+    uint64_t fileSize = in.tellg();
+    in.seekg(0, std::ios::beg);
 
-    // Read in the total read length and # of reads
-    uint64_t length = 0;
-    uint64_t numLengths = 0;
-    in.read(reinterpret_cast<char*>(&length), sizeof(length));
-    in.read(reinterpret_cast<char*>(&numLengths), sizeof(numLengths));
+    size_t numKeys = index->numKeys();
+    uint64_t legacySize = 2 * sizeof(uint64_t) + sizeof(Count) * numKeys;
+    SFCHeader header;
+    std::memset(&header, 0, sizeof(header));
+    in.read(reinterpret_cast<char*>(&header), std::min(fileSize, uint64_t(sizeof(header))));
+    bool compact = (header.magic == SFCHeader::Magic and fileSize != legacySize);
 
+    uint64_t length = compact ? header.length : header.magic;
+    uint64_t numLengths = compact ? header.numLengths : header.length;
     std::cerr << "read length = " << length << ", numLengths = " << numLengths << "\n";
-    // Read in the count vector
-    std::vector<AtomicCount> counts(index->numKeys());
-    in.read( reinterpret_cast<char*>(&counts[0]), sizeof(AtomicCount) * index->numKeys() );
-    in.close();
 
-    CountDBNew cdb(index);
-    cdb.counts_ = std::move(counts);
+    if (!compact) {
+      in.close();
+      // Read in the count vector
+      CountDBNewT cdb(index);
+      sailfish::preadParallel(fname, 2 * sizeof(uint64_t), 
+                              reinterpret_cast<char*>(cdb.counts_.data()), 
+                              sizeof(AtomicCount) * numKeys, numThreads);
+      cdb.length_ = length;
+      cdb.numLengths_ = numLengths;
+      return cdb;
+    }
+
+    if (header.numCounts != numKeys or 
+        (header.cellBits != 8 and header.cellBits != 16 and header.cellBits != 32) or
+        (header.cellBits == 32 and header.numOverflow > 0)) {
+      throw std::runtime_error(fname + " does not hold counts for this index");
+    }
+    CountDBNewT cdb(index, false, header.cellBits);
+    if (header.encoding == SFCHeader::Sparse) {
+      cdb.readSparse_(fname, in, numThreads);
+    } else {
+      size_t cellBytes = cdb.slotBytes_() * numKeys;
+      sailfish::preadParallel(fname, sizeof(header), const_cast<char*>(cdb.slotAddress_(0)), cellBytes, numThreads);
+      in.seekg(sizeof(header) + cellBytes);
+    }
+    // and then the overflow of the saturated cells
+    for (uint64_t i = 0; i < header.numOverflow; ++i) {
+      uint64_t entry[2];
+      in.read(reinterpret_cast<char*>(entry), sizeof(entry));
+      if (!in.good() or entry[0] >= numKeys) {
+        throw std::runtime_error(fname + " has a corrupt overflow table");
+      }
+      if (header.cellBits == 8) { 
+        cdb.compact8_.setOverflow(entry[0], entry[1]); 
+      } else { 
+        cdb.compact16_.setOverflow(entry[0], entry[1]); 
+      }
+    }
     cdb.length_ = length;
     cdb.numLengths_ = numLengths;
     return cdb;
@@ -97,70 +256,421 @@ class CountDBNew {
    inline Length totalLength() { return length_.load(); }
    inline Length numLengths() { return numLengths_.load(); } 
 
-   inline size_t id(Kmer k) { return index_->index(k); }
+   /**
+   *  Add the counts, and the read lengths, of other (which must count the
+   *  kmers of the same index) to these counts, in parallel.  When both hold
+   *  plain 32-bit counts, this is a (vectorizable) sum of the two arrays;
+   *  counts loaded from a sparse file add just their nonzero counts.
+   **/
+   void addCounts(CountDBNewT& other) {
+    if (other.size() != size()) {
+      throw std::invalid_argument("can't add counts of " + std::to_string(other.size()) + 
+                                  " kmers to counts of " + std::to_string(size()));
+    }
+    length_ += other.length_.load();
+    numLengths_ += other.numLengths_.load();
+    typedef tbb::blocked_range<size_t> Range;
+    const size_t grainSize = 1 << 16;
+    if (other.haveNonzeroIds_) {
+      auto& ids = other.nonzeroIds_;
+      tbb::parallel_for(Range(0, ids.size(), grainSize), [&](const Range& r) -> void {
+        for (size_t i = r.begin(); i != r.end(); ++i) { add_(ids[i], other.count_(ids[i])); }
+      });
+    } else if (layout_ == Layout::SEPARATE and other.layout_ == Layout::SEPARATE) {
+      // the ranges are disjoint, so the counters needn't be updated atomically
+      Count* dst = reinterpret_cast<Count*>(counts_.data());
+      const Count* src = reinterpret_cast<const Count*>(other.counts_.data());
+      tbb::parallel_for(Range(0, size(), grainSize), [dst, src](const Range& r) -> void {
+        for (size_t i = r.begin(); i != r.end(); ++i) { dst[i] += src[i]; }
+      });
+    } else {
+      tbb::parallel_for(Range(0, size(), grainSize), [&](const Range& r) -> void {
+        for (size_t i = r.begin(); i != r.end(); ++i) {
+          Count c = other.count_(i);
+          if (c != 0) { add_(i, c); }
+        }
+      });
+    }
+   }
+
+   /**
+   *  Multiply every count, and the total and number of read lengths, by
+   *  factor (which must be at least 1), rounding to the nearest integer.
+   *  This turns the counts of a sample of the reads into estimates of the
+   *  counts of all of them.
+   **/
+   void scale(double factor) {
+    if (!(factor >= 1.0)) {
+      throw std::invalid_argument("counts can't be scaled by " + std::to_string(factor));
+    }
+    length_ = static_cast<Length>(std::llround(length_.load() * factor));
+    numLengths_ = static_cast<Length>(std::llround(numLengths_.load() * factor));
+    typedef tbb::blocked_range<size_t> Range;
+    const uint64_t maxCount = std::numeric_limits<Count>::max();
+    tbb::parallel_for(Range(0, size(), 1 << 16), [&](const Range& r) -> void {
+      for (size_t i = r.begin(); i != r.end(); ++i) {
+        uint64_t c = count_(i);
+        if (c == 0) { continue; }
+        uint64_t scaled = std::min(static_cast<uint64_t>(std::llround(c * factor)), maxCount);
+        if (scaled > c) { add_(i, scaled - c); }
+      }
+    });
+   }
+
+   /**
+   *  Call f(id) with the id of every nonzero count, in increasing order.
+   *  Counts loaded from a sparse file remember which of them were nonzero
+   *  (the counts of a loaded file are only ever read), so that this visits
+   *  just those rather than scanning every count.
+   **/
+   template <typename F>
+   void forEachNonzero(F f) {
+    if (haveNonzeroIds_) {
+      for (auto id : nonzeroIds_) { f(id); }
+      return;
+    }
+    for (size_t i = 0, n = size(); i < n; ++i) {
+      if (count_(i) != 0) { f(i); }
+    }
+   }
 
-   uint32_t operator[](uint64_t kmer) {
+   inline size_t id(Kmer k) {
+    if (!interleaved()) { return index_->index(k); }
+    size_t slot = index_->slot(k);
+    return (slot != INVALID and slotMatches_(slot, k)) ? slot : INVALID;
+   }
+
+   /**
+   *  Look up the ids of a batch of kmers, writing the id of kmers[i] (or
+   *  INVALID) into ids[i].  With the interleaved layout, the kmers are
+   *  verified against the keys stored next to the counters, which leaves
+   *  the counters that incAtIndices() is about to touch in the cache.
+   **/
+   inline void lookup(const Kmer* kmers, size_t n, size_t* ids) {
+    if (!interleaved()) { index_->index(kmers, n, ids); return; }
+    index_->slots(kmers, n, ids);
+    for (size_t i = 0; i < n; ++i) {
+      if (ids[i] != INVALID) { __builtin_prefetch(slotAddress_(ids[i]), 1); }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      ids[i] = (ids[i] != INVALID and slotMatches_(ids[i], kmers[i])) ? ids[i] : INVALID;
+    }
+   }
+
+   uint32_t operator[](Kmer kmer) {
     auto idx = id(kmer);
-    return (idx == INVALID) ? 0 : counts_[idx].load();
+    return (idx == INVALID) ? 0 : count_(idx);
    }
 
    uint32_t atIndex(size_t idx) {
-      return (idx == INVALID) ? 0 : counts_[idx].load();
+      return (idx == INVALID) ? 0 : count_(idx);
    }
 
-   std::vector<AtomicCount>::size_type size() { return counts_.size(); }
+   size_t size() { return index_->numKeys(); }
 
    // increment the count for kmer 'k' by 'amt'
    // returns true if k existed in the database and false otherwise
    inline bool inc(Kmer k, uint32_t amt=1) {
-    auto idx = index_->index(k);
+    auto idx = id(k);
     bool valid = (idx != INVALID);
-    if (valid) { counts_[idx] += amt; }
+    if (valid) { add_(idx, amt); }
     return valid;
    }
 
-   inline void incAtIndex(std::vector<AtomicCount>::size_type idx, uint32_t amt=1) {
-     counts_[idx] += amt;
+   inline void incAtIndex(size_t idx, uint32_t amt=1) {
+     add_(idx, amt);
    }
 
+   // increment the count at idx without an atomic read-modify-write; this
+   // is only safe if the calling thread is the only one that ever writes
+   // to this counter (see PartitionedCounts)
+   inline void incAtIndexOwned(size_t idx, uint32_t amt=1) {
+     switch (layout_) {
+       case Layout::COMPACT8: compact8_.addOwned(idx, amt); break;
+       case Layout::COMPACT16: compact16_.addOwned(idx, amt); break;
+       default: {
+         auto& c = counter_(idx);
+         c.store(c.load(std::memory_order_relaxed) + amt, std::memory_order_relaxed);
+       }
+     }
+   }
+
+   // increment the count of every valid id in ids[0, n); the counters are
+   // prefetched (for writing) before any of them is touched
+   inline void incAtIndices(const size_t* ids, size_t n) {
+     for (size_t i = 0; i < n; ++i) {
+       if (ids[i] != INVALID) { __builtin_prefetch(slotAddress_(ids[i]), 1); }
+     }
+     for (size_t i = 0; i < n; ++i) {
+       if (ids[i] != INVALID) { add_(ids[i], 1); }
+     }
+   }
+
+   inline bool interleaved() { return layout_ == Layout::KEYS or layout_ == Layout::FINGERPRINTS; }
+
+   // The width of each counter, in bits
+   inline uint32_t countBits() {
+     switch (layout_) {
+       case Layout::COMPACT8: return 8;
+       case Layout::COMPACT16: return 16;
+       default: return 32;
+     }
+   }
+
+   /**
+   *  Touch the pages of the counts that belong to thread threadIdx (of
+   *  numThreads).  The counters were all written (zeroed) when they were
+   *  allocated, so they are already resident and need only be read.
+   **/
    void will_need(uint32_t threadIdx, uint32_t numThreads) {
      auto pageSize = sysconf(_SC_PAGESIZE);
-     size_t numPages{0};
-     
-     auto entriesPerPage = pageSize / sizeof(AtomicCount);
-     auto size = counts_.size();
-     numPages = (sizeof(AtomicCount) * counts_.size()) / entriesPerPage;
-     // number of pages that each thread should touch
-     auto numPagesPerThread = numPages / numThreads;
-     auto entriesPerThread = entriesPerPage * numPagesPerThread;
-     // the page this thread starts touching
-     auto start = entriesPerPage * threadIdx;
-     for (size_t i = start; i < size; i += numThreads*entriesPerPage) {
-      auto ci = counts_[i].load();
-      counts_[i] = 0;
-      counts_[i] = ci;
+     const char* base = slotAddress_(0);
+     size_t bytes = slotBytes_() * size();
+     volatile char sink{0};
+     for (size_t i = pageSize * threadIdx; i < bytes; i += numThreads * pageSize) {
+       sink = sink + base[i];
      }
    }
 
-   bool dumpCountsToFile( const std::string& fname ) {
+   // Report the kind of pages backing the counts
+   void reportBacking() {
+     sailfish::hugepages::reportBacking("counts", slotAddress_(0), slotBytes_() * size());
+   }
+
+   /**
+   *  Write the counts to fname; if sparse is true, only the nonzero counts
+   *  are written (see SFCHeader), which makes the file much smaller unless
+   *  most kmers were seen.
+   **/
+   bool dumpCountsToFile( const std::string& fname, bool sparse = false ) {
     std::ofstream counts(fname, std::ios::out | std::ios::binary );
     uint64_t length = length_.load();
     uint64_t numLengths = numLengths_.load();
+    size_t numCounts = size();
+    if (sparse or layout_ == Layout::COMPACT8 or layout_ == Layout::COMPACT16) {
+      std::vector<std::pair<uint64_t, uint32_t>> overflow;
+      if (layout_ == Layout::COMPACT8) { overflow = compact8_.overflow(); }
+      if (layout_ == Layout::COMPACT16) { overflow = compact16_.overflow(); }
+      SFCHeader header;
+      std::memset(&header, 0, sizeof(header));
+      header.magic = SFCHeader::Magic;
+      header.length = length;
+      header.numLengths = numLengths;
+      header.numCounts = numCounts;
+      header.cellBits = countBits();
+      header.encoding = SFCHeader::Dense;
+      if (sparse) { header.encoding = SFCHeader::Sparse; }
+      header.numOverflow = overflow.size();
+      counts.write(reinterpret_cast<char*>(&header), sizeof(header));
+      if (sparse) { writeSparse_(counts); } else { counts.write(slotAddress_(0), slotBytes_() * numCounts); }
+      for (auto& o : overflow) {
+        uint64_t entry[2] = {o.first, o.second};
+        counts.write(reinterpret_cast<char*>(entry), sizeof(entry));
+      }
+      counts.close();
+      return !counts.fail();
+    }
+
     counts.write(reinterpret_cast<char*>(&length), sizeof(length));
     counts.write(reinterpret_cast<char*>(&numLengths), sizeof(numLengths));
-    size_t numCounts = counts_.size();
-    counts.write( reinterpret_cast<char*>(&counts_[0]), sizeof(counts_[0]) * numCounts );
+    if (layout_ == Layout::SEPARATE) {
+      counts.write( reinterpret_cast<char*>(counts_.data()), sizeof(AtomicCount) * numCounts );
+    } else {
+      // gather the counts out of the slots, a block at a time
+      std::vector<Count> block;
+      const size_t blockSize = 1 << 16;
+      for (size_t s = 0; s < numCounts; s += blockSize) {
+        size_t e = std::min(numCounts, s + blockSize);
+        block.clear();
+        for (size_t i = s; i < e; ++i) { block.push_back(counter_(i).load()); }
+        counts.write( reinterpret_cast<char*>(&block[0]), sizeof(Count) * block.size() );
+      }
+    }
     counts.close();
+    return !counts.fail();
    }
 
    inline uint32_t kmerLength() { return index_->kmerLength(); }
-   const std::vector<Kmer>& kmers() { return index_->kmers(); }
+   const Kmer* kmers() { return index_->kmers(); }
   private:
-    std::shared_ptr<PerfectHashIndex> index_;
-    std::vector< AtomicCount > counts_;
+    /**
+    *  Write the sparse encoding of the counts (everything between the
+    *  header and the overflow table).  The cells of compact counts are
+    *  written as they are; any other counts are written as uint32_t's.
+    **/
+    void writeSparse_(std::ofstream& out) {
+      const uint64_t blockSize = SFCHeader::SparseBlockSize;
+      size_t cellBytes = countBits() / 8;
+      bool compact = (layout_ == Layout::COMPACT8 or layout_ == Layout::COMPACT16);
+      std::vector<uint64_t> blocks;
+      std::vector<uint8_t> ids;
+      std::vector<char> cells;
+      uint64_t numNonzero{0};
+      uint64_t prev{0};
+      for (size_t i = 0, n = size(); i < n; ++i) {
+        Count c = count_(i);
+        if (c == 0) { continue; }
+        if (numNonzero % blockSize == 0) {
+          blocks.push_back(i);
+          blocks.push_back(ids.size());
+          prev = i;
+        }
+        for (uint64_t delta = i - prev; ; delta >>= 7) {
+          if (delta < 0x80) { ids.push_back(static_cast<uint8_t>(delta)); break; }
+          ids.push_back(static_cast<uint8_t>(delta | 0x80));
+        }
+        prev = i;
+        const char* cell = compact ? slotAddress_(i) : reinterpret_cast<const char*>(&c);
+        cells.insert(cells.end(), cell, cell + cellBytes);
+        ++numNonzero;
+      }
+      uint64_t sizes[2] = {numNonzero, ids.size()};
+      out.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+      out.write(reinterpret_cast<const char*>(blocks.data()), sizeof(uint64_t) * blocks.size());
+      out.write(reinterpret_cast<const char*>(ids.data()), ids.size());
+      out.write(cells.data(), cells.size());
+    }
+
+    /**
+    *  Read the sparse encoding of the counts (which in is positioned at)
+    *  into these (zeroed) counts, leaving in at the overflow table.  The
+    *  blocks of ids are decoded, and their cells stored, by numThreads
+    *  threads.
+    **/
+    void readSparse_(const std::string& fname, std::ifstream& in, uint32_t numThreads) {
+      const uint64_t blockSize = SFCHeader::SparseBlockSize;
+      uint64_t sizes[2] = {0, 0};
+      in.read(reinterpret_cast<char*>(sizes), sizeof(sizes));
+      uint64_t numNonzero = sizes[0];
+      uint64_t idBytes = sizes[1];
+      size_t numKeys = size();
+      uint64_t numBlocks = (numNonzero + blockSize - 1) / blockSize;
+      if (!in.good() or numNonzero > numKeys or idBytes > 10 * numNonzero) {
+        throw std::runtime_error(fname + " has a corrupt sparse count list");
+      }
+      std::vector<uint64_t> blocks(2 * numBlocks);
+      in.read(reinterpret_cast<char*>(blocks.data()), sizeof(uint64_t) * blocks.size());
+      uint64_t bodyOffset = in.tellg();
+      size_t cellBytes = slotBytes_();
+      std::vector<char> body(idBytes + numNonzero * cellBytes);
+      sailfish::preadParallel(fname, bodyOffset, body.data(), body.size(), numThreads);
+      in.seekg(bodyOffset + body.size());
+
+      const uint8_t* idList = reinterpret_cast<const uint8_t*>(body.data());
+      const char* cells = body.data() + idBytes;
+      nonzeroIds_.resize(numNonzero);
+      std::atomic<bool> corrupt{false};
+      auto decodeBlocks = [&](uint32_t t) -> void {
+        for (uint64_t b = t; b < numBlocks and !corrupt; b += numThreads) {
+          uint64_t first = b * blockSize;
+          uint64_t last = std::min(numNonzero, first + blockSize);
+          uint64_t id = blocks[2 * b];
+          size_t pos = blocks[2 * b + 1];
+          for (uint64_t j = first; j < last; ++j) {
+            uint64_t delta{0};
+            for (uint32_t shift = 0; ; shift += 7) {
+              if (pos >= idBytes or shift > 63) { corrupt = true; return; }
+              uint8_t byte = idList[pos++];
+              delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+              if (byte < 0x80) { break; }
+            }
+            id += delta;
+            if (id >= numKeys) { corrupt = true; return; }
+            nonzeroIds_[j] = id;
+            std::memcpy(const_cast<char*>(slotAddress_(id)), cells + j * cellBytes, cellBytes);
+          }
+        }
+      };
+      numThreads = std::max(uint32_t(1), std::min(numThreads, static_cast<uint32_t>(std::max(numBlocks, uint64_t(1)))));
+      std::vector<std::thread> threads;
+      for (uint32_t t = 1; t < numThreads; ++t) { threads.emplace_back(decodeBlocks, t); }
+      decodeBlocks(0);
+      for (auto& t : threads) { t.join(); }
+      if (corrupt) { throw std::runtime_error(fname + " has a corrupt sparse count list"); }
+      haveNonzeroIds_ = true;
+    }
+
+    static Layout layoutFor_(Index& index, bool interleaved, uint32_t countBits) {
+      if (countBits == 8) { return Layout::COMPACT8; }
+      if (countBits == 16) { return Layout::COMPACT16; }
+      if (countBits != 32) {
+        throw std::invalid_argument("counts must be 8, 16 or 32 bits wide, not " + std::to_string(countBits));
+      }
+      if (!interleaved or index.hashType() == HashType::DENSE or 
+          index.hashType() == HashType::ELIAS_FANO) { return Layout::SEPARATE; }
+      return (index.kmers() != nullptr) ? Layout::KEYS : Layout::FINGERPRINTS;
+    }
+
+    // The count of the kmer with the given id
+    inline uint32_t count_(size_t idx) {
+      switch (layout_) {
+        case Layout::COMPACT8: return compact8_.get(idx);
+        case Layout::COMPACT16: return compact16_.get(idx);
+        default: return counter_(idx).load();
+      }
+    }
+
+    // Add amt to the count of the kmer with the given id
+    inline void add_(size_t idx, uint32_t amt) {
+      switch (layout_) {
+        case Layout::COMPACT8: compact8_.add(idx, amt); break;
+        case Layout::COMPACT16: compact16_.add(idx, amt); break;
+        default: counter_(idx) += amt;
+      }
+    }
+
+    // The (32-bit) counter of the kmer with the given id, wherever it is
+    // stored; compact counts have none
+    inline AtomicCount& counter_(size_t idx) {
+      switch (layout_) {
+        case Layout::SEPARATE: return counts_[idx];
+        case Layout::KEYS: return keySlots_[idx].count;
+        default: return fingerprintSlots_[idx].count;
+      }
+    }
+
+    inline const char* slotAddress_(size_t idx) {
+      switch (layout_) {
+        case Layout::SEPARATE: return reinterpret_cast<const char*>(counts_.data() + idx);
+        case Layout::KEYS: return reinterpret_cast<const char*>(keySlots_.data() + idx);
+        case Layout::COMPACT8: return compact8_.data() + idx;
+        case Layout::COMPACT16: return compact16_.data() + 2 * idx;
+        default: return reinterpret_cast<const char*>(fingerprintSlots_.data() + idx);
+      }
+    }
+
+    inline size_t slotBytes_() {
+      switch (layout_) {
+        case Layout::SEPARATE: return sizeof(AtomicCount);
+        case Layout::KEYS: return sizeof(KeySlot);
+        case Layout::COMPACT8: return sizeof(uint8_t);
+        case Layout::COMPACT16: return sizeof(uint16_t);
+        default: return sizeof(FingerprintSlot);
+      }
+    }
+
+    // Does the key (or fingerprint) stored in (interleaved) slot s match k?
+    inline bool slotMatches_(size_t s, Kmer k) {
+      if (layout_ == Layout::KEYS) { return keySlots_[s].key == k; }
+      return fingerprintSlots_[s].fingerprint == (static_cast<uint32_t>(Index::fingerprint(k)) & fingerprintMask_);
+    }
+
+    std::shared_ptr<Index> index_;
+    Layout layout_;
+    CountVector counts_;
+    KeySlotVector keySlots_;
+    FingerprintSlotVector fingerprintSlots_;
+    CompactCountsT<uint8_t> compact8_;
+    CompactCountsT<uint16_t> compact16_;
+    uint32_t fingerprintMask_;
     AtomicLength length_;
     AtomicLengthCount numLengths_;
+    // the ids of the nonzero counts, if they were loaded from a sparse file
+    std::vector<uint64_t> nonzeroIds_;
+    bool haveNonzeroIds_;
 };
 
 
+using CountDBNew = CountDBNewT<uint64_t>;
+
 #endif // COUNTDBNEW_HPP
\ No newline at end of file
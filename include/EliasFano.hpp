@@ -0,0 +1,172 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef ELIAS_FANO_HPP
+#define ELIAS_FANO_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+/**
+*  An Elias-Fano encoding of a sorted set of distinct 64-bit keys, which
+*  answers "what is the rank of key x in the set (if it's there at all)".
+*  Used as a kmer index, it replaces both the perfect hash and the key array,
+*  since the set is stored exactly and the rank of a kmer is its id.
+*
+*  Each key is split into its low lowBits bits, which are stored verbatim in
+*  a packed array, and its high bits, which are stored in unary: the i-th
+*  key sets bit (high_i + i) of the upper bit vector.  The keys with a given
+*  high part h therefore follow the h-th zero of the upper bit vector; the
+*  position of every 512th zero is sampled so that it can be found quickly.
+*  With lowBits = floor(log2(u / n)), the whole set takes about lowBits + 2
+*  bits per key, rather than the 64 (+ the perfect hash) that storing the
+*  keys takes.  Like KmerMPHF, the set is built into a single flat buffer,
+*  which is what is written to (and mapped from) the index file.
+**/
+class EliasFano {
+  public:
+   static constexpr uint64_t NotFound = std::numeric_limits<uint64_t>::max();
+   static constexpr uint64_t ZerosPerSample = 512;
+
+   struct Header {
+    uint64_t numKeys;
+    uint64_t lowBits;
+    // the largest high part of any key
+    uint64_t maxHigh;
+    uint64_t numSamples;
+    uint64_t numUpperWords;
+    uint64_t numLowWords;
+   };
+   static constexpr size_t HeaderBytes = ((sizeof(Header) + 63) / 64) * 64;
+
+   /**
+   *  Encode keys, which must be sorted and distinct.
+   **/
+   template <typename Alloc>
+   static std::vector<char> build(const std::vector<uint64_t, Alloc>& keys) {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    uint64_t n = keys.size();
+    header.numKeys = n;
+
+    // the universe is [0, largest key]; choose lowBits = floor(log2(u / n))
+    unsigned __int128 universe = (n > 0) ? static_cast<unsigned __int128>(keys.back()) + 1 : 1;
+    uint64_t lowBits{0};
+    while (lowBits < 63 and n > 0 and (universe >> (lowBits + 1)) >= n) { ++lowBits; }
+    header.lowBits = lowBits;
+    header.maxHigh = (n > 0) ? (keys.back() >> lowBits) : 0;
+
+    // one bit per key and one zero terminating each possible high part
+    uint64_t numUpperBits = n + header.maxHigh + 1;
+    header.numUpperWords = (numUpperBits + 63) / 64;
+    // one extra word so that a key's low bits can always be read as two words
+    header.numLowWords = (n * lowBits + 63) / 64 + 1;
+    header.numSamples = (header.maxHigh + 1 + ZerosPerSample - 1) / ZerosPerSample;
+
+    std::vector<char> packed(HeaderBytes + sizeof(uint64_t) * 
+                             (header.numSamples + header.numUpperWords + header.numLowWords), 0);
+    std::memcpy(&packed[0], &header, sizeof(header));
+    uint64_t* samples = reinterpret_cast<uint64_t*>(&packed[HeaderBytes]);
+    uint64_t* upper = samples + header.numSamples;
+    uint64_t* low = upper + header.numUpperWords;
+
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t pos = (keys[i] >> lowBits) + i;
+      upper[pos >> 6] |= uint64_t(1) << (pos & 63);
+      if (lowBits > 0) {
+        uint64_t l = keys[i] & ((uint64_t(1) << lowBits) - 1);
+        uint64_t bit = i * lowBits;
+        low[bit >> 6] |= l << (bit & 63);
+        if ((bit & 63) + lowBits > 64) { low[(bit >> 6) + 1] |= l >> (64 - (bit & 63)); }
+      }
+    }
+
+    // sample the position of every ZerosPerSample-th zero
+    uint64_t zero{0};
+    for (uint64_t pos = 0; pos < numUpperBits; ++pos) {
+      if (upper[pos >> 6] & (uint64_t(1) << (pos & 63))) { continue; }
+      if (zero % ZerosPerSample == 0) { samples[zero / ZerosPerSample] = pos; }
+      ++zero;
+    }
+    return packed;
+   }
+
+   /**
+   *  The rank of key among the encoded keys, or NotFound if it isn't one of
+   *  them.
+   **/
+   static inline uint64_t rank(const char* packed, uint64_t key) {
+    const Header* header = reinterpret_cast<const Header*>(packed);
+    const uint64_t* samples = reinterpret_cast<const uint64_t*>(packed + HeaderBytes);
+    const uint64_t* upper = samples + header->numSamples;
+    const uint64_t* low = upper + header->numUpperWords;
+
+    uint64_t lowBits = header->lowBits;
+    uint64_t high = key >> lowBits;
+    if (header->numKeys == 0 or high > header->maxHigh) { return NotFound; }
+    uint64_t lowMask = (lowBits > 0) ? ((uint64_t(1) << lowBits) - 1) : 0;
+    uint64_t target = key & lowMask;
+
+    // the keys with this high part are the ones after zero # (high - 1)
+    uint64_t pos = (high == 0) ? 0 : select0_(samples, upper, high - 1) + 1;
+    uint64_t r = pos - high;
+    while (upper[pos >> 6] & (uint64_t(1) << (pos & 63))) {
+      uint64_t l = lowAt_(low, r, lowBits, lowMask);
+      if (l == target) { return r; }
+      // the keys in a bucket are sorted by their low bits
+      if (l > target) { return NotFound; }
+      ++pos; ++r;
+    }
+    return NotFound;
+   }
+
+  private:
+   // The position of zero # z (counting from 0) in the upper bit vector
+   static inline uint64_t select0_(const uint64_t* samples, const uint64_t* upper, uint64_t z) {
+    uint64_t pos = samples[z / ZerosPerSample];
+    uint64_t remaining = z % ZerosPerSample;
+    uint64_t w = pos >> 6;
+    uint64_t zeros = ~upper[w] & (~uint64_t(0) << (pos & 63));
+    uint64_t count = __builtin_popcountll(zeros);
+    while (count <= remaining) {
+      remaining -= count;
+      zeros = ~upper[++w];
+      count = __builtin_popcountll(zeros);
+    }
+    for (uint64_t i = 0; i < remaining; ++i) { zeros &= zeros - 1; }
+    return (w << 6) + __builtin_ctzll(zeros);
+   }
+
+   // The low bits of the key with rank r
+   static inline uint64_t lowAt_(const uint64_t* low, uint64_t r, uint64_t lowBits, uint64_t lowMask) {
+    uint64_t bit = r * lowBits;
+    uint64_t offset = bit & 63;
+    uint64_t v = low[bit >> 6] >> offset;
+    if (offset + lowBits > 64) { v |= low[(bit >> 6) + 1] << (64 - offset); }
+    return v & lowMask;
+   }
+};
+
+#endif // ELIAS_FANO_HPP
@@ -0,0 +1,301 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef GZIP_INPUT_HPP
+#define GZIP_INPUT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "zlib.h"
+#include "MappedFile.hpp"
+
+namespace sailfish {
+
+/**
+*  A read file, as the read parser should see it.  A file that isn't
+*  compressed is read directly.  A gzip compressed file is decompressed by
+*  Sailfish itself, into a pipe which the parser reads from (as it would
+*  from a `<(gunzip -c reads.fastq.gz)` process substitution).
+*
+*  BGZF files (gzip files made of independently compressed blocks of at most
+*  64KB, each of which records its compressed size, as written by bgzip) are
+*  decompressed a batch of blocks at a time by numThreads threads, while the
+*  previous batch is written to the pipe.  Any other gzip file is inflated
+*  by a single thread, which at least overlaps the decompression with
+*  counting without a separate process.  Standard input ("-") and named
+*  pipes are left to the parser.
+**/
+class GzipInput {
+  public:
+   GzipInput(const std::string& fname, uint32_t numThreads) : 
+       path_(fname), readFd_(-1), writeFd_(-1), numThreads_(std::max(numThreads, 1u)), blocked_(false) {
+    // standard input and pipes can't be mapped; the parser streams them
+    struct stat st;
+    if (fname == "-" or stat(fname.c_str(), &st) != 0 or !S_ISREG(st.st_mode)) { return; }
+    file_.reset(new MappedFile(fname));
+    auto base = reinterpret_cast<const unsigned char*>(file_->base());
+    if (!isGzip(base, file_->size())) { file_.reset(); return; }
+    blocked_ = (bgzfBlockSize(base, file_->size()) > 0);
+
+    int fds[2];
+    if (pipe(fds) != 0) { throw std::runtime_error("could not create a pipe for " + fname); }
+    readFd_ = fds[0];
+    writeFd_ = fds[1];
+    path_ = "/dev/fd/" + std::to_string(readFd_);
+    feeder_ = std::thread([this, fname]() -> void {
+      // if the reader goes away, write() should fail rather than kill us
+      sigset_t pipeSignal;
+      sigemptyset(&pipeSignal);
+      sigaddset(&pipeSignal, SIGPIPE);
+      pthread_sigmask(SIG_BLOCK, &pipeSignal, nullptr);
+      try {
+        if (blocked_) { feedBlocks_(); } else { feedStream_(); }
+      } catch (std::exception& e) {
+        error_ = std::make_exception_ptr(std::runtime_error("could not decompress " + fname + " [" + e.what() + "]"));
+      }
+      close(writeFd_);
+    });
+   }
+
+   ~GzipInput() {
+    if (feeder_.joinable()) {
+      // unblock the feeder if it's still writing to a reader that's gone
+      close(readFd_);
+      readFd_ = -1;
+      feeder_.join();
+    }
+    if (readFd_ >= 0) { close(readFd_); }
+   }
+
+   GzipInput(const GzipInput&) = delete;
+   GzipInput& operator=(const GzipInput&) = delete;
+
+   // The path the read parser should open
+   inline const std::string& path() const { return path_; }
+
+   inline bool compressed() const { return readFd_ >= 0; }
+
+   // True if the file is BGZF, and so decompressed in parallel
+   inline bool blocked() const { return blocked_; }
+
+   /**
+   *  Wait for the decompression to finish (once the parser has read all of
+   *  the file), and throw if the file couldn't be decompressed.
+   **/
+   void finish() {
+    if (feeder_.joinable()) { feeder_.join(); }
+    if (error_) { std::rethrow_exception(error_); }
+   }
+
+   static bool isGzip(const unsigned char* p, size_t n) { return n >= 18 and p[0] == 0x1f and p[1] == 0x8b; }
+
+   /**
+   *  The size of the BGZF block at p (with n bytes left in the file), or 0
+   *  if p doesn't begin a BGZF block.
+   **/
+   static size_t bgzfBlockSize(const unsigned char* p, size_t n) {
+    // a gzip member, deflated, with an extra field
+    if (!isGzip(p, n) or p[2] != 8 or (p[3] & 4) == 0) { return 0; }
+    size_t xlen = p[10] | (p[11] << 8);
+    if (12 + xlen > n) { return 0; }
+    // look for the "BC" subfield, which holds the block size - 1
+    for (size_t i = 12; i + 4 <= 12 + xlen; ) {
+      size_t slen = p[i + 2] | (p[i + 3] << 8);
+      if (p[i] == 'B' and p[i + 1] == 'C' and slen == 2 and i + 6 <= 12 + xlen) {
+        size_t bsize = (p[i + 4] | (p[i + 5] << 8)) + 1;
+        return (bsize <= n and bsize >= 12 + xlen + 8) ? bsize : 0;
+      }
+      i += 4 + slen;
+    }
+    return 0;
+   }
+
+  private:
+   // A BGZF block of the file, and its contents once inflated
+   struct Block {
+    const unsigned char* data;
+    size_t size;
+    std::vector<char> raw;
+   };
+
+   static const size_t BlocksPerThread = 64;
+
+   static void inflateBlock_(Block& b) {
+    size_t xlen = b.data[10] | (b.data[11] << 8);
+    const unsigned char* trailer = b.data + b.size - 8;
+    uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (uint32_t(trailer[3]) << 24);
+    uint32_t isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | (uint32_t(trailer[7]) << 24);
+    b.raw.resize(isize);
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK) { throw std::runtime_error("inflateInit2 failed"); }
+    zs.next_in = const_cast<Bytef*>(b.data + 12 + xlen);
+    zs.avail_in = b.size - 12 - xlen - 8;
+    // (zlib insists on an output buffer, even for the empty block at the end)
+    char none{0};
+    zs.next_out = reinterpret_cast<Bytef*>((isize > 0) ? b.raw.data() : &none);
+    zs.avail_out = isize;
+    int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END or zs.avail_out != 0 or 
+        crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(b.raw.data()), isize) != crc) {
+      throw std::runtime_error("corrupt BGZF block");
+    }
+   }
+
+   // Write the n bytes at buf to the pipe; false if the reader has gone
+   bool write_(const char* buf, size_t n) {
+    while (n > 0) {
+      ssize_t w = write(writeFd_, buf, n);
+      if (w < 0) {
+        if (errno == EINTR) { continue; }
+        if (errno == EPIPE) { return false; }
+        throw std::runtime_error(std::string("could not write to the parser [") + std::strerror(errno) + "]");
+      }
+      buf += w;
+      n -= w;
+    }
+    return true;
+   }
+
+   void feedBlocks_() {
+    auto base = reinterpret_cast<const unsigned char*>(file_->base());
+    size_t size = file_->size();
+    size_t pos{0};
+    size_t batchSize = BlocksPerThread * numThreads_;
+    // find the next batch of blocks
+    auto nextBatch = [&]() -> std::vector<Block> {
+      std::vector<Block> batch;
+      while (pos < size and batch.size() < batchSize) {
+        size_t bsize = bgzfBlockSize(base + pos, size - pos);
+        if (bsize == 0) { throw std::runtime_error("not a BGZF block at offset " + std::to_string(pos)); }
+        batch.push_back(Block{base + pos, bsize, {}});
+        pos += bsize;
+      }
+      return batch;
+    };
+    auto inflateBatch = [this](std::vector<Block>& batch) -> void {
+      std::atomic<size_t> next{0};
+      std::vector<std::exception_ptr> errors(numThreads_);
+      std::vector<std::thread> threads;
+      for (uint32_t t = 0; t < numThreads_; ++t) {
+        threads.emplace_back([&batch, &next, &errors, t]() -> void {
+          try {
+            for (size_t i = next++; i < batch.size(); i = next++) { inflateBlock_(batch[i]); }
+          } catch (...) {
+            errors[t] = std::current_exception();
+          }
+        });
+      }
+      for (auto& t : threads) { t.join(); }
+      for (auto& e : errors) { if (e) { std::rethrow_exception(e); } }
+    };
+    auto writeBatch = [this](std::vector<Block>& batch) -> bool {
+      for (auto& b : batch) { if (!write_(b.raw.data(), b.raw.size())) { return false; } }
+      return true;
+    };
+
+    // inflate each batch while the previous one is written out
+    std::vector<Block> ready = nextBatch();
+    inflateBatch(ready);
+    while (!ready.empty()) {
+      auto written = std::async(std::launch::async, writeBatch, std::ref(ready));
+      std::vector<Block> batch;
+      try {
+        batch = nextBatch();
+        inflateBatch(batch);
+      } catch (...) {
+        written.wait();
+        throw;
+      }
+      if (!written.get()) { return; }
+      ready.swap(batch);
+    }
+   }
+
+   void feedStream_() {
+    const size_t chunkSize = size_t(1) << 20;
+    std::vector<char> out(chunkSize);
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    // 15 + 16: a gzip (not zlib or raw) stream
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) { throw std::runtime_error("inflateInit2 failed"); }
+    std::unique_ptr<z_stream, int(*)(z_stream*)> guard(&zs, inflateEnd);
+    auto base = reinterpret_cast<const unsigned char*>(file_->base());
+    size_t size = file_->size();
+    // the amount of the file handed to zlib so far
+    size_t pos{0};
+    for (;;) {
+      if (zs.avail_in == 0 and pos < size) {
+        // zlib counts its input in 32-bit words
+        size_t in = std::min(size - pos, size_t(1) << 30);
+        zs.next_in = const_cast<Bytef*>(base + pos);
+        zs.avail_in = in;
+        pos += in;
+      }
+      zs.next_out = reinterpret_cast<Bytef*>(out.data());
+      zs.avail_out = chunkSize;
+      int ret = inflate(&zs, Z_NO_FLUSH);
+      if (ret == Z_BUF_ERROR) { throw std::runtime_error("unexpected end of file"); }
+      if (ret != Z_OK and ret != Z_STREAM_END) {
+        throw std::runtime_error(zs.msg ? zs.msg : "inflate failed");
+      }
+      if (!write_(out.data(), chunkSize - zs.avail_out)) { return; }
+      if (ret == Z_STREAM_END) {
+        // a file may hold several gzip members, one after another
+        size_t next = pos - zs.avail_in;
+        if (next >= size or !isGzip(base + next, size - next)) { return; }
+        inflateReset(&zs);
+      }
+    }
+   }
+
+   std::string path_;
+   std::unique_ptr<MappedFile> file_;
+   int readFd_;
+   int writeFd_;
+   uint32_t numThreads_;
+   bool blocked_;
+   std::thread feeder_;
+   std::exception_ptr error_;
+};
+
+}
+
+#endif // GZIP_INPUT_HPP
@@ -0,0 +1,224 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef HUGE_PAGE_ALLOCATOR_HPP
+#define HUGE_PAGE_ALLOCATOR_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include <sys/mman.h>
+
+// Older headers lack the flags used to request a specific hugetlb page size
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace sailfish {
+namespace hugepages {
+
+constexpr size_t HugePageSize = size_t(1) << 21;
+constexpr size_t GiantPageSize = size_t(1) << 30;
+
+// Allocations smaller than this are served by the ordinary heap
+constexpr size_t MinBytes = HugePageSize;
+
+inline size_t roundUp(size_t bytes, size_t pageSize) {
+  return ((bytes + pageSize - 1) / pageSize) * pageSize;
+}
+
+// The size of the mapping for an allocation of bytes, unless it's backed by 1GB pages
+inline size_t roundedSize(size_t bytes) { return roundUp(bytes, HugePageSize); }
+
+// The allocations backed by 1GB pages, and the (whole 1GB page) sizes of their mappings
+inline std::mutex& giantMutex() { static std::mutex m; return m; }
+inline std::unordered_map<const void*, size_t>& giantMappings() {
+  static std::unordered_map<const void*, size_t> mappings;
+  return mappings;
+}
+
+/**
+*  Allocate bytes (>= MinBytes) backed by the largest pages we can get.  We
+*  first ask hugetlbfs for explicit huge pages (1GB pages for allocations of
+*  at least 1GB, then 2MB pages), which only succeeds if the administrator
+*  has reserved them.  Failing that, we take an ordinary anonymous mapping,
+*  aligned to the huge page size, and ask for transparent huge pages with
+*  madvise.  An allocation is rounded up to a whole 1GB page only if it
+*  actually gets 1GB pages (those are remembered, so deallocate can release
+*  the whole mapping); otherwise roundedSize(bytes) bytes are mapped.
+**/
+inline void* allocate(size_t bytes) {
+  size_t len = roundedSize(bytes);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_HUGETLB
+  if (bytes >= GiantPageSize) {
+    size_t giantLen = roundUp(bytes, GiantPageSize);
+    void* p = mmap(nullptr, giantLen, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+    if (p != MAP_FAILED) {
+      std::lock_guard<std::mutex> lock(giantMutex());
+      giantMappings()[p] = giantLen;
+      return p;
+    }
+  }
+  {
+    void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (p != MAP_FAILED) { return p; }
+  }
+#endif
+
+  // Over-allocate so that we can trim the mapping to an aligned region
+  size_t align = HugePageSize;
+  void* raw = mmap(nullptr, len + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (raw == MAP_FAILED) { throw std::bad_alloc(); }
+  uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+  uintptr_t aligned = ((start + align - 1) / align) * align;
+  if (aligned > start) { munmap(raw, aligned - start); }
+  uintptr_t end = start + len + align;
+  if (end > aligned + len) { munmap(reinterpret_cast<void*>(aligned + len), end - (aligned + len)); }
+
+  void* p = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+  madvise(p, len, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+inline void deallocate(void* p, size_t bytes) {
+  size_t len = roundedSize(bytes);
+  if (bytes >= GiantPageSize) {
+    std::lock_guard<std::mutex> lock(giantMutex());
+    auto it = giantMappings().find(p);
+    if (it != giantMappings().end()) {
+      len = it->second;
+      giantMappings().erase(it);
+    }
+  }
+  munmap(p, len);
+}
+
+/**
+*  Describe the pages that actually back the mapping containing p, as
+*  reported by the kernel in /proc/self/smaps.  Transparent huge pages are
+*  only handed out as memory is first touched, so this is most meaningful
+*  once the memory has been written.
+**/
+inline std::string describeBacking(const void* p) {
+  std::ifstream smaps("/proc/self/smaps");
+  if (!smaps.good()) { return "unknown (no /proc/self/smaps)"; }
+
+  uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+  bool inMapping{false};
+  size_t sizeKB{0}, kernelPageKB{0}, hugeKB{0};
+  std::string line;
+  while (std::getline(smaps, line)) {
+    std::istringstream ls(line);
+    std::string key;
+    ls >> key;
+    if (key.empty()) { continue; }
+    // fields look like "Size:  2048 kB"; anything else begins a new mapping
+    if (key.back() != ':') {
+      if (inMapping) { break; }
+      unsigned long long lo{0}, hi{0};
+      inMapping = (std::sscanf(key.c_str(), "%llx-%llx", &lo, &hi) == 2 and lo <= addr and addr < hi);
+      continue;
+    }
+    if (!inMapping) { continue; }
+    size_t value{0};
+    ls >> value;
+    if (key == "Size:") { sizeKB = value; }
+    else if (key == "KernelPageSize:") { kernelPageKB = value; }
+    else if (key == "AnonHugePages:" or key == "FilePmdMapped:" or key == "ShmemPmdMapped:") { hugeKB += value; }
+  }
+  if (!inMapping or sizeKB == 0) { return "unknown"; }
+
+  std::stringstream ss;
+  if (kernelPageKB > 4) {
+    ss << "hugetlb (" << ((kernelPageKB >= (1 << 20)) ? "1GB" : "2MB") << " pages)";
+  } else if (hugeKB > 0) {
+    ss << "transparent huge pages (" << (100 * hugeKB) / sizeKB << "% of " << sizeKB / 1024 << "MB)";
+  } else {
+    ss << kernelPageKB << "kB pages";
+  }
+  return ss.str();
+}
+
+inline void reportBacking(const std::string& name, const void* p, size_t bytes) {
+  if (p == nullptr or bytes == 0) { return; }
+  std::cerr << name << " [" << bytes / (1024 * 1024) << "MB] is backed by " 
+            << ((bytes < MinBytes) ? std::string("small pages (smaller than a huge page)") : describeBacking(p))
+            << "\n";
+}
+
+}
+
+/**
+*  An allocator for the large, randomly accessed arrays (keys, perfect hash,
+*  counts) that requests huge page backing for them (see
+*  hugepages::allocate) to cut down on TLB misses.  Small allocations come
+*  from the ordinary heap.
+**/
+template <typename T>
+class HugePageAllocator {
+  public:
+   using value_type = T;
+
+   HugePageAllocator() = default;
+   template <typename U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+   T* allocate(size_t n) {
+    if (n > std::numeric_limits<size_t>::max() / sizeof(T)) { throw std::bad_alloc(); }
+    size_t bytes = n * sizeof(T);
+    if (bytes < hugepages::MinBytes) { return static_cast<T*>(::operator new(bytes)); }
+    return static_cast<T*>(hugepages::allocate(bytes));
+   }
+
+   void deallocate(T* p, size_t n) {
+    size_t bytes = n * sizeof(T);
+    if (bytes < hugepages::MinBytes) { ::operator delete(p); return; }
+    hugepages::deallocate(p, bytes);
+   }
+};
+
+template <typename T, typename U>
+inline bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+template <typename T, typename U>
+inline bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
+}
+
+#endif // HUGE_PAGE_ALLOCATOR_HPP
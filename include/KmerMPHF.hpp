@@ -0,0 +1,238 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef KMER_MPHF_HPP
+#define KMER_MPHF_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_sort.h"
+
+#include "KmerWord.hpp"
+
+/**
+*  A minimal perfect hash function specialized for kmer keys (64 or 128-bit
+*  words, see KmerWord.hpp).
+*
+*  The construction follows BBHash: at each level, the keys that remain are
+*  hashed into a bit array of gamma * (# keys) bits.  Keys that land on a bit
+*  no other key hit are placed at that level; the rest move on to the next
+*  (smaller) level.  The id of a placed key is the number of placed keys
+*  that precede it, i.e. the rank of its bit across all levels.  The few keys
+*  left after MaxLevels levels are stored explicitly.  Every level is built
+*  in parallel, with atomic bit arrays recording hits and collisions.
+*
+*  The bits are stored in 64-byte (cache line) blocks: the first word of a
+*  block holds the rank of the block, and the other 7 words hold 448 bits of
+*  the level.  Probing a level therefore touches a single cache line, and most
+*  keys are resolved at the first or second level.  The structure is built
+*  into a single flat buffer, which is what is written to (and mapped from)
+*  the index file, and lookups work directly on that buffer.
+**/
+class KmerMPHF {
+  public:
+   static constexpr uint32_t MaxLevels = 28;
+   static constexpr uint64_t BitsPerBlock = 448;
+   static constexpr uint64_t WordsPerBlock = 8;
+
+   struct Header {
+    uint64_t numKeys;
+    uint64_t numLevels;
+    uint64_t numFallback;
+    uint64_t numBlocks;
+    uint64_t levelBits[MaxLevels];
+    uint64_t levelBlock[MaxLevels];
+   };
+   // The blocks start on a cache line boundary (relative to the buffer)
+   static constexpr size_t HeaderBytes = ((sizeof(Header) + 63) / 64) * 64;
+
+   /**
+   *  Build the function over keys (which must be distinct) and return its
+   *  flat representation.
+   **/
+   template <typename Key, typename Alloc>
+   static std::vector<char> build(const std::vector<Key, Alloc>& keys, double gamma = 2.0) {
+    using BlockedRange = tbb::blocked_range<size_t>;
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    header.numKeys = keys.size();
+
+    std::vector<std::vector<uint64_t>> levels;
+    std::vector<Key> remaining(keys.begin(), keys.end());
+
+    while (remaining.size() > 0 and levels.size() < MaxLevels) {
+      uint64_t level = levels.size();
+      uint64_t numBits = std::max(uint64_t(64), static_cast<uint64_t>(gamma * remaining.size()));
+      size_t numWords = (numBits + 63) / 64;
+      std::vector<std::atomic<uint64_t>> hits(numWords);
+      std::vector<std::atomic<uint64_t>> collisions(numWords);
+
+      // mark the bit of every key, noting those that are hit more than once
+      tbb::parallel_for(BlockedRange(size_t(0), remaining.size()),
+        [&](const BlockedRange& range) -> void {
+          for (size_t i = range.begin(); i != range.end(); ++i) {
+            uint64_t p = position_(remaining[i], level, numBits);
+            uint64_t mask = uint64_t(1) << (p & 63);
+            if (hits[p >> 6].fetch_or(mask) & mask) { collisions[p >> 6].fetch_or(mask); }
+          }
+      });
+
+      // keys that collided move on to the next level
+      tbb::enumerable_thread_specific<std::vector<Key>> collided;
+      tbb::parallel_for(BlockedRange(size_t(0), remaining.size()),
+        [&](const BlockedRange& range) -> void {
+          auto& local = collided.local();
+          for (size_t i = range.begin(); i != range.end(); ++i) {
+            uint64_t p = position_(remaining[i], level, numBits);
+            if (collisions[p >> 6].load() & (uint64_t(1) << (p & 63))) { local.push_back(remaining[i]); }
+          }
+      });
+
+      std::vector<uint64_t> bits(numWords);
+      for (size_t w = 0; w < numWords; ++w) { bits[w] = hits[w].load() & ~collisions[w].load(); }
+      levels.push_back(std::move(bits));
+      header.levelBits[level] = numBits;
+
+      std::vector<Key> next;
+      for (auto& local : collided) { next.insert(next.end(), local.begin(), local.end()); }
+      remaining.swap(next);
+    }
+
+    header.numLevels = levels.size();
+    header.numFallback = remaining.size();
+
+    // lay the levels out in blocks, recording the rank at the start of each
+    uint64_t numBlocks{0};
+    for (size_t l = 0; l < levels.size(); ++l) {
+      header.levelBlock[l] = numBlocks;
+      numBlocks += (header.levelBits[l] + BitsPerBlock - 1) / BitsPerBlock;
+    }
+    header.numBlocks = numBlocks;
+
+    size_t numBytes = HeaderBytes + numBlocks * WordsPerBlock * sizeof(uint64_t) +
+                      remaining.size() * fallbackWords_<Key>() * sizeof(uint64_t);
+    std::vector<char> packed(numBytes, 0);
+    std::memcpy(&packed[0], &header, sizeof(header));
+    uint64_t* blocks = reinterpret_cast<uint64_t*>(&packed[HeaderBytes]);
+
+    uint64_t rank{0};
+    for (size_t l = 0; l < levels.size(); ++l) {
+      auto& words = levels[l];
+      uint64_t levelBlocks = (header.levelBits[l] + BitsPerBlock - 1) / BitsPerBlock;
+      for (uint64_t b = 0; b < levelBlocks; ++b) {
+        uint64_t* block = blocks + (header.levelBlock[l] + b) * WordsPerBlock;
+        block[0] = rank;
+        for (uint64_t w = 0; w < WordsPerBlock - 1; ++w) {
+          size_t lw = b * (WordsPerBlock - 1) + w;
+          block[w + 1] = (lw < words.size()) ? words[lw] : 0;
+          rank += __builtin_popcountll(block[w + 1]);
+        }
+      }
+    }
+
+    // the keys we couldn't place are stored (sorted) with explicit ids
+    tbb::parallel_sort(remaining.begin(), remaining.end());
+    uint64_t* fallback = blocks + numBlocks * WordsPerBlock;
+    const size_t stride = fallbackWords_<Key>();
+    for (size_t i = 0; i < remaining.size(); ++i) {
+      std::memcpy(fallback + stride * i, &remaining[i], sizeof(Key));
+      fallback[stride * i + stride - 1] = rank + i;
+    }
+
+    return packed;
+   }
+
+   /**
+   *  The id of key in [0, numKeys) if key was one of the keys the function was
+   *  built over.  For any other key, the result is arbitrary (but still less
+   *  than numKeys, so it can be used to index a key array for verification).
+   **/
+   template <typename Key>
+   static inline uint64_t lookup(const char* packed, Key key) {
+    const Header* header = reinterpret_cast<const Header*>(packed);
+    const uint64_t* blocks = reinterpret_cast<const uint64_t*>(packed + HeaderBytes);
+
+    for (uint64_t l = 0; l < header->numLevels; ++l) {
+      uint64_t p = position_(key, l, header->levelBits[l]);
+      const uint64_t* block = blocks + (header->levelBlock[l] + p / BitsPerBlock) * WordsPerBlock;
+      uint64_t offset = p % BitsPerBlock;
+      uint64_t w = offset >> 6;
+      uint64_t word = block[w + 1];
+      uint64_t mask = uint64_t(1) << (offset & 63);
+      if (word & mask) {
+        uint64_t rank = block[0];
+        for (uint64_t i = 0; i < w; ++i) { rank += __builtin_popcountll(block[i + 1]); }
+        return rank + __builtin_popcountll(word & (mask - 1));
+      }
+    }
+
+    if (header->numFallback > 0) {
+      const uint64_t* fallback = blocks + header->numBlocks * WordsPerBlock;
+      const size_t stride = fallbackWords_<Key>();
+      auto keyAt = [fallback, stride](size_t i) -> Key {
+        Key k;
+        std::memcpy(&k, fallback + stride * i, sizeof(Key));
+        return k;
+      };
+      size_t lo{0}, hi{header->numFallback};
+      while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (keyAt(mid) < key) { lo = mid + 1; } else { hi = mid; }
+      }
+      if (lo < header->numFallback and keyAt(lo) == key) { return fallback[stride * lo + stride - 1]; }
+    }
+    return 0;
+   }
+
+   // prefetch the block that key falls into at the first level
+   template <typename Key>
+   static inline void prefetch(const char* packed, Key key) {
+    const Header* header = reinterpret_cast<const Header*>(packed);
+    const uint64_t* blocks = reinterpret_cast<const uint64_t*>(packed + HeaderBytes);
+    uint64_t p = position_(key, 0, header->levelBits[0]);
+    __builtin_prefetch(blocks + (p / BitsPerBlock) * WordsPerBlock);
+   }
+
+  private:
+   // A fallback entry is a key followed by its id
+   template <typename Key>
+   static constexpr size_t fallbackWords_() { return sizeof(Key) / sizeof(uint64_t) + 1; }
+
+   // The position of key within a level of numBits bits
+   template <typename Key>
+   static inline uint64_t position_(Key key, uint64_t level, uint64_t numBits) {
+    // murmur3's finalizer, seeded by the level
+    uint64_t h = sailfish::kmers::hashWord(key, 0x9E3779B97F4A7C15ULL * (level + 1));
+    // map h onto [0, numBits) without a division
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(h) * numBits) >> 64);
+   }
+};
+
+#endif // KMER_MPHF_HPP
@@ -0,0 +1,147 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef KMER_STREAM_HPP
+#define KMER_STREAM_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+
+#include "KmerWord.hpp"
+
+namespace sailfish {
+namespace kmers {
+
+/**
+*  2-bit codes for the nucleotides; anything that is not a nucleotide
+*  is either RESET (it breaks the current kmer, e.g. an 'N') or IGNORE
+*  (it is skipped entirely, e.g. the newlines of a multi-line FASTA record).
+**/
+enum : uint8_t { CODE_A = 0, CODE_C = 1, CODE_G = 2, CODE_T = 3, CODE_RESET = 4, CODE_IGNORE = 5 };
+
+/**
+*  Convert the sequence [seq, seq + len) to 2-bit codes, writing them to codes
+*  (which must have room for len entries).  Ignored characters are removed, so
+*  the return value is the number of codes actually written.  This uses
+*  AVX2 or SSE2 when the compiler targets them and a table lookup otherwise.
+*  If qual is given, it holds the (FASTQ) quality of each of the len bases,
+*  and every base whose quality is below minQual is encoded as RESET.
+**/
+size_t encodeRead(const char* seq, size_t len, uint8_t* codes, const char* qual = nullptr, char minQual = 0);
+
+/**
+*  Roll a window of size k over the n encoded bases in codes, writing every
+*  valid forward kmer to fwd and its reverse complement to rev.  A RESET code
+*  restarts the window.  Returns the number of kmers written; fwd and rev must
+*  have room for n entries.  KmerT is the kmer word (uint64_t or Kmer128).
+**/
+template <typename KmerT>
+size_t forwardAndReverseKmers(const uint8_t* codes, size_t n, uint32_t k, KmerT* fwd, KmerT* rev);
+
+/**
+*  As above, but writes only the canonical (lesser of the forward and reverse
+*  complement) kmers to mers.
+**/
+template <typename KmerT>
+size_t canonicalKmers(const uint8_t* codes, size_t n, uint32_t k, KmerT* mers);
+
+/**
+*  As above, but writes only the forward kmers (or, if reverse, only their
+*  reverse complements) to mers.
+**/
+template <typename KmerT>
+size_t strandKmers(const uint8_t* codes, size_t n, uint32_t k, bool reverse, KmerT* mers);
+
+/**
+*  Holds the (reusable) buffers needed to turn reads into a stream of kmers.
+*  Each counting thread should own its own KmerStream.
+**/
+template <typename KmerT>
+class KmerStreamT {
+  public:
+   /**
+   *  If minQuality (a Phred score) is nonzero, the kmers of a read that is
+   *  given with its qualities never span a base of lower quality.
+   **/
+   explicit KmerStreamT(uint32_t k, uint32_t minQuality = 0) : 
+       k_(k), minQual_(static_cast<char>(33 + std::min(minQuality, 93u))), 
+       masking_(minQuality > 0), numKmers_(0) {}
+
+   // Fill fwd() and rev() with the kmers of the read [s, e) (whose
+   // qualities, if it has them, begin at qual)
+   void directional(const char* s, const char* e, const char* qual = nullptr) {
+    auto n = encode_(s, e, qual);
+    if (n < k_) { numKmers_ = 0; return; }
+    numKmers_ = forwardAndReverseKmers(codes_.data(), n, k_, fwd_.data(), rev_.data());
+   }
+
+   // Fill fwd() with the canonical kmers of the read [s, e)
+   void canonical(const char* s, const char* e, const char* qual = nullptr) {
+    auto n = encode_(s, e, qual);
+    if (n < k_) { numKmers_ = 0; return; }
+    numKmers_ = canonicalKmers(codes_.data(), n, k_, fwd_.data());
+   }
+
+   // Fill fwd() with the kmers of the read [s, e) on one strand (the
+   // reverse complement strand if reverse)
+   void stranded(const char* s, const char* e, bool reverse, const char* qual = nullptr) {
+    auto n = encode_(s, e, qual);
+    if (n < k_) { numKmers_ = 0; return; }
+    numKmers_ = strandKmers(codes_.data(), n, k_, reverse, fwd_.data());
+   }
+
+   inline size_t numKmers() const { return numKmers_; }
+   inline KmerT* fwd() { return fwd_.data(); }
+   inline KmerT* rev() { return rev_.data(); }
+
+  private:
+   // Encode the bases of [s, e) into codes_, growing the buffers to fit, and
+   // return how many there are; a read shorter than a kmer has no kmers, so the
+   // callers return before touching the (possibly still empty) buffers.
+   size_t encode_(const char* s, const char* e, const char* qual) {
+    size_t len = e - s;
+    if (len > codes_.size()) {
+      codes_.resize(len);
+      fwd_.resize(len);
+      rev_.resize(len);
+    }
+    if (!masking_) { qual = nullptr; }
+    return (len > 0) ? encodeRead(s, len, codes_.data(), qual, minQual_) : 0;
+   }
+
+   uint32_t k_;
+   char minQual_;
+   bool masking_;
+   size_t numKmers_;
+   std::vector<uint8_t> codes_;
+   std::vector<KmerT> fwd_;
+   std::vector<KmerT> rev_;
+};
+
+using KmerStream = KmerStreamT<uint64_t>;
+
+}
+}
+
+#endif // KMER_STREAM_HPP
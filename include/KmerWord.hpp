@@ -0,0 +1,83 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef KMER_WORD_HPP
+#define KMER_WORD_HPP
+
+#include <cstdint>
+
+namespace sailfish {
+namespace kmers {
+
+/**
+*  Kmers are packed 2 bits per base into an unsigned word; a uint64_t holds
+*  kmers of up to 32 bases and an unsigned __int128 (a pair of machine words)
+*  those of up to 64 bases.  Everything that stores or hashes kmers is
+*  templated on the word type, and the word is chosen once, at startup, from
+*  the kmer length recorded in the index (see readIndexKmerLength).
+**/
+using Kmer128 = unsigned __int128;
+
+// The longest kmer that a word of type KmerT can hold
+template <typename KmerT>
+constexpr uint32_t maxKmerLength() { return 4 * sizeof(KmerT); }
+
+// The mask selecting the 2k low bits of a word
+template <typename KmerT>
+inline KmerT kmerMask(uint32_t k) {
+  return (k < maxKmerLength<KmerT>()) ? ((KmerT(1) << (2 * k)) - 1) : ~KmerT(0);
+}
+
+// murmur3's 64-bit finalizer
+inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// A seeded 64-bit hash of a kmer word
+inline uint64_t hashWord(uint64_t w, uint64_t seed) { return mix64(w ^ seed); }
+inline uint64_t hashWord(Kmer128 w, uint64_t seed) {
+  uint64_t lo = static_cast<uint64_t>(w);
+  uint64_t hi = static_cast<uint64_t>(w >> 64);
+  return mix64(lo ^ seed ^ mix64(hi + 0x9E3779B97F4A7C15ULL));
+}
+
+// splitmix64's finalizer; a hash unrelated to hashWord
+inline uint64_t splitMix64(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+inline uint64_t fingerprintWord(uint64_t w) { return splitMix64(w + 0x632BE59BD9B4E019ULL); }
+inline uint64_t fingerprintWord(Kmer128 w) {
+  return splitMix64(static_cast<uint64_t>(w) + 
+                    splitMix64(static_cast<uint64_t>(w >> 64) + 0x632BE59BD9B4E019ULL));
+}
+
+}
+}
+
+#endif // KMER_WORD_HPP
@@ -43,7 +43,10 @@
 #include "tbb/parallel_for_each.h"
 
 #include <boost/range/irange.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <boost/iostreams/device/array.hpp>
 #include "ezETAProgressBar.hpp"
+#include "MappedFile.hpp"
 
 namespace LUTTools {
 
@@ -62,6 +65,19 @@ struct TranscriptInfo{
   std::vector<KmerID> kmers; // TranscriptID => KmerID
 };
 
+/**
+*  An input stream over the contents of the lookup table fname, which may be
+*  stored in the compressed container (see CompressedFile.hpp).
+**/
+class LUTInput {
+  public:
+    explicit LUTInput(const std::string& fname) : file_(fname), stream_(file_.base(), file_.size()) {}
+    std::istream& stream() { return stream_; }
+  private:
+    sailfish::MappedFile file_;
+    boost::iostreams::stream<boost::iostreams::array_source> stream_;
+};
+
 void dumpKmerLUT(
     std::vector<TranscriptList> &transcriptsForKmer,
     const std::string &fname) {
@@ -92,7 +108,8 @@ void readKmerLUT(
     const std::string &fname,
     std::vector<TranscriptList> &transcriptsForKmer) {
 
-    std::ifstream ifile(fname, std::ios::binary);
+    LUTInput input(fname);
+    std::istream& ifile = input.stream();
     // get the size of the vector from file
     size_t numk = 0;
     ifile.read(reinterpret_cast<char *>(&numk), sizeof(numk));
@@ -109,8 +126,6 @@ void readKmerLUT(
             ifile.read(reinterpret_cast<char *>(&transcriptsForKmer[i][0]), numTran * sizeof(TranscriptID));
         }
     }
-
-    ifile.close();
 }
 
 
@@ -135,7 +150,7 @@ void writeTranscriptInfo (TranscriptInfo *ti, std::ofstream &ostream) {
     ostream.write(reinterpret_cast<const char *>(&ti->kmers[0]), numKmers * sizeof(KmerID));
 }
 
-std::unique_ptr<TranscriptInfo> readTranscriptInfo(std::ifstream &istream) {
+std::unique_ptr<TranscriptInfo> readTranscriptInfo(std::istream &istream) {
     std::unique_ptr<TranscriptInfo> ti(new TranscriptInfo);
     size_t recordSize = 0;
     istream.read(reinterpret_cast<char *>(&recordSize), sizeof(recordSize));
@@ -143,9 +158,8 @@ std::unique_ptr<TranscriptInfo> readTranscriptInfo(std::ifstream &istream) {
     istream.read(reinterpret_cast<char *>(&ti->geneID), sizeof(ti->geneID));
     size_t slen = 0;
     istream.read(reinterpret_cast<char *>(&slen), sizeof(slen));
-    char *name = new char[slen];
-    istream.read(name, slen);
-    ti->name = std::string(name);
+    ti->name.resize(slen);
+    if (slen > 0) { istream.read(&ti->name[0], slen); }
     // read the transcript's length
     istream.read(reinterpret_cast<char *>(&ti->length), sizeof(ti->length));
     size_t numKmers = 0;
@@ -155,6 +169,40 @@ std::unique_ptr<TranscriptInfo> readTranscriptInfo(std::ifstream &istream) {
     return ti;
 }
 
+/**
+*  The length of every transcript in the transcript lookup table tlutfname,
+*  indexed by transcript id.  The kmer list of each record is skipped rather
+*  than read.
+**/
+std::vector<Length> readTranscriptLengths(const std::string &tlutfname) {
+    LUTInput input(tlutfname);
+    std::istream& ifile = input.stream();
+    size_t numRecords {0};
+    ifile.read(reinterpret_cast<char *>(&numRecords), sizeof(numRecords));
+    std::vector<Length> lengths(numRecords, 0);
+    for (size_t i = 0; i < numRecords; ++i) {
+        size_t recordSize {0};
+        ifile.read(reinterpret_cast<char *>(&recordSize), sizeof(recordSize));
+        auto recordEnd = ifile.tellg() + static_cast<std::streamoff>(recordSize);
+        TranscriptID tid {0};
+        ifile.read(reinterpret_cast<char *>(&tid), sizeof(tid));
+        TranscriptID gid {0};
+        ifile.read(reinterpret_cast<char *>(&gid), sizeof(gid));
+        size_t slen {0};
+        ifile.read(reinterpret_cast<char *>(&slen), sizeof(slen));
+        ifile.seekg(slen, std::ios::cur);
+        Length length {0};
+        ifile.read(reinterpret_cast<char *>(&length), sizeof(length));
+        if (!ifile.good()) {
+            throw std::runtime_error(tlutfname + " ends in the middle of a record");
+        }
+        if (tid >= lengths.size()) { lengths.resize(tid + 1, 0); }
+        lengths[tid] = length;
+        ifile.seekg(recordEnd);
+    }
+    return lengths;
+}
+
 /*
 std::vector<std::unique_ptr<TranscriptInfo>> getTranscriptsFromFile(const std::string &tlutfname,
         const std::vector<Offset> &offsets,
@@ -207,7 +255,8 @@ std::vector<Offset> buildTLUTIndex(const std::string &tlutfname, size_t numTrans
     std::cerr << "done\n";
 
     std::cerr << "opening file\n";
-    std::ifstream ifile(tlutfname, std::ios::binary);
+    LUTInput input(tlutfname);
+    std::istream& ifile = input.stream();
     std::cerr << "done\n";
 
     size_t numRecords {0};
@@ -231,7 +280,6 @@ std::vector<Offset> buildTLUTIndex(const std::string &tlutfname, size_t numTrans
         ++pb;
     }
 
-    ifile.close();
     return offsets;
 }
 
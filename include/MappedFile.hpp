@@ -0,0 +1,162 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "CompressedFile.hpp"
+#include "HugePageAllocator.hpp"
+
+namespace sailfish {
+
+/**
+*  A read-only, shared memory mapping of an entire file.  The mapping is
+*  released when the object is destroyed.  Since the pages are shared and
+*  backed by the file, several processes mapping the same file share a single
+*  copy of it in the page cache.
+*
+*  A file in the compressed container format (see CompressedFile.hpp) is
+*  instead decompressed, on all cores, into private (huge page backed)
+*  memory, so the contents are what they would be if the file were stored
+*  uncompressed.
+**/
+class MappedFile {
+  public:
+   explicit MappedFile(const std::string& fname) : base_(nullptr), size_(0), decompressed_(false) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("could not open " + fname + " [" + std::strerror(errno) + "]");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("could not stat " + fname + " [" + std::strerror(errno) + "]");
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void* addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("could not mmap " + fname + " [" + std::strerror(errno) + "]");
+      }
+      base_ = static_cast<char*>(addr);
+#ifdef MADV_HUGEPAGE
+      // kernels that can back read-only file mappings with huge pages only
+      // do so when asked; this is a hint, so failure is fine
+      madvise(addr, size_, MADV_HUGEPAGE);
+#endif
+    }
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (compressed::isCompressed(base_, size_)) { decompress_(fname); }
+   }
+
+   ~MappedFile() {
+    if (base_ == nullptr) { return; }
+    if (decompressed_) { hugepages::deallocate(base_, allocatedSize_()); } else { munmap(base_, size_); }
+   }
+
+   MappedFile(const MappedFile&) = delete;
+   MappedFile& operator=(const MappedFile&) = delete;
+
+   /**
+   *  Fault the whole file in ahead of its use.  MADV_WILLNEED starts the
+   *  kernel's (asynchronous) readahead of the file, and numThreads threads
+   *  then read a byte from every page, so that the page table entries of
+   *  the mapping are filled in in parallel rather than one fault at a time
+   *  by whichever thread happens to use each page first.
+   **/
+   void prefault(uint32_t numThreads) const {
+    if (base_ == nullptr) { return; }
+    madvise(base_, size_, MADV_WILLNEED);
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    numThreads = std::max(numThreads, uint32_t(1));
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < numThreads; ++t) {
+      threads.emplace_back([this, t, numThreads, pageSize]() -> void {
+        // each thread touches a contiguous stretch, so that readahead helps
+        size_t numPages = (size_ + pageSize - 1) / pageSize;
+        size_t perThread = (numPages + numThreads - 1) / numThreads;
+        size_t end = std::min(numPages, (t + 1) * perThread);
+        volatile char sink{0};
+        for (size_t p = t * perThread; p < end; ++p) { sink = sink + base_[p * pageSize]; }
+      });
+    }
+    for (auto& t : threads) { t.join(); }
+   }
+
+   inline const char* base() const { return base_; }
+   inline size_t size() const { return size_; }
+
+   // True if the file was stored compressed
+   inline bool decompressed() const { return decompressed_; }
+
+  private:
+   /**
+   *  Replace the mapping of a compressed file with its decompressed
+   *  contents.  The container is checked before anything is allocated for
+   *  them, so a corrupt header can't ask for an arbitrary allocation, and
+   *  the mapping is released however this fails.
+   **/
+   void decompress_(const std::string& fname) {
+    char* mapped = base_;
+    size_t mappedSize = size_;
+    base_ = nullptr;
+    try {
+      size_ = compressed::rawSize(mapped, mappedSize);
+      base_ = static_cast<char*>(hugepages::allocate(allocatedSize_()));
+      decompressed_ = true;
+      uint32_t numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+      compressed::decompress(mapped, mappedSize, base_, numThreads);
+    } catch (std::exception& e) {
+      munmap(mapped, mappedSize);
+      if (base_ != nullptr) { hugepages::deallocate(base_, allocatedSize_()); }
+      base_ = nullptr;
+      throw std::runtime_error("could not decompress " + fname + " [" + e.what() + "]");
+    }
+    munmap(mapped, mappedSize);
+   }
+
+   inline size_t allocatedSize_() const { return std::max(size_, size_t(1)); }
+
+   char* base_;
+   size_t size_;
+   bool decompressed_;
+};
+
+}
+
+#endif // MAPPED_FILE_HPP
@@ -0,0 +1,93 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef PARALLEL_READ_HPP
+#define PARALLEL_READ_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace sailfish {
+
+/**
+*  Read size bytes, starting at byte offset of the file fname, into dst.
+*  The range is split into chunks of at least minChunk bytes that numThreads
+*  threads pread concurrently; on a file that is not yet in the page cache
+*  this keeps several requests outstanding, and the threads also fault in
+*  the pages of dst in parallel.  Throws if the file is shorter than
+*  offset + size.
+**/
+inline void preadParallel(const std::string& fname, uint64_t offset, char* dst, size_t size,
+                          uint32_t numThreads, size_t minChunk = size_t(1) << 22) {
+  if (size == 0) { return; }
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("could not open " + fname + " [" + std::strerror(errno) + "]");
+  }
+  size_t numChunks = std::max(size_t(1), std::min(size_t(std::max(numThreads, 1u)), size / minChunk));
+  size_t chunkSize = (size + numChunks - 1) / numChunks;
+
+  std::atomic<int> error{0};
+  std::atomic<bool> truncated{false};
+  auto readChunk = [&](size_t c) -> void {
+    size_t begin = c * chunkSize;
+    size_t end = std::min(size, begin + chunkSize);
+    while (begin < end and error == 0 and !truncated) {
+      ssize_t n = pread(fd, dst + begin, end - begin, offset + begin);
+      if (n < 0) {
+        if (errno != EINTR) { error = errno; }
+      } else if (n == 0) {
+        truncated = true;
+      } else {
+        begin += n;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t c = 1; c < numChunks; ++c) { threads.emplace_back(readChunk, c); }
+  readChunk(0);
+  for (auto& t : threads) { t.join(); }
+  close(fd);
+
+  if (error != 0) {
+    throw std::runtime_error("could not read " + fname + " [" + std::strerror(error) + "]");
+  }
+  if (truncated) {
+    throw std::runtime_error(fname + " is shorter than expected");
+  }
+}
+
+}
+
+#endif // PARALLEL_READ_HPP
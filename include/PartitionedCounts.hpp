@@ -0,0 +1,145 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef PARTITIONED_COUNTS_HPP
+#define PARTITIONED_COUNTS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "tbb/concurrent_queue.h"
+
+#include "CountDBNew.hpp"
+
+/**
+*  An alternative to having every thread atomically increment the shared
+*  count vector.  The kmer id space is split into contiguous partitions, one
+*  per counting thread.  Threads route the ids they find into per-partition
+*  buffers; full buffers are handed to the partition's owner, which is the
+*  only thread that ever writes to the counters in that partition and can
+*  therefore apply them with plain (non-atomic) adds.  Heavily-hit kmers no
+*  longer cause cache lines to bounce between cores.
+*
+*  Each counting thread creates one Writer (with a distinct owner index) and
+*  must call finish() on it when it has no more ids to add; finish() returns
+*  once every count destined for the thread's own partition has been applied.
+**/
+template <typename KmerT>
+class PartitionedCountsT {
+  // (ids are full width; a hashed or succinct index may hold 2^32 keys or more)
+  using IDBuffer = std::vector<size_t>;
+  using CountDB = CountDBNewT<KmerT>;
+
+  public:
+   static constexpr size_t BufferSize = 1024;
+
+   PartitionedCountsT( CountDB& counts, uint32_t numPartitions ) :
+      counts_(counts), numPartitions_(numPartitions), 
+      queues_(new tbb::concurrent_queue<IDBuffer>[numPartitions]),
+      numFinished_(0) {
+     // the smallest power of two partition size that covers all of the ids
+     shift_ = 0;
+     size_t perPartition = (counts_.size() + numPartitions - 1) / numPartitions;
+     while ((size_t(1) << shift_) < perPartition) { ++shift_; }
+   }
+
+   inline uint32_t partition(size_t id) { return id >> shift_; }
+
+   class Writer {
+    public:
+     Writer( PartitionedCountsT& pc, uint32_t owner ) : pc_(pc), owner_(owner), 
+        buffers_(pc.numPartitions_) {
+       for (auto& b : buffers_) { b.reserve(BufferSize); }
+     }
+
+     // route every valid id in ids[0, n) to its partition
+     inline void add(const size_t* ids, size_t n) {
+       for (size_t i = 0; i < n; ++i) {
+         if (ids[i] == pc_.counts_.INVALID) { continue; }
+         auto p = pc_.partition(ids[i]);
+         auto& b = buffers_[p];
+         b.push_back(ids[i]);
+         if (b.size() == BufferSize) {
+           handOff_(p);
+           // keep up with the work that other threads hand us
+           pc_.drain_(owner_);
+         }
+       }
+     }
+
+     void finish() {
+       for (uint32_t p = 0; p < pc_.numPartitions_; ++p) {
+         if (!buffers_[p].empty()) { handOff_(p); }
+       }
+       ++pc_.numFinished_;
+       // Once every writer has finished, nothing more will be added to our
+       // queue, so one final pass drains it completely.
+       while (pc_.numFinished_ < pc_.numPartitions_) {
+         if (!pc_.drain_(owner_)) { std::this_thread::yield(); }
+       }
+       pc_.drain_(owner_);
+     }
+
+    private:
+     void handOff_(uint32_t p) {
+       if (p == owner_) {
+         pc_.apply_(buffers_[p]);
+         buffers_[p].clear();
+       } else {
+         pc_.queues_[p].push(std::move(buffers_[p]));
+         buffers_[p] = IDBuffer();
+         buffers_[p].reserve(BufferSize);
+       }
+     }
+
+     PartitionedCountsT& pc_;
+     uint32_t owner_;
+     std::vector<IDBuffer> buffers_;
+   };
+
+  private:
+   // apply all of the buffers currently waiting for partition p; returns
+   // true if there was anything to apply
+   bool drain_(uint32_t p) {
+     IDBuffer b;
+     bool any{false};
+     while (queues_[p].try_pop(b)) { apply_(b); any = true; }
+     return any;
+   }
+
+   inline void apply_(const IDBuffer& b) {
+     for (auto id : b) { counts_.incAtIndexOwned(id); }
+   }
+
+   CountDB& counts_;
+   uint32_t numPartitions_;
+   uint32_t shift_;
+   std::unique_ptr<tbb::concurrent_queue<IDBuffer>[]> queues_;
+   std::atomic<uint32_t> numFinished_;
+};
+
+using PartitionedCounts = PartitionedCountsT<uint64_t>;
+
+#endif // PARTITIONED_COUNTS_HPP
@@ -23,62 +23,365 @@
 #ifndef __PERFECT_HASH_INDEX_HPP__
 #define __PERFECT_HASH_INDEX_HPP__
 
+#include <algorithm>
 #include <vector>
 #include <chrono>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
 #include <memory>
 #include <functional>
+#include <stdexcept>
+#include <limits>
+#include <string>
 
 #include <sys/mman.h>
 
 #include "boost/timer/timer.hpp"
+#include "tbb/parallel_sort.h"
 #include "cmph.h"
 
-//template <typename Deleter>
-class PerfectHashIndex {
-  using Kmer = uint64_t;
+#include "MappedFile.hpp"
+#include "KmerMPHF.hpp"
+#include "BlockedBloomFilter.hpp"
+#include "EliasFano.hpp"
+#include "HugePageAllocator.hpp"
+#include "KmerWord.hpp"
+
+// The minimal perfect hash function used by an index; a DENSE index has no
+// hash function at all, but a table with an entry for every possible kmer,
+// and an ELIAS_FANO index stores the sorted kmers succinctly (see EliasFano)
+enum class HashType : uint32_t { CMPH = 0, NATIVE = 1, DENSE = 2, ELIAS_FANO = 3 };
+
+/**
+*  The on-disk layout of a (memory-mappable) Sailfish index.  The header
+*  occupies the first page of the file; the key array (or the array of key
+*  fingerprints) and the packed perfect hash each start on a page boundary,
+*  so that the file can be mapped and used in place without copying anything
+*  onto the heap.  An index may also carry a membership filter over its
+*  keys, which also starts on a page boundary.
+**/
+struct SFIHeader {
+  // "SFIDX" followed by the format version; an index written in the original
+  // (unmappable) format begins with the kmer length, which is never larger
+  // than 32 and so can't be mistaken for the magic number.
+  static constexpr uint64_t Magic = 0x0000015844494653ULL;
+  static constexpr size_t Alignment = 4096;
+
+  uint64_t magic;
+  uint32_t merSize;
+  uint32_t canonical;
+  uint64_t numKeys;
+  uint64_t keysOffset;
+  uint64_t hashOffset;
+  uint64_t hashSize;
+  // a HashType; indices without this field have it zeroed, i.e. CMPH
+  uint32_t hashType;
+  // 0 if the full keys are stored; otherwise the width (8, 16 or 32) of the
+  // key fingerprints that are stored in their place
+  uint32_t fingerprintBits;
+  // the (optional) BlockedBloomFilter over the keys, which follows the hash;
+  // indices without a filter have both fields zeroed
+  uint64_t filterOffset;
+  uint64_t filterSize;
+};
+
+/**
+*  The kmer length recorded in the index fname (in either format); this
+*  determines the kmer word type (see KmerWord.hpp) that the index must be
+*  loaded with.
+**/
+inline uint32_t readIndexKmerLength(const std::string& fname) {
+  FILE* in = fopen(fname.c_str(), "r");
+  if (in == nullptr) { throw std::runtime_error("could not open " + fname); }
+  SFIHeader header;
+  std::memset(&header, 0, sizeof(header));
+  size_t numRead = fread(reinterpret_cast<char*>(&header), 1, sizeof(header), in);
+  fclose(in);
+  if (numRead >= sizeof(uint64_t) and header.magic == sailfish::compressed::Header::Magic) {
+    // the index is compressed (see CompressedFile.hpp); its header is in the first frame
+    std::memset(&header, 0, sizeof(header));
+    numRead = sailfish::compressed::readPrefix(fname, reinterpret_cast<char*>(&header), sizeof(header));
+  }
+  if (numRead == sizeof(header) and header.magic == SFIHeader::Magic) { return header.merSize; }
+  // the original format begins with the kmer length
+  uint32_t merSize{0};
+  std::memcpy(&merSize, &header, sizeof(merSize));
+  return merSize;
+}
+
+/**
+*  A perfect hash based index of a fixed set of kmers, each packed into a word
+*  of type KmerT.  PerfectHashIndex (below) is the index of kmers of up to 32
+*  bases.
+**/
+template <typename KmerT>
+class PerfectHashIndexT {
+  using Kmer = KmerT;
   using Count = uint32_t;
   using AtomicKmer = std::atomic<Kmer>;
   using AtomicCount = std::atomic<Count>;
   using Deleter = std::function<void(cmph_t*)>;
 
   public:
+   // Indices over kmers at most this long may be built as dense tables; the
+   // table for the longest of them has 4^14 (4-byte) entries, i.e. 1GB.
+   static constexpr uint32_t DenseMaxK = 14;
+   // A dense table is always used if it's at most this large, ...
+   static constexpr size_t DenseMinBytes = size_t(1) << 20;
+   // ... and otherwise only if it's at most this many times the size of the
+   // keys that a hashed index would store instead.
+   static constexpr size_t DenseMaxRatio = 4;
+   // The entry of a dense table for a kmer that isn't in the index
+   static constexpr uint32_t DenseAbsent = std::numeric_limits<uint32_t>::max();
+
+   // The keys and the packed hash are held in huge page backed memory
+   using KmerVector = std::vector<Kmer, sailfish::HugePageAllocator<Kmer>>;
+   using ByteVector = std::vector<char, sailfish::HugePageAllocator<char>>;
+
    // We'll return this invalid id if a kmer is not found in our DB
    size_t INVALID = std::numeric_limits<size_t>::max();
 
-   PerfectHashIndex( std::vector<Kmer>& kmers, std::unique_ptr<cmph_t, Deleter>& hash, 
-                     uint32_t merSize, bool canonical ) : kmers_(std::move(kmers)), 
-                                                          hash_(std::move(hash)), 
-                                                          hashRaw_(hash_.get()),
+   /**
+   *  Build an index from an explicit set of keys and the perfect hash over
+   *  them.  The hash is converted to cmph's packed representation (the same
+   *  one that is stored on disk), and the original is released.
+   **/
+   PerfectHashIndexT( KmerVector& kmers, std::unique_ptr<cmph_t, Deleter>& hash, 
+                     uint32_t merSize, bool canonical ) : ownedKmers_(std::move(kmers)), 
+                                                          hashType_(HashType::CMPH),
+                                                          fingerprintBits_(0),
                                                           merSize_(merSize),
-                                                          canonical_(canonical) {}
+                                                          canonical_(canonical) {
+    if (hash) {
+      ownedHash_.resize(cmph_packed_size(hash.get()));
+      cmph_pack(hash.get(), &ownedHash_[0]);
+      hash.reset();
+    }
+    kmers_ = ownedKmers_.data();
+    fingerprints_ = nullptr;
+    numKmers_ = ownedKmers_.size();
+    hashRaw_ = ownedHash_.data();
+    filterRaw_ = nullptr;
+   }
+
+   /**
+   *  Build an index from an explicit set of keys and an already packed hash
+   *  function of the given type (e.g. the output of KmerMPHF::build).
+   *
+   *  If fingerprintBits is non-zero, only a fingerprint of that many bits
+   *  (8, 16 or 32) is kept for each key, and the keys themselves are
+   *  discarded.  A kmer that is not in the index is then (wrongly) reported
+   *  as present with probability 2^-fingerprintBits.
+   **/
+   PerfectHashIndexT( KmerVector& kmers, std::vector<char>& packedHash, HashType hashType,
+                     uint32_t merSize, bool canonical, 
+                     uint32_t fingerprintBits = 0 ) : ownedKmers_(std::move(kmers)),
+                                                      ownedHash_(packedHash.begin(), packedHash.end()),
+                                                      hashType_(hashType),
+                                                      fingerprintBits_(fingerprintBits),
+                                                      merSize_(merSize),
+                                                      canonical_(canonical) {
+    std::vector<char>().swap(packedHash);
+    numKmers_ = ownedKmers_.size();
+    hashRaw_ = ownedHash_.data();
+    filterRaw_ = nullptr;
+    kmers_ = nullptr;
+    fingerprints_ = nullptr;
+    if (keyless_()) {
+      // the table (or the encoded set) determines the id of a kmer exactly,
+      // so lookups need no keys
+      KmerVector().swap(ownedKmers_);
+      fingerprintBits_ = 0;
+      return;
+    }
+    switch (fingerprintBits_) {
+      case 0:
+        kmers_ = ownedKmers_.data();
+        break;
+      case 8:
+        fillFingerprints_<uint8_t>();
+        break;
+      case 16:
+        fillFingerprints_<uint16_t>();
+        break;
+      case 32:
+        fillFingerprints_<uint32_t>();
+        break;
+      default:
+        throw std::invalid_argument("fingerprints must be 8, 16 or 32 bits wide");
+    }
+   }
+
+   /**
+   *  Build a direct-addressed index over kmers, which must have length at
+   *  most DenseMaxK.  The "hash" is a table of 4^merSize ids, indexed by the
+   *  2-bit encoded kmer itself, holding the position of each kmer in kmers
+   *  (or DenseAbsent).  A lookup is a single array access, and since each
+   *  slot belongs to exactly one kmer, no keys are kept to verify lookups.
+   **/
+   // The size in bytes of the dense table over kmers of length merSize
+   static size_t denseTableBytes( uint32_t merSize ) { return sizeof(uint32_t) << (2 * merSize); }
+
+   /**
+   *  Should an index over numKeys kmers of length merSize be a dense table?
+   *  The table covers every possible kmer, so over a small set of keys it's
+   *  mostly empty, and much larger than a hashed index.
+   **/
+   static bool denseFits( uint32_t merSize, size_t numKeys ) {
+    if (merSize > DenseMaxK) { return false; }
+    size_t tableBytes = denseTableBytes(merSize);
+    return tableBytes <= DenseMinBytes or tableBytes / DenseMaxRatio <= numKeys * sizeof(Kmer);
+   }
+
+   static PerfectHashIndexT denseIndex( KmerVector& kmers, uint32_t merSize, bool canonical ) {
+    if (merSize > DenseMaxK) {
+      throw std::invalid_argument("dense indices only support kmers of up to " + 
+                                  std::to_string(DenseMaxK) + " bases");
+    }
+    size_t numSlots = size_t(1) << (2 * merSize);
+    std::vector<char> table(sizeof(uint32_t) * numSlots);
+    uint32_t* ids = reinterpret_cast<uint32_t*>(&table[0]);
+    const uint32_t absent = DenseAbsent;
+    std::fill(ids, ids + numSlots, absent);
+    for (size_t i = 0; i < kmers.size(); ++i) { ids[static_cast<size_t>(kmers[i])] = static_cast<uint32_t>(i); }
+    size_t numKeys = kmers.size();
+
+    PerfectHashIndexT index(kmers, table, HashType::DENSE, merSize, canonical);
+    index.numKmers_ = numKeys;
+    return index;
+   }
+
+   /**
+   *  Build a succinct index over kmers (of at most 32 bases), for when
+   *  memory is tight.  The kmers are sorted and stored as an Elias-Fano
+   *  sequence, which replaces both the perfect hash and the key array; the
+   *  id of a kmer is its rank in sorted order, and a lookup is a rank query.
+   *  This takes a fraction of the memory of a hashed index (for the index
+   *  itself; the counts are unchanged), at the cost of slower lookups.
+   **/
+   static PerfectHashIndexT eliasFanoIndex( KmerVector& kmers, uint32_t merSize, bool canonical ) {
+    if (sizeof(Kmer) > sizeof(uint64_t)) {
+      throw std::invalid_argument("Elias-Fano indices only support kmers of up to 32 bases");
+    }
+    std::vector<uint64_t> sorted(kmers.size());
+    for (size_t i = 0; i < kmers.size(); ++i) { sorted[i] = static_cast<uint64_t>(kmers[i]); }
+    tbb::parallel_sort(sorted.begin(), sorted.end());
+    std::vector<char> packed = EliasFano::build(sorted);
+    size_t numKeys = sorted.size();
+
+    PerfectHashIndexT index(kmers, packed, HashType::ELIAS_FANO, merSize, canonical);
+    index.numKmers_ = numKeys;
+    return index;
+   }
 
-   PerfectHashIndex( PerfectHashIndex&& ph ) {
+   PerfectHashIndexT( PerfectHashIndexT&& ph ) {
    	merSize_ = ph.merSize_;
-   	hash_ = std::move(ph.hash_);
-    hashRaw_ = hash_.get();
-   	kmers_ = std::move(ph.kmers_);
     canonical_ = ph.canonical_;
+    // moving the vectors leaves their buffers (and hence the raw pointers) intact
+   	ownedKmers_ = std::move(ph.ownedKmers_);
+    ownedHash_ = std::move(ph.ownedHash_);
+    ownedFingerprints_ = std::move(ph.ownedFingerprints_);
+    ownedFilter_ = std::move(ph.ownedFilter_);
+    mapping_ = std::move(ph.mapping_);
+    kmers_ = ph.kmers_;
+    fingerprints_ = ph.fingerprints_;
+    numKmers_ = ph.numKmers_;
+    hashRaw_ = ph.hashRaw_;
+    filterRaw_ = ph.filterRaw_;
+    hashType_ = ph.hashType_;
+    fingerprintBits_ = ph.fingerprintBits_;
    }
 
+   /**
+   *  Write the index in the mappable format described by SFIHeader.
+   **/
    void dumpToFile(const std::string& fname) {
    	FILE* out = fopen(fname.c_str(), "w");
-
-   	// read the key set
-    fwrite( reinterpret_cast<char*>(&merSize_), sizeof(merSize_), 1, out );
-    fwrite( reinterpret_cast<char*>(&canonical_), sizeof(canonical_), 1, out);
-    size_t numCounts = kmers_.size();
-    fwrite( reinterpret_cast<char*>(&numCounts), sizeof(size_t), 1, out );
-    fwrite( reinterpret_cast<char*>(&kmers_[0]), sizeof(Kmer), numCounts, out );
-
-    cmph_dump(hash_.get(), out); 
+    if (out == nullptr) { throw std::runtime_error("could not open " + fname + " for writing"); }
+
+    auto align = [](uint64_t off) -> uint64_t { 
+      return ((off + SFIHeader::Alignment - 1) / SFIHeader::Alignment) * SFIHeader::Alignment;
+    };
+
+    SFIHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = SFIHeader::Magic;
+    header.merSize = merSize_;
+    header.canonical = canonical_;
+    header.numKeys = numKmers_;
+    header.keysOffset = SFIHeader::Alignment;
+    header.hashOffset = align(header.keysOffset + keysSize_());
+    header.hashSize = hashSize_();
+    header.hashType = static_cast<uint32_t>(hashType_);
+    header.fingerprintBits = fingerprintBits_;
+    header.filterSize = filterSize_();
+    header.filterOffset = (header.filterSize > 0) ? align(header.hashOffset + header.hashSize) : 0;
+
+    std::vector<char> padding(SFIHeader::Alignment, 0);
+    fwrite( reinterpret_cast<char*>(&header), sizeof(header), 1, out );
+    fwrite( &padding[0], 1, header.keysOffset - sizeof(header), out );
+    if (keysSize_() > 0) { fwrite( keys_(), 1, keysSize_(), out ); }
+    fwrite( &padding[0], 1, header.hashOffset - (header.keysOffset + keysSize_()), out );
+    fwrite( hashRaw_, 1, header.hashSize, out );
+    if (header.filterSize > 0) {
+      fwrite( &padding[0], 1, header.filterOffset - (header.hashOffset + header.hashSize), out );
+      fwrite( filterRaw_, 1, header.filterSize, out );
+    }
     fclose(out);
+   }
 
+   /**
+   *  Load an index.  Indices in the mappable format are mapped read-only
+   *  and used in place (once the sections their header describes are found
+   *  to lie within the file); indices in the original format are read onto
+   *  the heap.
+   **/
+   static PerfectHashIndexT fromFile( const std::string& fname ) {
+    uint32_t merSize = readIndexKmerLength(fname);
+    uint32_t maxK = sailfish::kmers::maxKmerLength<Kmer>();
+    if (merSize > maxK or (maxK > 32 and merSize <= 32)) {
+      throw std::runtime_error(fname + " indexes kmers of length " + std::to_string(merSize) + 
+                               ", which can't be loaded into an index of " + 
+                               std::to_string(maxK) + "-base kmer words");
+    }
+    std::shared_ptr<sailfish::MappedFile> mapping(new sailfish::MappedFile(fname));
+    if (mapping->size() >= sizeof(SFIHeader) and 
+        reinterpret_cast<const SFIHeader*>(mapping->base())->magic == SFIHeader::Magic) {
+      auto header = reinterpret_cast<const SFIHeader*>(mapping->base());
+      checkSections_(fname, *header, mapping->base(), mapping->size());
+      KmerVector noKmers;
+      std::vector<char> noHash;
+      PerfectHashIndexT index(noKmers, noHash, static_cast<HashType>(header->hashType), 
+                             header->merSize, header->canonical, header->fingerprintBits);
+      const char* keys = mapping->base() + header->keysOffset;
+      if (index.keyless_()) {
+        // there are no keys
+      } else if (index.fingerprintBits_ == 0) {
+        index.kmers_ = reinterpret_cast<const Kmer*>(keys);
+      } else {
+        index.fingerprints_ = keys;
+      }
+      index.numKmers_ = header->numKeys;
+      index.hashRaw_ = mapping->base() + header->hashOffset;
+      if (header->filterSize > 0) { index.filterRaw_ = mapping->base() + header->filterOffset; }
+      index.mapping_ = mapping;
+      return index;
+    }
+    if (mapping->decompressed()) {
+      throw std::runtime_error(fname + " is compressed, but only indices in the mappable format can be");
+    }
+    mapping.reset();
+    return fromLegacyFile(fname);
    }
 
-   static PerfectHashIndex fromFile( const std::string& fname ) {
+   /**
+   *  Load an index written in the original format:
+   *  merSize, canonical, numKeys, the keys and finally the (cmph_dump'ed) hash.
+   **/
+   static PerfectHashIndexT fromLegacyFile( const std::string& fname ) {
    	FILE* in = fopen(fname.c_str(),"r");
+    if (in == nullptr) { throw std::runtime_error("could not open " + fname); }
 
    	// read the key set
     uint32_t merSize;
@@ -87,88 +390,366 @@ class PerfectHashIndex {
     fread( reinterpret_cast<char*>(&canonical), sizeof(canonical), 1, in );
     size_t numCounts;
     fread( reinterpret_cast<char*>(&numCounts), sizeof(size_t), 1, in );
-    std::vector<Kmer> kmers(numCounts, Kmer(0));
+    KmerVector kmers(numCounts, Kmer(0));
     fread( reinterpret_cast<char*>(&kmers[0]), sizeof(Kmer), numCounts, in );
 
     // read the hash
     std::unique_ptr<cmph_t, Deleter> hash( cmph_load(in), cmph_destroy );
-    PerfectHashIndex index(kmers, hash, merSize, canonical);
+    PerfectHashIndexT index(kmers, hash, merSize, canonical);
 
     fclose(in);
 
     return index;
    }
 
-   inline size_t getKmerIndex( uint64_t kmer ) {
-    return kmer % kmers_.size();
+   /**
+   *  Copy an index that is mapped from disk into (huge page backed) memory
+   *  of its own, and release the mapping.  This gives up sharing the index
+   *  with other processes through the page cache, but the page cache is
+   *  made of small pages, so random lookups into a mapped index miss in the
+   *  TLB far more often.
+   **/
+   void copyFromMapping() {
+    if (!mapping_) { return; }
+    if (kmers_ != nullptr) {
+      ownedKmers_.assign(kmers_, kmers_ + numKmers_);
+      kmers_ = ownedKmers_.data();
+    } else if (fingerprints_ != nullptr) {
+      ownedFingerprints_.assign(fingerprints_, fingerprints_ + keysSize_());
+      fingerprints_ = ownedFingerprints_.data();
+    }
+    ownedHash_.assign(hashRaw_, hashRaw_ + hashSize_());
+    hashRaw_ = ownedHash_.data();
+    if (filterRaw_ != nullptr) {
+      ownedFilter_.assign(filterRaw_, filterRaw_ + filterSize_());
+      filterRaw_ = ownedFilter_.data();
+    }
+    mapping_.reset();
+   }
+
+   // Report the kind of pages backing the keys and the hash
+   void reportBacking() {
+    sailfish::hugepages::reportBacking("index keys", keys_(), keysSize_());
+    sailfish::hugepages::reportBacking("index hash", hashRaw_, hashSize_());
+    if (filterRaw_ != nullptr) { sailfish::hugepages::reportBacking("index filter", filterRaw_, filterSize_()); }
+   }
+
+   /**
+   *  Attach a membership filter (the output of BlockedBloomFilter::build
+   *  over this index's keys).  Every lookup then consults the filter first,
+   *  and a kmer that the filter rejects is never hashed.
+   **/
+   void setFilter( std::vector<char>& filter ) {
+    ownedFilter_.assign(filter.begin(), filter.end());
+    std::vector<char>().swap(filter);
+    filterRaw_ = ownedFilter_.data();
+   }
+
+   inline bool hasFilter() { return filterRaw_ != nullptr; }
+
+   inline size_t getKmerIndex( Kmer kmer ) {
+    return kmer % numKmers_;
+   }
+
+   inline size_t index( Kmer kmer ) {
+    if (hashType_ == HashType::DENSE) { return denseId_(kmer); }
+    if (hashType_ == HashType::ELIAS_FANO) {
+      if (filterRaw_ != nullptr and !BlockedBloomFilter::mayContain(filterRaw_, kmer)) { return INVALID; }
+      return eliasFanoId_(kmer);
+    }
+    size_t id = slot(kmer);
+    return (id != INVALID and matches_(id, kmer)) ? id : INVALID;
+   }
+
+   /**
+   *  Look up a batch of kmers at once, writing the id of kmers[i] (or INVALID)
+   *  into ids[i].  All of the kmers are hashed first (see slots()), and the
+   *  key (or fingerprint) slots they land on are prefetched before any of
+   *  them is verified.  This lets the (independent) cache misses on the keys
+   *  overlap rather than being paid one after another.
+   **/
+   inline void index( const Kmer* kmers, size_t n, size_t* ids ) {
+    if (hashType_ == HashType::DENSE) {
+      const uint32_t* table = reinterpret_cast<const uint32_t*>(hashRaw_);
+      for (size_t i = 0; i < n; ++i) { __builtin_prefetch(&table[static_cast<size_t>(kmers[i])]); }
+      for (size_t i = 0; i < n; ++i) { ids[i] = denseId_(kmers[i]); }
+      return;
+    }
+    if (hashType_ == HashType::ELIAS_FANO) {
+      screen_(kmers, n, ids);
+      for (size_t i = 0; i < n; ++i) {
+        if (ids[i] != INVALID) { ids[i] = eliasFanoId_(kmers[i]); }
+      }
+      return;
+    }
+    slots(kmers, n, ids);
+    for (size_t i = 0; i < n; ++i) {
+      if (ids[i] != INVALID) { __builtin_prefetch(keys_() + ids[i] * keyBytes_()); }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      ids[i] = (ids[i] != INVALID and matches_(ids[i], kmers[i])) ? ids[i] : INVALID;
+    }
+   }
+
+   /**
+   *  The slot that kmer hashes to, without checking the key stored there;
+   *  for a kmer that isn't in the index, this is an arbitrary slot (or
+   *  INVALID, if the filter rejects it).  This is for callers that keep
+   *  their own copy of the keys (see CountDBNew's interleaved layout).  Dense
+   *  and Elias-Fano indices have no such slots.
+   **/
+   inline size_t slot( Kmer kmer ) {
+    if (filterRaw_ != nullptr and !BlockedBloomFilter::mayContain(filterRaw_, kmer)) { return INVALID; }
+    return slot_(kmer);
    }
 
-   inline size_t index( uint64_t kmer ) {
-   	char *key = reinterpret_cast<char*>(&kmer);
-    unsigned int id{cmph_search(hashRaw_, key, sizeof(uint64_t))};
-    return (kmers_[id] == kmer) ? id : INVALID;
+   /**
+   *  The (unverified) slots of a batch of kmers.  If the index has a filter,
+   *  the whole batch is screened by it (with the filter blocks prefetched)
+   *  first, and only the kmers that pass are hashed.
+   **/
+   inline void slots( const Kmer* kmers, size_t n, size_t* slots ) {
+    screen_(kmers, n, slots);
+    if (hashType_ == HashType::NATIVE) {
+      for (size_t i = 0; i < n; ++i) {
+        if (slots[i] != INVALID) { KmerMPHF::prefetch(hashRaw_, kmers[i]); }
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      if (slots[i] != INVALID) { slots[i] = slot_(kmers[i]); }
+    }
    }
 
-   inline size_t numKeys() { return kmers_.size(); }
+   inline size_t numKeys() { return numKmers_; }
+   // The size of the (packed) hash function, or of the dense table or
+   // succinct set that takes its place
+   inline size_t hashBytes() { return hashSize_(); }
 
+   /**
+   *  Check that every key maps back to itself.  Only an index that stores
+   *  the full keys can be verified; an index of fingerprints (or a dense
+   *  index) is trusted.
+   **/
    bool verify() {
+    if (kmers_ == nullptr) { return true; }
    	auto start = std::chrono::steady_clock::now();
-   	for ( auto k : kmers_ ) { 
+   	for ( size_t i = 0; i < numKmers_; ++i ) { 
+      auto k = kmers_[i];
    		if( kmers_[index(k)] != k ) { return false; }
    	}
    	auto end = std::chrono::steady_clock::now();
    	auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
-   	std::cerr << "verified: " << static_cast<double>(ms.count()) / kmers_.size() << " us / key\n";
+   	std::cerr << "verified: " << static_cast<double>(ms.count()) / numKmers_ << " us / key\n";
    	return true;
    }
 
+   /**
+   *  Prepare the index for lookups using numThreads threads, and return the
+   *  number of bytes that were faulted in.  A mapped index is faulted in
+   *  from the page cache (or the disk) in parallel; an index in private
+   *  memory was written when it was loaded, and is already resident.
+   **/
+   size_t warmUp(uint32_t numThreads) {
+    if (!mapping_) { return 0; }
+    mapping_->prefault(numThreads);
+    return mapping_->size();
+   }
+
    void will_need(uint32_t threadIdx, uint32_t numThreads) {
      auto pageSize = sysconf(_SC_PAGESIZE);
-     size_t numPages{0};
-     
-     auto entriesPerPage = pageSize / sizeof(char);
-     auto size = cmph_size(hashRaw_);
-     numPages = (sizeof(char) * size) / entriesPerPage;
-     // number of pages that each thread should touch
-     auto numPagesPerThread = numPages / numThreads;
-     auto entriesPerThread = entriesPerPage * numPagesPerThread;
-     // the page this thread starts touching
-     auto start = entriesPerPage * threadIdx;
-     // the last page this thread touches
-     auto end = start + entriesPerThread;
-
-     for (size_t i = start; i < size; i += numThreads*entriesPerPage) {      
-      *(reinterpret_cast<char*>(hashRaw_)+i) = *(reinterpret_cast<char*>(hashRaw_)+i);
-     }
-
-     // entries per page
-     entriesPerPage = pageSize / sizeof(Kmer);
-     // total number of pages
-     size = kmers_.size();
-     numPages = (sizeof(Kmer) * kmers_.size()) / entriesPerPage;
-     // number of pages that each thread should touch
-     numPagesPerThread = numPages / numThreads;
-     entriesPerThread = entriesPerPage * numPagesPerThread;
-     // the page this thread starts touching
-     start = entriesPerPage * threadIdx;
-     // the last page this thread touches
-     end = start + entriesPerThread;
-     for (size_t i = start; i < size; i += numThreads*entriesPerPage) {
-      //std::cerr << "thread " << threadIdx << " is touching page " << i / entriesPerPage << "\n";
-      kmers_[i] = kmers_[i];
-     }
+     // The index may be mapped read-only, so we fault the pages in by
+     // reading (rather than writing) a byte from each of them.
+     volatile char sink{0};
+
+     auto touch = [&](const char* base, size_t size) -> void {
+       for (size_t i = pageSize * threadIdx; i < size; i += numThreads * pageSize) {      
+         sink = sink + base[i];
+       }
+     };
+     touch(hashRaw_, hashSize_());
+     touch(keys_(), keysSize_());
+     if (filterRaw_ != nullptr) { touch(filterRaw_, filterSize_()); }
    }
 
    inline bool canonical() { return canonical_; }
    inline uint32_t kmerLength() { return merSize_; }
-   const std::vector<Kmer>& kmers() { return kmers_; }
+   // The keys of the index, or nullptr if it stores only their fingerprints
+   // (or is dense, and stores no keys at all)
+   inline const Kmer* kmers() { return kmers_; }
+
+   inline uint32_t fingerprintBits() { return fingerprintBits_; }
+
+   /**
+   *  The fingerprint of a kmer; fingerprints of width b are the low b bits.
+   *  This hash is unrelated to the ones used by the perfect hash, so the
+   *  fingerprint of a kmer is independent of the slot it lands in.
+   **/
+   static inline uint64_t fingerprint( Kmer kmer ) { return sailfish::kmers::fingerprintWord(kmer); }
+
+   // The fingerprint stored for the key with the given id
+   inline uint32_t storedFingerprint( size_t id ) {
+    switch (fingerprintBits_) {
+      case 8: return reinterpret_cast<const uint8_t*>(fingerprints_)[id];
+      case 16: return reinterpret_cast<const uint16_t*>(fingerprints_)[id];
+      default: return reinterpret_cast<const uint32_t*>(fingerprints_)[id];
+    }
+   }
+
+   inline HashType hashType() { return hashType_; }
 
    private:
-   	std::vector<Kmer> kmers_;
-   	std::unique_ptr<cmph_t, Deleter> hash_;
-    cmph_t* hashRaw_;
+    /**
+    *  Check that the sections described by the header of the mapped index
+    *  fname (of the given size) lie within it, so that a truncated or corrupt
+    *  file is an error rather than a read past the end of the mapping.  The
+    *  table of a dense index, which is addressed by the kmers themselves,
+    *  must have an entry for every kmer, and the blocks of the filter must
+    *  fit in its section.
+    **/
+    static void checkSections_( const std::string& fname, const SFIHeader& header, 
+                                const char* base, uint64_t size ) {
+      auto within = [size](uint64_t offset, uint64_t bytes) -> bool { 
+        return offset <= size and bytes <= size - offset; 
+      };
+      auto corrupt = [&fname](const std::string& what) -> std::runtime_error {
+        return std::runtime_error(fname + " is not a valid index: " + what);
+      };
+      if (header.hashType > static_cast<uint32_t>(HashType::ELIAS_FANO)) {
+        throw corrupt("unknown hash type " + std::to_string(header.hashType));
+      }
+      HashType hashType = static_cast<HashType>(header.hashType);
+      if (hashType != HashType::DENSE and hashType != HashType::ELIAS_FANO) {
+        uint32_t bits = header.fingerprintBits;
+        if (bits != 0 and bits != 8 and bits != 16 and bits != 32) {
+          throw corrupt("fingerprints can't be " + std::to_string(bits) + " bits wide");
+        }
+        uint64_t keyBytes = (bits == 0) ? sizeof(Kmer) : bits / 8;
+        // (written so that it can't overflow)
+        if (header.keysOffset > size or header.numKeys > (size - header.keysOffset) / keyBytes) {
+          throw corrupt("its " + std::to_string(header.numKeys) + " keys run past the end of the file");
+        }
+      }
+      if (!within(header.hashOffset, header.hashSize)) {
+        throw corrupt("its hash runs past the end of the file");
+      }
+      if (hashType == HashType::DENSE and 
+          (header.merSize > DenseMaxK or header.hashSize != (sizeof(uint32_t) << (2 * header.merSize)))) {
+        throw corrupt("its dense table doesn't have an entry for every kmer");
+      }
+      if (header.filterSize > 0) {
+        if (!within(header.filterOffset, header.filterSize) or header.filterSize < BlockedBloomFilter::HeaderBytes) {
+          throw corrupt("its filter runs past the end of the file");
+        }
+        BlockedBloomFilter::Header filter;
+        std::memcpy(&filter, base + header.filterOffset, sizeof(filter));
+        uint64_t blockBytes = BlockedBloomFilter::WordsPerBlock * sizeof(uint64_t);
+        if (filter.numBlocks == 0 or 
+            filter.numBlocks > (header.filterSize - BlockedBloomFilter::HeaderBytes) / blockBytes) {
+          throw corrupt("its filter blocks run past the end of the file");
+        }
+      }
+    }
+
+    // The slot that kmer hashes to; the key stored there must still be
+    // checked to know whether kmer is actually in the index.
+    inline size_t slot_( Kmer kmer ) {
+      if (hashType_ == HashType::NATIVE) { return KmerMPHF::lookup(hashRaw_, kmer); }
+      char *key = reinterpret_cast<char*>(&kmer);
+      return cmph_search_packed(const_cast<char*>(hashRaw_), key, sizeof(Kmer));
+    }
+
+    // Set out[i] to INVALID if the filter rejects kmers[i], and to 0 otherwise
+    inline void screen_( const Kmer* kmers, size_t n, size_t* out ) {
+      if (filterRaw_ == nullptr) { std::fill(out, out + n, size_t(0)); return; }
+      for (size_t i = 0; i < n; ++i) { BlockedBloomFilter::prefetch(filterRaw_, kmers[i]); }
+      for (size_t i = 0; i < n; ++i) { 
+        out[i] = BlockedBloomFilter::mayContain(filterRaw_, kmers[i]) ? 0 : INVALID; 
+      }
+    }
+
+    // The id of kmer in an Elias-Fano index (whose kmers fit in 64 bits)
+    inline size_t eliasFanoId_( Kmer kmer ) {
+      uint64_t r = EliasFano::rank(hashRaw_, static_cast<uint64_t>(kmer));
+      return (r == EliasFano::NotFound) ? INVALID : r;
+    }
+
+    // Dense and Elias-Fano indices store no keys (or fingerprints)
+    inline bool keyless_() { return hashType_ == HashType::DENSE or hashType_ == HashType::ELIAS_FANO; }
+
+    // The id of kmer in a dense index
+    inline size_t denseId_( Kmer kmer ) {
+      uint32_t id = reinterpret_cast<const uint32_t*>(hashRaw_)[static_cast<size_t>(kmer)];
+      return (id == DenseAbsent) ? INVALID : id;
+    }
+
+    // Does the key (or fingerprint) stored in slot id match kmer?
+    inline bool matches_( size_t id, Kmer kmer ) {
+      switch (fingerprintBits_) {
+        case 0:
+          return kmers_[id] == kmer;
+        case 8:
+          return reinterpret_cast<const uint8_t*>(fingerprints_)[id] == 
+                 static_cast<uint8_t>(fingerprint(kmer));
+        case 16:
+          return reinterpret_cast<const uint16_t*>(fingerprints_)[id] == 
+                 static_cast<uint16_t>(fingerprint(kmer));
+        default:
+          return reinterpret_cast<const uint32_t*>(fingerprints_)[id] == 
+                 static_cast<uint32_t>(fingerprint(kmer));
+      }
+    }
+
+    // Replace the (owned) keys with their fingerprints
+    template <typename FP>
+    void fillFingerprints_() {
+      ownedFingerprints_.resize(sizeof(FP) * numKmers_);
+      FP* fps = reinterpret_cast<FP*>(ownedFingerprints_.data());
+      for (size_t i = 0; i < numKmers_; ++i) { fps[i] = static_cast<FP>(fingerprint(ownedKmers_[i])); }
+      KmerVector().swap(ownedKmers_);
+      fingerprints_ = ownedFingerprints_.data();
+    }
+
+    inline const char* keys_() {
+      return (fingerprintBits_ == 0) ? reinterpret_cast<const char*>(kmers_) : fingerprints_;
+    }
+    inline size_t keyBytes_() { 
+      if (keyless_()) { return 0; }
+      return (fingerprintBits_ == 0) ? sizeof(Kmer) : fingerprintBits_ / 8; 
+    }
+    inline size_t keysSize_() { return keyBytes_() * numKmers_; }
+
+    size_t hashSize_() {
+      if (!mapping_) { return ownedHash_.size(); }
+      return reinterpret_cast<const SFIHeader*>(mapping_->base())->hashSize;
+    }
+
+    size_t filterSize_() {
+      if (filterRaw_ == nullptr) { return 0; }
+      if (!mapping_) { return ownedFilter_.size(); }
+      return reinterpret_cast<const SFIHeader*>(mapping_->base())->filterSize;
+    }
+
+    // Storage for an index that lives on the heap
+   	KmerVector ownedKmers_;
+    ByteVector ownedFingerprints_;
+    ByteVector ownedHash_;
+    ByteVector ownedFilter_;
+    // Storage for an index that is mapped from disk
+    std::shared_ptr<sailfish::MappedFile> mapping_;
+
+    // The keys (or their fingerprints) and packed hash, wherever they live
+    const Kmer* kmers_;
+    const char* fingerprints_;
+    size_t numKmers_;
+    const char* hashRaw_;
+    // The membership filter over the keys, or nullptr if there is none
+    const char* filterRaw_;
+    HashType hashType_;
+    uint32_t fingerprintBits_;
    	uint32_t merSize_;
     bool canonical_;
 };
 
+using PerfectHashIndex = PerfectHashIndexT<uint64_t>;
+
 #endif // __PERFECT_HASH_INDEX_HPP__
\ No newline at end of file
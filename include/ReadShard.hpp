@@ -0,0 +1,147 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef READ_SHARD_HPP
+#define READ_SHARD_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace sailfish {
+
+/**
+*  A hash of the name of a read, given its header line (without the leading
+*  '>' or '@').  The name ends at the first whitespace, and a trailing "/1"
+*  or "/2" is ignored, so that the two ends of a pair hash alike.  The hash
+*  depends only on the name, so it is the same in every process and on
+*  every machine.
+**/
+inline uint64_t readNameHash(const char* header, size_t len) {
+  size_t end = 0;
+  while (end < len and header[end] != ' ' and header[end] != '\t') { ++end; }
+  if (end >= 2 and header[end - 2] == '/' and (header[end - 1] == '1' or header[end - 1] == '2')) { end -= 2; }
+  // FNV-1a, followed by a final mix so that the low bits are well distributed
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < end; ++i) {
+    h ^= static_cast<uint8_t>(header[i]);
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+*  Shard i of N of a set of reads (given on the command line as "i/N", with
+*  0 <= i < N).  If there are at least N read files, the shard is made of
+*  whole files (those whose position in the list is i modulo N); otherwise
+*  it is made of the reads whose name hashes to i modulo N.  Either way,
+*  every read belongs to exactly one of the N shards.
+**/
+class ReadShard {
+  public:
+   ReadShard() : index_(0), count_(1) {}
+
+   // Parse a shard given as "i/N"
+   static ReadShard parse(const std::string& spec) {
+    auto slash = spec.find('/');
+    // (digits only, so that neither number can be negative)
+    bool digits = slash != std::string::npos and slash > 0 and slash + 1 < spec.size() and 
+                  spec.find_first_not_of("0123456789/") == std::string::npos and 
+                  spec.find('/', slash + 1) == std::string::npos;
+    if (digits) {
+      // (strtoull saturates, so a number too large for a count is caught)
+      unsigned long long index = std::strtoull(spec.c_str(), nullptr, 10);
+      unsigned long long count = std::strtoull(spec.c_str() + slash + 1, nullptr, 10);
+      if (count > 0 and count <= std::numeric_limits<uint32_t>::max() and index < count) {
+        ReadShard shard;
+        shard.index_ = static_cast<uint32_t>(index);
+        shard.count_ = static_cast<uint32_t>(count);
+        return shard;
+      }
+    }
+    throw std::invalid_argument("a shard must be given as i/N, with 0 <= i < N, not " + spec);
+   }
+
+   inline uint32_t index() const { return index_; }
+   inline uint32_t count() const { return count_; }
+
+   // True if this shard holds all of the reads
+   inline bool all() const { return count_ == 1; }
+
+   // True if the shard is made of whole files, when there are numFiles
+   inline bool byFile(size_t numFiles) const { return !all() and numFiles >= count_; }
+
+   // True if the file at position i of the list belongs to this shard
+   inline bool ownsFile(size_t i) const { return i % count_ == index_; }
+
+   // True if the read with the given header belongs to this shard
+   inline bool ownsRead(const char* header, size_t len) const {
+    return readNameHash(header, len) % count_ == index_;
+   }
+
+  private:
+   uint32_t index_;
+   uint32_t count_;
+};
+
+/**
+*  A uniform sample of a fraction of a set of reads, made of the reads whose
+*  name hashes below the fraction (of the hash range).  Like a ReadShard, it
+*  depends only on the names of the reads, so the same reads are sampled
+*  every time, whatever the order or number of threads they're read by, and
+*  the two ends of a pair are sampled together.  The hash is remixed (and
+*  compared on its high bits) so that a sample is independent of a shard.
+**/
+class ReadSample {
+  public:
+   explicit ReadSample(double fraction = 1.0) : fraction_(fraction) {
+    if (!(fraction > 0.0 and fraction <= 1.0)) {
+      throw std::invalid_argument("a sample fraction must be in (0, 1], not " + std::to_string(fraction));
+    }
+    // compare the top 53 bits of the hash, which a double holds exactly
+    threshold_ = static_cast<uint64_t>(fraction * 9007199254740992.0);
+   }
+
+   inline double fraction() const { return fraction_; }
+
+   // True if the sample is all of the reads
+   inline bool all() const { return fraction_ == 1.0; }
+
+   // True if the read with the given header is in the sample
+   inline bool keeps(const char* header, size_t len) const {
+    return ((readNameHash(header, len) * 0x9e3779b97f4a7c15ULL) >> 11) < threshold_;
+   }
+
+  private:
+   double fraction_;
+   uint64_t threshold_;
+};
+
+}
+
+#endif // READ_SHARD_HPP
@@ -0,0 +1,784 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#ifndef SEQUENCE_READER_HPP
+#define SEQUENCE_READER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "MappedFile.hpp"
+
+namespace sailfish {
+
+/**
+*  A FASTA or FASTQ record, which points into the file it was read from.
+*  [header, header + hlen) is the header line (without the leading '>' or
+*  '@'), [seq_s, seq_e) the sequence and [qual_s, qual_e) the qualities (an
+*  empty range for FASTA).  The sequence of a multi-line FASTA record
+*  includes its line breaks (which KmerStream ignores); trailing line breaks
+*  are never included.
+**/
+struct SequenceRecord {
+  const char* header;
+  size_t hlen;
+  const char* seq_s;
+  const char* seq_e;
+  const char* qual_s;
+  const char* qual_e;
+};
+
+/**
+*  An input that can only be read from front to back: standard input ("-"),
+*  a named pipe, or a /dev/fd pipe.  It is never seeked, so that reads can
+*  be consumed as they arrive.  Gzip compressed input (recognized by its
+*  first two bytes) is inflated as it is read.
+**/
+class StreamSource {
+  public:
+   explicit StreamSource(const std::string& fname) : 
+       fd_(-1), own_(fname != "-"), started_(false), gzip_(false), eof_(false), inMember_(false),
+       in_(size_t(1) << 16) {
+    fd_ = own_ ? open(fname.c_str(), O_RDONLY) : STDIN_FILENO;
+    if (fd_ < 0) { throw std::runtime_error("could not open " + fname + " [" + std::strerror(errno) + "]"); }
+    std::memset(&zs_, 0, sizeof(zs_));
+   }
+
+   ~StreamSource() {
+    if (gzip_) { inflateEnd(&zs_); }
+    if (own_) { close(fd_); }
+   }
+
+   StreamSource(const StreamSource&) = delete;
+   StreamSource& operator=(const StreamSource&) = delete;
+
+   // Read up to n bytes into dst; fewer only at the end of the input
+   size_t read(char* dst, size_t n) {
+    if (!started_) { start_(); }
+    size_t got{0};
+    while (got < n) {
+      if (zs_.avail_in == 0 and !eof_) { fill_(); }
+      if (zs_.avail_in == 0) {
+        if (inMember_) { throw std::runtime_error("unexpected end of gzip input"); }
+        break;
+      }
+      if (!gzip_) {
+        size_t m = std::min(n - got, static_cast<size_t>(zs_.avail_in));
+        std::memcpy(dst + got, zs_.next_in, m);
+        zs_.next_in += m;
+        zs_.avail_in -= m;
+        got += m;
+        continue;
+      }
+      inMember_ = true;
+      zs_.next_out = reinterpret_cast<Bytef*>(dst + got);
+      // zlib counts its output in 32-bit words
+      zs_.avail_out = std::min(n - got, size_t(1) << 30);
+      uInt avail = zs_.avail_out;
+      int ret = inflate(&zs_, Z_NO_FLUSH);
+      got += avail - zs_.avail_out;
+      if (ret == Z_STREAM_END) {
+        // the input may hold several gzip members, one after another
+        inMember_ = false;
+        inflateReset(&zs_);
+      } else if (ret != Z_OK and ret != Z_BUF_ERROR) {
+        throw std::runtime_error(zs_.msg ? zs_.msg : "inflate failed");
+      }
+    }
+    return got;
+   }
+
+   inline bool compressed() const { return gzip_; }
+
+  private:
+   // Read whatever is available (blocking only until something is)
+   void fill_() {
+    for (;;) {
+      ssize_t r = ::read(fd_, in_.data(), in_.size());
+      if (r < 0 and errno == EINTR) { continue; }
+      if (r < 0) { throw std::runtime_error(std::string("read failed [") + std::strerror(errno) + "]"); }
+      zs_.next_in = in_.data();
+      zs_.avail_in = r;
+      eof_ = (r == 0);
+      return;
+    }
+   }
+
+   // Look at the first two bytes to see whether the input is gzipped
+   void start_() {
+    started_ = true;
+    fill_();
+    if (zs_.avail_in == 1 and !eof_) {
+      unsigned char first = in_[0];
+      fill_();
+      // put the first byte back in front of the rest
+      std::memmove(in_.data() + 1, zs_.next_in, std::min<size_t>(zs_.avail_in, in_.size() - 1));
+      in_[0] = first;
+      zs_.next_in = in_.data();
+      zs_.avail_in = std::min<size_t>(zs_.avail_in + 1, in_.size());
+    }
+    gzip_ = (zs_.avail_in >= 2 and in_[0] == 0x1f and in_[1] == 0x8b);
+    if (gzip_) {
+      Bytef* next = zs_.next_in;
+      uInt avail = zs_.avail_in;
+      // 15 + 16: a gzip (not zlib or raw) stream
+      if (inflateInit2(&zs_, 15 + 16) != Z_OK) { throw std::runtime_error("inflateInit2 failed"); }
+      zs_.next_in = next;
+      zs_.avail_in = avail;
+    }
+   }
+
+   int fd_;
+   bool own_;
+   bool started_;
+   bool gzip_;
+   bool eof_;
+   bool inMember_;
+   std::vector<unsigned char> in_;
+   z_stream zs_;
+};
+
+/**
+*  Reads the records of a set of FASTA (single or multi-line) and FASTQ
+*  (4-line) files.  A regular file is mapped into memory and read in place,
+*  in chunks of about chunkSize bytes.  A chunk boundary is moved forward to
+*  the start of the next record (a line beginning with '>' in FASTA; in
+*  FASTQ, a line beginning with '@' whose second next line begins with '+',
+*  which a quality line can't be mistaken for), so that each thread can
+*  parse the chunks it takes on its own.  Threads take chunks from a shared
+*  counter, which is the only thing they share.
+*
+*  Any other input ("-" for standard input, a named pipe, or a gzipped file)
+*  is read through a StreamSource, a chunk at a time, by whichever thread
+*  needs one next.  The chunk is cut after its last complete record, and
+*  the rest is carried over to the next one; the threads parse the chunks
+*  in parallel, while more input arrives.
+*
+*  The interface follows that of jellyfish::parse_read: each thread calls
+*  new_thread() to get its own stream, and next_read() on that stream until
+*  it returns nullptr.  A record is valid until the next call.
+**/
+class SequenceReader {
+  struct File {
+    std::string name;
+    std::unique_ptr<MappedFile> map;
+    bool fastq;
+    // for a streamed file, the source, the part of the last read that
+    // followed its last record, and the offset of that part in the input
+    std::unique_ptr<StreamSource> source;
+    std::vector<char> carry;
+    size_t consumed;
+    bool formatKnown;
+  };
+
+  struct Chunk {
+    uint32_t file;
+    size_t begin;
+    size_t end;
+  };
+
+  // The records that begin in [begin, end), with data up to limit
+  struct Span {
+    const File* file;
+    const char* begin;
+    const char* end;
+    const char* limit;
+    size_t offset;
+    std::shared_ptr<std::vector<char>> buffer;
+  };
+
+  // Parses the records of a span, one at a time
+  class SpanParser {
+    public:
+     SpanParser() : pos_(nullptr) {
+      span_.file = nullptr;
+      span_.begin = span_.end = span_.limit = nullptr;
+     }
+
+     // The span to parse next
+     Span& span() { return span_; }
+     void rewind() { pos_ = span_.begin; }
+
+     // Parse the next record into record; false at the end of the span
+     // (or at a malformed record, if malformed() is then true)
+     bool next(SequenceRecord& record) {
+      // skip blank lines between records
+      while (pos_ < span_.end and (*pos_ == '\n' or *pos_ == '\r')) { ++pos_; }
+      if (pos_ >= span_.end) { return false; }
+      malformed_ = !(span_.file->fastq ? parseFastq_(record) : parseFasta_(record));
+      return !malformed_;
+     }
+
+     inline bool malformed() const { return pos_ < span_.end and malformed_; }
+
+     std::string malformedError() const {
+      return span_.file->name + " has a malformed record at offset " + 
+             std::to_string(span_.offset + (pos_ - span_.begin));
+     }
+
+    private:
+     bool parseFasta_(SequenceRecord& record) {
+      if (*pos_ != '>') { return false; }
+      const char* limit = span_.limit;
+      const char* seq = nextLine_(pos_, limit);
+      record.header = pos_ + 1;
+      record.hlen = lineEnd_(pos_, limit) - record.header;
+      // the sequence lines never hold a '>', so the next one begins a header
+      auto next = static_cast<const char*>(std::memchr(seq, '>', limit - seq));
+      if (next == nullptr) { next = limit; }
+      const char* seqEnd = next;
+      while (seqEnd > seq and (seqEnd[-1] == '\n' or seqEnd[-1] == '\r')) { --seqEnd; }
+      record.seq_s = seq;
+      record.seq_e = seqEnd;
+      record.qual_s = record.qual_e = seqEnd;
+      pos_ = next;
+      return true;
+     }
+
+     bool parseFastq_(SequenceRecord& record) {
+      if (*pos_ != '@') { return false; }
+      const char* limit = span_.limit;
+      const char* seq = nextLine_(pos_, limit);
+      const char* plus = nextLine_(seq, limit);
+      const char* qual = nextLine_(plus, limit);
+      if (plus >= limit or *plus != '+' or qual >= limit) { return false; }
+      record.header = pos_ + 1;
+      record.hlen = lineEnd_(pos_, limit) - record.header;
+      record.seq_s = seq;
+      record.seq_e = lineEnd_(seq, limit);
+      record.qual_s = qual;
+      record.qual_e = lineEnd_(qual, limit);
+      if (record.qual_e - record.qual_s != record.seq_e - record.seq_s) { return false; }
+      pos_ = nextLine_(qual, limit);
+      return true;
+     }
+
+     Span span_;
+     const char* pos_;
+     bool malformed_{false};
+  };
+
+  friend class PairedSequenceReader;
+
+  public:
+   explicit SequenceReader(const std::vector<std::string>& fnames, size_t chunkSize = size_t(1) << 23) : 
+       chunkSize_(std::max(chunkSize, size_t(1))), nextChunk_(0), nextStream_(0) {
+    for (auto& fname : fnames) {
+      File f = open_(fname);
+      if (f.source) {
+        streams_.push_back(files_.size());
+      } else {
+        size_t size = f.map->size();
+        for (size_t b = firstRecord_(f.map->base(), size); b < size; b += chunkSize_) {
+          chunks_.push_back(Chunk{static_cast<uint32_t>(files_.size()), b, std::min(size, b + chunkSize_)});
+        }
+      }
+      files_.push_back(std::move(f));
+    }
+   }
+
+   SequenceReader(const SequenceReader&) = delete;
+   SequenceReader& operator=(const SequenceReader&) = delete;
+
+   class Stream {
+    public:
+     explicit Stream(SequenceReader& reader) : reader_(&reader) {}
+
+     // The next record, or nullptr once there are none left
+     const SequenceRecord* next_read() {
+      while (!parser_.next(record_)) {
+        if (parser_.malformed()) {
+          reader_->fail_(parser_.malformedError());
+          return nullptr;
+        }
+        if (!reader_->takeSpan_(parser_.span())) { return nullptr; }
+        parser_.rewind();
+      }
+      return &record_;
+     }
+
+    private:
+     SequenceReader* reader_;
+     SpanParser parser_;
+     SequenceRecord record_;
+   };
+
+   Stream new_thread() { return Stream(*this); }
+
+   /**
+   *  Throw if any of the inputs had a malformed record or couldn't be read
+   *  (reading stops at the first one); call this once every stream has
+   *  returned nullptr.
+   **/
+   void finish() {
+    std::lock_guard<std::mutex> lock(errorMutex_);
+    if (!error_.empty()) { throw std::runtime_error(error_); }
+   }
+
+  private:
+   /**
+   *  Open fname: map it if it's a regular file (that isn't gzipped), and
+   *  otherwise open it as a stream, whose format is found once it's read.
+   **/
+   static File open_(const std::string& fname) {
+    File f{fname, nullptr, false, nullptr, {}, 0, false};
+    struct stat st;
+    bool regular = (fname != "-" and stat(fname.c_str(), &st) == 0 and S_ISREG(st.st_mode));
+    if (regular) {
+      f.map.reset(new MappedFile(fname));
+      auto base = reinterpret_cast<const unsigned char*>(f.map->base());
+      if (f.map->size() >= 2 and base[0] == 0x1f and base[1] == 0x8b) { f.map.reset(); }
+    }
+    if (!f.map) {
+      f.source.reset(new StreamSource(fname));
+      return f;
+    }
+    const char* base = f.map->base();
+    size_t size = f.map->size();
+    size_t first = firstRecord_(base, size);
+    if (first < size) {
+      if (base[first] != '>' and base[first] != '@') {
+        throw std::runtime_error(fname + " is neither a FASTA nor a FASTQ file");
+      }
+      f.fastq = (base[first] == '@');
+    }
+    f.formatKnown = true;
+    return f;
+   }
+
+   // Find the format of a streamed file from the first data read from it
+   static void detectFormat_(File& f, const char* data, size_t size) {
+    size_t first = firstRecord_(data, size);
+    if (f.formatKnown or first == size) { return; }
+    if (data[first] != '>' and data[first] != '@') {
+      throw std::runtime_error("it is neither FASTA nor FASTQ");
+    }
+    f.fastq = (data[first] == '@');
+    f.formatKnown = true;
+   }
+
+   // The start of the line after the one p is in
+   static const char* nextLine_(const char* p, const char* end) {
+    auto nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    return (nl == nullptr) ? end : nl + 1;
+   }
+
+   // The end of the line beginning at p, without its line break
+   static const char* lineEnd_(const char* p, const char* end) {
+    auto nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    const char* e = (nl == nullptr) ? end : nl;
+    return (e > p and e[-1] == '\r') ? e - 1 : e;
+   }
+
+   // The offset of the first thing other than white space
+   static size_t firstRecord_(const char* base, size_t size) {
+    size_t first{0};
+    while (first < size and std::isspace(static_cast<unsigned char>(base[first]))) { ++first; }
+    return first;
+   }
+
+   // True if the line at p begins a record (of a FASTQ file if fastq)
+   static bool isRecordStart_(const char* p, const char* end, bool fastq) {
+    if (!fastq) { return *p == '>'; }
+    if (*p != '@') { return false; }
+    const char* seq = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (seq == nullptr) { return false; }
+    const char* plus = static_cast<const char*>(std::memchr(seq + 1, '\n', end - (seq + 1)));
+    return plus != nullptr and plus + 1 < end and plus[1] == '+';
+   }
+
+   // The start of the first record at or after p (in [base, end))
+   static const char* resync_(const char* base, const char* end, const char* p, bool fastq) {
+    if (p >= end) { return end; }
+    // a record begins at the start of a line
+    if (p > base and p[-1] != '\n') { p = nextLine_(p, end); }
+    while (p < end and !isRecordStart_(p, end, fastq)) { p = nextLine_(p, end); }
+    return p;
+   }
+
+   // The start of the last record in [base, end) that begins after base, or base if there is none
+   static const char* lastRecord_(const char* base, const char* end, bool fastq) {
+    const char* p = end;
+    if (!fastq) {
+      // a header begins with a '>' at the start of a line (header text may
+      // hold a '>' too, but sequence lines never do)
+      while (p - base > 1) {
+        auto gt = static_cast<const char*>(memrchr(base + 1, '>', (p - 1) - base));
+        if (gt == nullptr) { break; }
+        if (gt[-1] == '\n') { return gt; }
+        p = gt;
+      }
+      return base;
+    }
+    while (p > base) {
+      // the start of the line before p
+      const char* nl = static_cast<const char*>(memrchr(base, '\n', (p - 1) - base));
+      const char* line = (nl == nullptr) ? base : nl + 1;
+      if (line > base and isRecordStart_(line, end, fastq)) { return line; }
+      p = line;
+    }
+    return base;
+   }
+
+   // Take the next span of records (if there is one) for a stream to parse
+   bool takeSpan_(Span& span) {
+    span.buffer.reset();
+    while (!failed_) {
+      size_t c = nextChunk_++;
+      if (c >= chunks_.size()) { break; }
+      const File& f = files_[chunks_[c].file];
+      const char* base = f.map->base();
+      const char* end = base + f.map->size();
+      span.file = &f;
+      span.begin = resync_(base, end, base + chunks_[c].begin, f.fastq);
+      span.end = resync_(base, end, base + chunks_[c].end, f.fastq);
+      span.limit = end;
+      span.offset = span.begin - base;
+      if (span.begin < span.end) { return true; }
+    }
+    return takeStreamed_(span);
+   }
+
+   // Read the next chunk of the streamed inputs
+   bool takeStreamed_(Span& span) {
+    std::lock_guard<std::mutex> lock(streamMutex_);
+    while (!failed_ and nextStream_ < streams_.size()) {
+      File& f = files_[streams_[nextStream_]];
+      try {
+        auto buffer = std::make_shared<std::vector<char>>();
+        buffer->swap(f.carry);
+        size_t cut{0};
+        bool eof{false};
+        while (!eof) {
+          size_t have = buffer->size();
+          buffer->resize(have + chunkSize_);
+          size_t got = f.source->read(buffer->data() + have, chunkSize_);
+          buffer->resize(have + got);
+          eof = (got < chunkSize_);
+          detectFormat_(f, buffer->data(), buffer->size());
+          if (!f.formatKnown) { continue; }
+          // keep reading until the chunk ends a record (a record may be
+          // longer than a chunk)
+          const char* base = buffer->data();
+          cut = eof ? buffer->size() : lastRecord_(base, base + buffer->size(), f.fastq) - base;
+          if (cut > 0) { break; }
+        }
+        f.carry.assign(buffer->begin() + cut, buffer->end());
+        buffer->resize(cut);
+        span.offset = f.consumed;
+        f.consumed += cut;
+        if (eof) {
+          // all that can be left uncut at the end is the white space of an
+          // input that holds no records (and whose format is still unknown)
+          f.carry.clear();
+          f.source.reset();
+          ++nextStream_;
+        }
+        if (cut == 0) { continue; }
+        span.file = &f;
+        span.begin = buffer->data();
+        span.end = span.limit = buffer->data() + cut;
+        span.buffer = std::move(buffer);
+        return true;
+      } catch (std::exception& e) {
+        fail_("could not read " + f.name + " [" + e.what() + "]");
+      }
+    }
+    return false;
+   }
+
+   void fail_(const std::string& error) {
+    std::lock_guard<std::mutex> lock(errorMutex_);
+    if (error_.empty()) { error_ = error; }
+    failed_ = true;
+   }
+
+   size_t chunkSize_;
+   std::vector<File> files_;
+   std::vector<Chunk> chunks_;
+   std::atomic<size_t> nextChunk_;
+   // the streamed files, read one after another
+   std::vector<size_t> streams_;
+   size_t nextStream_;
+   std::mutex streamMutex_;
+   std::atomic<bool> failed_{false};
+   std::mutex errorMutex_;
+   std::string error_;
+};
+
+/**
+*  Reads the mates of paired-end reads, from two lists of files in which the
+*  i-th records are the two mates of the i-th fragment.  Under a lock, the
+*  next fragmentsPerChunk records are cut from the first list, and as many
+*  from the second.  The threads then parse the pairs of chunks in parallel.
+*  Both lists may hold any input that SequenceReader takes, and the two
+*  needn't be split into files the same way.
+*
+*  Each thread calls new_thread() to get its own stream, and next_pair() on
+*  that stream until it returns false.
+**/
+class PairedSequenceReader {
+  using File = SequenceReader::File;
+  using Span = SequenceReader::Span;
+  using SpanParser = SequenceReader::SpanParser;
+
+  // One of the lists of files, and the part of its current file still to read
+  struct Side {
+    std::vector<File> files;
+    size_t current;
+    std::shared_ptr<std::vector<char>> buffer;
+    const char* pos;
+    const char* end;
+    bool eof;
+    // the offset of pos in the current file
+    size_t offset;
+  };
+
+  public:
+   PairedSequenceReader(const std::vector<std::string>& mates1, const std::vector<std::string>& mates2,
+                        size_t fragmentsPerChunk = size_t(1) << 14, size_t readSize = size_t(1) << 22) : 
+       fragmentsPerChunk_(std::max(fragmentsPerChunk, size_t(1))), readSize_(std::max(readSize, size_t(1))) {
+    for (auto& fname : mates1) { sides_[0].files.push_back(SequenceReader::open_(fname)); }
+    for (auto& fname : mates2) { sides_[1].files.push_back(SequenceReader::open_(fname)); }
+    for (auto& side : sides_) {
+      // (the first file is opened by the first take_)
+      side.current = std::numeric_limits<size_t>::max();
+      side.pos = side.end = nullptr;
+      side.eof = true;
+      side.offset = 0;
+    }
+   }
+
+   PairedSequenceReader(const PairedSequenceReader&) = delete;
+   PairedSequenceReader& operator=(const PairedSequenceReader&) = delete;
+
+   class Stream {
+    public:
+     explicit Stream(PairedSequenceReader& reader) : reader_(&reader) {}
+
+     // The next pair of mates; false once there are none left
+     bool next_pair(const SequenceRecord*& mate1, const SequenceRecord*& mate2) {
+      for (;;) {
+        bool has1 = parsers_[0].next(records_[0]);
+        bool has2 = parsers_[1].next(records_[1]);
+        if (has1 and has2) {
+          mate1 = &records_[0];
+          mate2 = &records_[1];
+          return true;
+        }
+        for (auto& parser : parsers_) {
+          if (parser.malformed()) {
+            reader_->fail_(parser.malformedError());
+            return false;
+          }
+        }
+        if (has1 or has2) {
+          reader_->fail_("the mates in " + parsers_[0].span().file->name + " and " + 
+                         parsers_[1].span().file->name + " are out of step");
+          return false;
+        }
+        if (!reader_->takePair_(parsers_[0].span(), parsers_[1].span())) { return false; }
+        parsers_[0].rewind();
+        parsers_[1].rewind();
+      }
+     }
+
+    private:
+     PairedSequenceReader* reader_;
+     SpanParser parsers_[2];
+     SequenceRecord records_[2];
+   };
+
+   Stream new_thread() { return Stream(*this); }
+
+   // Throw if either list had a malformed record, or if the lists don't pair up
+   void finish() {
+    std::lock_guard<std::mutex> lock(errorMutex_);
+    if (!error_.empty()) { throw std::runtime_error(error_); }
+   }
+
+  private:
+   /**
+   *  The end of the record at p, or nullptr if the rest of it hasn't been
+   *  read yet.  (A truncated record is left for the parser to report.)
+   **/
+   static const char* recordEnd_(const char* p, const char* end, bool fastq, bool eof) {
+    if (fastq) {
+      for (int line = 0; line < 4; ++line) {
+        auto nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (nl == nullptr) { return eof ? end : nullptr; }
+        p = nl + 1;
+      }
+      return p;
+    }
+    const char* seq = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    auto next = (seq == nullptr) ? nullptr : static_cast<const char*>(std::memchr(seq, '>', end - seq));
+    if (next == nullptr) { return eof ? end : nullptr; }
+    return next;
+   }
+
+   // Move side on to its next file with anything left in it; false if there is none
+   bool nextFile_(Side& side) {
+    while (side.pos == side.end and side.eof) {
+      side.current = (side.current == std::numeric_limits<size_t>::max()) ? 0 : side.current + 1;
+      side.buffer.reset();
+      side.offset = 0;
+      if (side.current > 0 and side.current <= side.files.size()) {
+        side.files[side.current - 1].source.reset();
+      }
+      if (side.current >= side.files.size()) {
+        side.pos = side.end = nullptr;
+        return false;
+      }
+      File& f = side.files[side.current];
+      if (f.map) {
+        side.pos = f.map->base();
+        side.end = side.pos + f.map->size();
+        side.eof = true;
+      } else {
+        side.pos = side.end = nullptr;
+        side.eof = false;
+      }
+    }
+    return true;
+   }
+
+   // Read more of side's current (streamed) file, after what's left of it
+   void read_(Side& side) {
+    File& f = side.files[side.current];
+    auto buffer = std::make_shared<std::vector<char>>(side.pos, side.end);
+    size_t have = buffer->size();
+    buffer->resize(have + readSize_);
+    size_t got = f.source->read(buffer->data() + have, readSize_);
+    buffer->resize(have + got);
+    side.eof = (got < readSize_);
+    SequenceReader::detectFormat_(f, buffer->data(), buffer->size());
+    side.buffer = std::move(buffer);
+    side.pos = side.buffer->data();
+    side.end = side.pos + side.buffer->size();
+   }
+
+   /**
+   *  Cut up to n records from side into span (all from one file), and
+   *  return the number cut; 0 once the side has none left.
+   **/
+   size_t take_(Side& side, size_t n, Span& span) {
+    while (nextFile_(side)) {
+      File& f = side.files[side.current];
+      if (!f.formatKnown) {
+        // (a stream of nothing but white space holds no records)
+        if (side.eof) { side.pos = side.end; } else { read_(side); }
+        continue;
+      }
+      const char* p = side.pos;
+      size_t taken{0};
+      for (; taken < n; ++taken) {
+        while (p < side.end and (*p == '\n' or *p == '\r')) { ++p; }
+        if (p == side.end) { break; }
+        const char* e = recordEnd_(p, side.end, f.fastq, side.eof);
+        if (e == nullptr) { break; }
+        p = e;
+      }
+      if (taken < n and !side.eof) {
+        read_(side);
+        continue;
+      }
+      span.file = &f;
+      span.begin = side.pos;
+      span.end = span.limit = p;
+      span.offset = side.offset;
+      span.buffer = side.buffer;
+      side.offset += p - side.pos;
+      // (blank lines at the end of the file are dropped with it)
+      side.pos = (taken < n) ? side.end : p;
+      if (taken > 0) { return taken; }
+    }
+    return 0;
+   }
+
+   // Cut the next pair of chunks; false once there are none left
+   bool takePair_(Span& span1, Span& span2) {
+    std::lock_guard<std::mutex> lock(sideMutex_);
+    if (failed_) { return false; }
+    try {
+      Side& side1 = sides_[0];
+      size_t n1 = take_(side1, fragmentsPerChunk_, span1);
+      size_t n2 = take_(sides_[1], std::max(n1, size_t(1)), span2);
+      if (n1 == 0 and n2 == 0) { return false; }
+      if (n2 == 0 or n1 == 0) {
+        throw std::runtime_error(std::string("there are more mates in ") + (n1 ? "the first" : "the second") + 
+                                 " list of files than in the other");
+      }
+      if (n2 < n1) {
+        // the second list's file ended first; give the rest of the first
+        // list's records back, to pair with the second list's next file
+        const char* p = span1.begin;
+        for (size_t i = 0; i < n2; ++i) {
+          while (*p == '\n' or *p == '\r') { ++p; }
+          p = recordEnd_(p, span1.end, span1.file->fastq, true);
+        }
+        side1.offset -= span1.end - p;
+        side1.pos = p;
+        span1.end = span1.limit = p;
+      }
+      return true;
+    } catch (std::exception& e) {
+      fail_(std::string("could not read the mates [") + e.what() + "]");
+      return false;
+    }
+   }
+
+   void fail_(const std::string& error) {
+    std::lock_guard<std::mutex> lock(errorMutex_);
+    if (error_.empty()) { error_ = error; }
+    failed_ = true;
+   }
+
+   Side sides_[2];
+   size_t fragmentsPerChunk_;
+   size_t readSize_;
+   std::mutex sideMutex_;
+   std::atomic<bool> failed_{false};
+   std::mutex errorMutex_;
+   std::string error_;
+};
+
+}
+
+#endif // SEQUENCE_READER_HPP
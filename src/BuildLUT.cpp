@@ -37,6 +37,7 @@
 #include <thread>
 #include <chrono>
 #include <iomanip>
+#include <algorithm>
 
 #include <boost/range/irange.hpp>
 #include <boost/program_options.hpp>
@@ -48,8 +49,6 @@
 #include "tbb/parallel_for_each.h"
 #include "tbb/task_scheduler_init.h"
 
-#include <jellyfish/sequence_parser.hpp>
-#include <jellyfish/parse_read.hpp>
 #include <jellyfish/mer_counting.hpp>
 #include <jellyfish/misc.hpp>
 #include <jellyfish/compacted_hash.hpp>
@@ -59,7 +58,9 @@
 #include "SailfishUtils.hpp"
 #include "GenomicFeature.hpp"
 #include "CountDBNew.hpp"
+#include "KmerStream.hpp"
 #include "ezETAProgressBar.hpp"
+#include "SequenceReader.hpp"
 
 using TranscriptID = uint32_t;
 using KmerID = uint64_t;
@@ -74,31 +75,21 @@ struct ContainingTranscript{
 
 /**
  * This function builds both a kmer => transcript and transcript => kmer
- * lookup table.
+ * lookup table.  KmerT is the kmer word type of the index (see KmerWord.hpp).
  */
+template <typename KmerT>
 int buildLUTs( 
   const std::vector<std::string>& transcriptFiles, //!< File from which transcripts are read
-  PerfectHashIndex& transcriptIndex,               //!< Index of transcript kmers
-  CountDBNew& transcriptHash,                      //!< Count of kmers in transcripts
+  PerfectHashIndexT<KmerT>& transcriptIndex,       //!< Index of transcript kmers
+  CountDBNewT<KmerT>& transcriptHash,              //!< Count of kmers in transcripts
   TranscriptGeneMap& tgmap,                        //!< Transcript => Gene map
   const std::string& tlutfname,                    //!< Transcript lookup table filename
   const std::string& klutfname,                    //!< Kmer lookup table filename
   uint32_t numThreads                              //!< Number of threads to use in parallel
   ) {
 
-  char** fnames = new char*[transcriptFiles.size()];
-  size_t z{0};
-  size_t numFnames{0};
-  for ( auto& s : transcriptFiles ){
-    // Ugly, yes?  But this is not as ugly as the alternatives.
-    // The char*'s contained in fname are owned by the transcriptFiles
-    // vector and need not be manually freed.
-    fnames[numFnames] = const_cast<char*>(s.c_str());
-    ++numFnames;
-  }
-
-  // Create a jellyfish parser
-  jellyfish::parse_read parser( fnames, fnames+numFnames, 1000);
+  // The transcripts are parsed in place
+  sailfish::SequenceReader parser(transcriptFiles);
 
   std::vector<std::thread> threads;
   std::vector<TranscriptList> transcriptsForKmer;
@@ -192,23 +183,21 @@ int buildLUTs(
        &transcriptIndex, &transcriptsForKmer, &tmut, merLen]() -> void {
 
         // Each thread gets it's own stream
-        jellyfish::parse_read::thread stream = parser.new_thread();
-        jellyfish::parse_read::read_t* read;
+        sailfish::SequenceReader::Stream stream = parser.new_thread();
+        const sailfish::SequenceRecord* read;
         auto INVALID = transcriptHash.INVALID;
         bool useCanonical{transcriptIndex.canonical()};
+        sailfish::kmers::KmerStreamT<KmerT> mers(merLen);
 
         // while there are transcripts left to process
         while ( (read = stream.next_read()) ) { 
           // The transcript name
-          std::string fullHeader(read->header, read->hlen);
-          std::string header = fullHeader.substr(0, fullHeader.find(' '));
+          std::string header(read->header, std::find(read->header, read->header + read->hlen, ' '));
           
-          // The transcript sequence
-          // strip the newlines from the sequence and put it into a string (newSeq)
-          std::string seq(read->seq_s, std::distance(read->seq_s, read->seq_e) - 1 );
-          auto newEnd  = std::remove( seq.begin(), seq.end(), '\n' );
-          auto readLen = std::distance( seq.begin(), newEnd );
-          std::string newSeq(seq.begin(), seq.begin() + readLen);
+          // The transcript sequence, which KmerStream reads across the line
+          // breaks of a multi-line record; they don't count toward its length
+          auto readLen = std::distance(read->seq_s, read->seq_e) - 
+                         std::count_if(read->seq_s, read->seq_e, [](char c) { return c == '\n' or c == '\r'; });
     
           // Lookup the ID of this transcript in our transcript -> gene map
           auto transcriptIndex = tgmap.findTranscriptID(header); 
@@ -228,18 +217,16 @@ int buildLUTs(
           tinfo->length = readLen;
           //tinfo->kmers.resize(numKmers);
 
-          // Iterate over the kmers
+          // Iterate over the kmers (kmers containing anything other than
+          // A, C, G or T are skipped, as they are when building the index)
           ReadLength effectiveLength(0);
-          for ( auto offset : boost::irange( size_t(0), numKmers) ) { 
-            // the kmer and it's uint64_t representation
-            auto mer = newSeq.substr( offset, merLen );             
-            auto binMer = jellyfish::parse_dna::mer_string_to_binary(mer.c_str(), merLen );
-            
-            if (useCanonical) {
-              auto rcMer = jellyfish::parse_dna::reverse_complement(binMer, merLen);
-              binMer = std::min(binMer, rcMer);
-            }
-
+          if (useCanonical) {
+            mers.canonical(read->seq_s, read->seq_e);
+          } else {
+            mers.directional(read->seq_s, read->seq_e);
+          }
+          for ( auto offset : boost::irange( size_t(0), mers.numKmers()) ) { 
+            auto binMer = mers.fwd()[offset];
             auto binMerId = transcriptHash.id(binMer);
             // Only count and track kmers which should be considered
             if ( binMerId != INVALID ) {
@@ -275,6 +262,37 @@ int buildLUTs(
   return 0;
 }
 
+template int buildLUTs<uint64_t>(const std::vector<std::string>&, PerfectHashIndexT<uint64_t>&, 
+                                 CountDBNewT<uint64_t>&, TranscriptGeneMap&, const std::string&, 
+                                 const std::string&, uint32_t);
+template int buildLUTs<sailfish::kmers::Kmer128>(const std::vector<std::string>&, 
+                                                 PerfectHashIndexT<sailfish::kmers::Kmer128>&, 
+                                                 CountDBNewT<sailfish::kmers::Kmer128>&, 
+                                                 TranscriptGeneMap&, const std::string&, 
+                                                 const std::string&, uint32_t);
+
+/**
+ * Load the index and transcript counts (with kmer word type KmerT) and build
+ * the lookup tables from them.
+ */
+template <typename KmerT>
+void loadIndexAndBuildLUTs(const std::vector<std::string>& genesFile, const std::string& sfIndexFile,
+                           const std::string& sfTrascriptCountFile, TranscriptGeneMap& tgmap,
+                           const std::string& tlutfname, const std::string& klutfname, 
+                           uint32_t numThreads) {
+  std::cerr << "Reading transcript index from [" << sfIndexFile << "] . . .";
+  auto sfIndex = PerfectHashIndexT<KmerT>::fromFile( sfIndexFile );
+  auto del = []( PerfectHashIndexT<KmerT>* h ) -> void { };
+  auto sfIndexPtr = std::shared_ptr<PerfectHashIndexT<KmerT>>( &sfIndex, del );
+  std::cerr << "done\n";
+
+  std::cerr << "Reading transcript counts from [" << sfTrascriptCountFile << "] . . .";
+  auto transcriptHash = CountDBNewT<KmerT>::fromFile(sfTrascriptCountFile, sfIndexPtr);
+  std::cerr << "done\n";
+
+  buildLUTs(genesFile, sfIndex, transcriptHash, tgmap, tlutfname, klutfname, numThreads);
+}
+
 /**
  * This function is the main command line driver for the lookup table
  * building phase of Sailfish.  The 'buildlut' command that invokes this
@@ -372,17 +390,14 @@ int mainBuildLUT(int argc, char* argv[] ) {
     } // archive and stream closed when destructors are called
 
 
-    std::cerr << "Reading transcript index from [" << sfIndexFile << "] . . .";
-    auto sfIndex = PerfectHashIndex::fromFile( sfIndexFile );
-    auto del = []( PerfectHashIndex* h ) -> void { };
-    auto sfIndexPtr = std::shared_ptr<PerfectHashIndex>( &sfIndex, del );
-    std::cerr << "done\n";
-
-    std::cerr << "Reading transcript counts from [" << sfTrascriptCountFile << "] . . .";
-    auto transcriptHash = CountDBNew::fromFile(sfTrascriptCountFile, sfIndexPtr);
-    std::cerr << "done\n";
-
-    buildLUTs(genesFile, sfIndex, transcriptHash, tgmap, tlutfname, klutfname, numThreads);
+    // the kmer length recorded in the index determines the kmer word type
+    if (readIndexKmerLength(sfIndexFile) <= sailfish::kmers::maxKmerLength<uint64_t>()) {
+      loadIndexAndBuildLUTs<uint64_t>(genesFile, sfIndexFile, sfTrascriptCountFile, tgmap, 
+                                      tlutfname, klutfname, numThreads);
+    } else {
+      loadIndexAndBuildLUTs<sailfish::kmers::Kmer128>(genesFile, sfIndexFile, sfTrascriptCountFile, tgmap, 
+                                                      tlutfname, klutfname, numThreads);
+    }
 
   } catch (po::error &e){
     std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
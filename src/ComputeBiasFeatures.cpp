@@ -25,13 +25,12 @@
 #include <iostream>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <atomic>
 #include <thread>
 
 #include "jellyfish/parse_dna.hpp"
 #include "jellyfish/mapped_file.hpp"
-#include "jellyfish/parse_read.hpp"
-#include "jellyfish/sequence_parser.hpp"
 #include "jellyfish/dna_codes.hpp"
 #include "jellyfish/compacted_hash.hpp"
 #include "jellyfish/mer_counting.hpp"
@@ -43,6 +42,7 @@
 #include <boost/filesystem.hpp>
 
 #include "CommonTypes.hpp"
+#include "SequenceReader.hpp"
 
 // holding 2-mers as a uint64_t is a waste of space,
 // but using Jellyfish makes life so much easier, so 
@@ -76,19 +76,8 @@ int computeBiasFeatures(
         }
         std::cerr << "\n";
 
-        char** fnames = new char*[readFiles.size()];
-        size_t z{0};
-        size_t numFnames{0};
-        for ( auto& s : readFiles ){
-            // Ugly, yes?  But this is not as ugly as the alternatives.
-            // The char*'s contained in fname are owned by the readFiles
-            // vector and need not be manually freed.
-            fnames[numFnames] = const_cast<char*>(s.c_str());
-            ++numFnames;
-        }
-
-        // Create a jellyfish parser
-        jellyfish::parse_read parser( fnames, fnames+numFnames, 5000);
+        // The transcripts are parsed in place
+        sailfish::SequenceReader parser(readFiles);
 
 
 	    size_t merLen = 2;
@@ -131,8 +120,8 @@ int computeBiasFeatures(
 	    threads.push_back(std::thread(
 	        [&featQueue, &numComplete, &parser, &readNum, &tstart, lshift, masq, merLen, numActors]() -> void {
 
-                jellyfish::parse_read::read_t* read;
-                jellyfish::parse_read::thread stream = parser.new_thread();
+                const sailfish::SequenceRecord* read;
+                sailfish::SequenceReader::Stream stream = parser.new_thread();
                 size_t cmlen, kmer, numKmers;
                 while ( (read = stream.next_read()) ) {
                     ++readNum; //++locallyProcessedReads;
@@ -155,7 +144,9 @@ int computeBiasFeatures(
                     numKmers = 0;
                     cmlen = kmer = 0;
 
-                    uint32_t readLen = std::distance(start, end);
+                    // the line breaks of a multi-line record aren't bases
+                    uint32_t readLen = std::distance(start, end) - 
+                                       std::count_if(start, end, [](char c) { return c == '\n' or c == '\r'; });
                     tfeat.name = std::string(read->header, read->header + read->hlen);
                     tfeat.length = readLen;
                     auto nfact = 1.0 / readLen;
@@ -181,19 +172,19 @@ int computeBiasFeatures(
                                   break;
 
                                 default:
+                                  // every base counts towards the GC content once,
+                                  // the first and last of the transcript included
+                                  if (base == 'G' or base == 'C') { tfeat.gcContent += nfact; }
                                   // form the new kmer
                                   kmer = ((kmer << 2) & masq) | c;
                                   if (++cmlen >= merLen) {
 									  tfeat.diNucleotides[kmer]++;
-									  if (base == 'G' or base == 'C') { tfeat.gcContent += nfact; }
 								  }
 
                             } // end switch
 
                         } // end while
 
-                    char lastBase = *(end - 1);
-                    if (lastBase == 'G' or lastBase == 'C') { tfeat.gcContent += nfact; }
                     featQueue.push(tfeat);
 
                 } // end reads
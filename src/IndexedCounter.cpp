@@ -26,12 +26,14 @@
 #include <vector>
 #include <algorithm>
 #include <limits>
+#include <cmath>
 #include <atomic>
 #include <chrono>
 #include <thread>
 #include <random>
 #include <functional>
 #include <memory>
+#include <future>
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/parsers.hpp>
@@ -51,8 +53,6 @@
 
 #include "jellyfish/parse_dna.hpp"
 #include "jellyfish/mapped_file.hpp"
-#include "jellyfish/parse_read.hpp"
-#include "jellyfish/sequence_parser.hpp"
 #include "jellyfish/dna_codes.hpp"
 #include "jellyfish/compacted_hash.hpp"
 #include "jellyfish/mer_counting.hpp"
@@ -62,6 +62,576 @@
 #include "cmph.h"
 
 #include "PerfectHashIndex.hpp"
+#include "BatchedKmerCounter.hpp"
+#include "PartitionedCounts.hpp"
+#include "KmerStream.hpp"
+#include "ReadShard.hpp"
+#include "GzipInput.hpp"
+#include "SequenceReader.hpp"
+
+/**
+*  The strand protocol of a library: whether each read (or the first mate of
+*  each fragment) is read from the strand of its transcript (Forward), from
+*  the opposite strand (Reverse), or from either one (Unstranded).
+**/
+enum class LibType : int { Unknown = 0, Unstranded = 1, Forward = 2, Reverse = 3 };
+
+// The --libtype names; "A" (automatic) leaves the type Unknown until it's inferred
+LibType parseLibType(const std::string& name) {
+    if (name == "A") { return LibType::Unknown; }
+    if (name == "U") { return LibType::Unstranded; }
+    if (name == "SF") { return LibType::Forward; }
+    if (name == "SR") { return LibType::Reverse; }
+    throw std::invalid_argument("--libtype must be one of A, U, SF or SR (not " + name + ")");
+}
+
+const char* libTypeName(LibType type) {
+    switch (type) {
+      case LibType::Unstranded: return "U (unstranded)";
+      case LibType::Forward: return "SF (stranded, forward)";
+      case LibType::Reverse: return "SR (stranded, reverse)";
+      default: return "A (not yet inferred)";
+    }
+}
+
+/**
+*  Infers the LibType of a library from the direction votes of its first
+*  SampleSize reads (or fragments).  Until the type is known, the counting
+*  threads report the vote of each read they count in both directions; once
+*  it is known, they count the reads of a stranded library in its direction
+*  alone.
+**/
+class LibTypeDetector {
+  public:
+   static const uint64_t SampleSize = 100000;
+
+   explicit LibTypeDetector(LibType type) : type_(static_cast<int>(type)) {}
+
+   inline LibType type() const { return static_cast<LibType>(type_.load(std::memory_order_relaxed)); }
+
+   // Report a read's vote: > 0 if more of its kmers are in the index
+   // forward than reverse, < 0 if fewer, and 0 if it's a tie
+   inline void vote(int v) {
+    if (v > 0) { ++forward_; } else if (v < 0) { ++reverse_; }
+    if (++sampled_ == SampleSize) { decide_(); }
+   }
+
+  private:
+   void decide_() {
+    uint64_t fwd = forward_;
+    uint64_t rev = reverse_;
+    uint64_t decided = fwd + rev;
+    // a library is stranded if at least 90% of the reads that had a
+    // preference (and there must be enough of them) agree
+    LibType type{LibType::Unstranded};
+    if (decided >= SampleSize / 100) {
+      if (fwd * 10 >= decided * 9) { type = LibType::Forward; }
+      if (rev * 10 >= decided * 9) { type = LibType::Reverse; }
+    }
+    std::cerr << "\ninferred library type " << libTypeName(type) << " from the first " << SampleSize 
+              << " reads (" << fwd << " forward, " << rev << " reverse)\n";
+    type_.store(static_cast<int>(type));
+   }
+
+   std::atomic<int> type_;
+   std::atomic<uint64_t> sampled_{0};
+   std::atomic<uint64_t> forward_{0};
+   std::atomic<uint64_t> reverse_{0};
+};
+
+// The qualities of a (FASTQ) read, or nullptr if it has none
+inline const char* qualities(const sailfish::SequenceRecord* read) {
+    return (read->qual_e > read->qual_s) ? read->qual_s : nullptr;
+}
+
+/**
+*  Count the kmers of the reads in vm["reads"] that occur in the index
+*  sfTrascriptIndexFile, writing the counts to countsFile.  KmerT is the kmer
+*  word type (see KmerWord.hpp); mainCount picks it from the kmer length
+*  recorded in the index.
+**/
+template <typename KmerT>
+void countReadKmers(const boost::program_options::variables_map& vm, 
+                    const std::string& sfTrascriptIndexFile,
+                    const std::string& countsFile) {
+    using std::string;
+    namespace bfs = boost::filesystem;
+    using Index = PerfectHashIndexT<KmerT>;
+    using CountDB = CountDBNewT<KmerT>;
+    using Partitions = PartitionedCountsT<KmerT>;
+    using Writer = typename Partitions::Writer;
+
+    std::cerr << "reading index . . . ";
+    auto phi = Index::fromFile(sfTrascriptIndexFile);
+    std::cerr << "done\n";
+    std::cerr << "index contained " << phi.numKeys() << " kmers\n";
+    if (vm["hugepages"].as<bool>()) {
+        std::cerr << "copying index into huge pages . . . ";
+        phi.copyFromMapping();
+        std::cerr << "done\n";
+    }
+
+    size_t nkeys = phi.numKeys();
+    size_t merLen = phi.kmerLength();
+
+    size_t numActors = vm["threads"].as<uint32_t>();
+    tbb::task_scheduler_init init(numActors);
+    std::vector<std::thread> threads;
+
+    // Fault the index in (in parallel) while we open the reads and start the
+    // parser, so that counting doesn't start out at the speed of page faults
+    auto warmUp = std::async(std::launch::async, [&phi, numActors]() -> std::pair<size_t, double> {
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = phi.warmUp(numActors);
+        auto end = std::chrono::steady_clock::now();
+        return { bytes, std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0 };
+    });
+
+    auto del = []( Index* h ) -> void { /*do nothing*/; };
+    auto phiPtr = std::shared_ptr<Index>(&phi, del);
+
+    std::atomic<uint64_t> readNum{0};
+    std::atomic<uint64_t> processedReads{0};
+
+    std::vector<string> readFiles;
+    if (vm.count("reads")) { readFiles = vm["reads"].as<std::vector<string>>(); }
+    std::vector<string> mates1, mates2;
+    if (vm.count("mates1")) { mates1 = vm["mates1"].as<std::vector<string>>(); }
+    if (vm.count("mates2")) { mates2 = vm["mates2"].as<std::vector<string>>(); }
+    bool paired = !mates1.empty();
+
+    // If we're counting just one shard of the reads, keep only its files, or
+    // (if there are too few files to go around, or the reads are paired)
+    // only its reads
+    auto shard = sailfish::ReadShard::parse(vm["shard"].as<string>());
+    bool shardByFile = !paired and shard.byFile(readFiles.size());
+    bool shardByName = !shard.all() and !shardByFile;
+    if (shardByFile) {
+        std::vector<string> shardFiles;
+        for (size_t i = 0; i < readFiles.size(); ++i) {
+            if (shard.ownsFile(i)) { shardFiles.push_back(readFiles[i]); }
+        }
+        readFiles.swap(shardFiles);
+        std::cerr << "counting shard " << shard.index() << " of " << shard.count() << " (by file)\n";
+    } else if (shardByName) {
+        std::cerr << "counting shard " << shard.index() << " of " << shard.count() << " (by read name)\n";
+    }
+
+    for( auto rf : readFiles ) {
+        std::cerr << "readFile: " << rf << ", ";
+    }
+    for( auto rf : mates1 ) { std::cerr << "mates1: " << rf << ", "; }
+    for( auto rf : mates2 ) { std::cerr << "mates2: " << rf << ", "; }
+    std::cerr << "\n";
+
+    // Gzipped read files are decompressed here (BGZF files in parallel); a
+    // gzipped stream is inflated by the parser as it is read
+    std::vector<std::unique_ptr<sailfish::GzipInput>> inputs;
+    auto openInputs = [&inputs, numActors](const std::vector<string>& files) -> std::vector<string> {
+        std::vector<string> paths;
+        for ( auto& rf : files ) {
+            inputs.emplace_back(new sailfish::GzipInput(rf, numActors));
+            if (inputs.back()->compressed()) {
+                std::cerr << rf << " is gzipped; decompressing it " 
+                          << (inputs.back()->blocked() ? "(BGZF) in parallel\n" : "in a single stream\n");
+            }
+            paths.push_back(inputs.back()->path());
+        }
+        return paths;
+    };
+    auto readPaths = openInputs(readFiles);
+    auto mates1Paths = openInputs(mates1);
+    auto mates2Paths = openInputs(mates2);
+
+    uint32_t countBits = vm["countBits"].as<uint32_t>();
+    if (countBits < 32 and vm["interleaved"].as<bool>()) {
+        std::cerr << "(compact counts are never interleaved; ignoring --interleaved)\n";
+    }
+    CountDB rhash( phiPtr, vm["interleaved"].as<bool>(), countBits );
+
+    // If requested, each thread owns a partition of the counts
+    bool partitioned = vm["partitioned"].as<bool>();
+    std::unique_ptr<Partitions> partitions{nullptr};
+    if (partitioned) {
+        partitions.reset(new Partitions(rhash, numActors));
+    }
+
+    // Open up the read files for parsing; regular files are parsed in place,
+    // and the rest (standard input, pipes, and the gzipped files that the
+    // inputs decompress into pipes) are streamed.  Mates are read in step.
+    std::unique_ptr<sailfish::SequenceReader> parser{nullptr};
+    std::unique_ptr<sailfish::PairedSequenceReader> pairedParser{nullptr};
+    if (!readPaths.empty()) { parser.reset(new sailfish::SequenceReader(readPaths)); }
+    if (paired) { pairedParser.reset(new sailfish::PairedSequenceReader(mates1Paths, mates2Paths)); }
+
+    auto warmedUp = warmUp.get();
+    if (warmedUp.first > 0) {
+        std::cerr << "prefaulted " << warmedUp.first / (1024 * 1024) << "MB of the index in " 
+                  << warmedUp.second << " s\n";
+    } else {
+        std::cerr << "the index is in private memory; nothing to prefault\n";
+    }
+    phi.reportBacking();
+    rhash.reportBacking();
+
+    {
+      std::atomic<size_t> unmappedKmers{0};
+      boost::timer::auto_cpu_timer t(std::cerr);
+      auto start = std::chrono::steady_clock::now();
+      bool canonical = phi.canonical();
+
+      // A read (or fragment) is counted if it's in our shard and in the
+      // sample, and if fewer than maxReads reads (or fragments) have been
+      // counted.  The threads take the reads in whatever order they get to
+      // them, so which reads make the first maxReads varies from run to run.
+      sailfish::ReadSample sample(vm["sampleFraction"].as<double>());
+      uint64_t maxReads = vm["maxReads"].as<uint64_t>();
+      std::atomic<uint64_t> keptReads{0};
+      if (!sample.all()) {
+          std::cerr << "counting a sample of " << sample.fraction() * 100.0 << "% of the reads\n";
+      }
+      if (maxReads > 0) {
+          std::cerr << "counting at most " << maxReads << (pairedParser ? " fragments\n" : " reads\n");
+      }
+      auto selects = [&shard, shardByName, &sample](const sailfish::SequenceRecord* read) -> bool {
+          return (!shardByName or shard.ownsRead(read->header, read->hlen)) and 
+                 (sample.all() or sample.keeps(read->header, read->hlen));
+      };
+      auto full = [&keptReads, maxReads]() -> bool {
+          return maxReads > 0 and ++keptReads > maxReads;
+      };
+      uint32_t minQuality = vm["minQuality"].as<uint32_t>();
+      if (minQuality > 0) {
+          std::cerr << "kmers will not span bases of quality below " << minQuality << "\n";
+      }
+      LibTypeDetector libType(parseLibType(vm["libtype"].as<string>()));
+      if (canonical and !vm["libtype"].defaulted()) {
+          std::cerr << "(the index is canonical, so reads are counted the same on either strand; ignoring --libtype)\n";
+      } else if (!canonical and libType.type() != LibType::Unknown) {
+          std::cerr << "library type " << libTypeName(libType.type()) << "\n";
+      }
+      //tbb::concurrent_unordered_set<int> assignedCPUs;
+
+      // Start the desired number of threads to parse the reads
+      // and build our data structure.
+      for (size_t k = 0; k < numActors; ++k) {
+        size_t threadIdx = k;
+        /** Guillaume inspired fast parser **/
+
+        // If we're only hashing canonical kmers
+        if (canonical) {
+            threads.emplace_back(std::thread(
+                [&parser, &pairedParser, &readNum, &rhash, &start, &phi, &unmappedKmers, &partitions, &selects, &full, threadIdx, merLen, minQuality]() -> void {
+                std::unique_ptr<Writer> writer{nullptr};
+                if (partitions) { writer.reset(new Writer(*partitions, threadIdx)); }
+                BatchedKmerCounterT<KmerT> counter(phi, rhash, writer.get());
+                sailfish::kmers::KmerStreamT<KmerT> mers(merLen, minQuality);
+
+                auto progress = [&readNum, &start](size_t numReads) -> void {
+                    auto n = (readNum += numReads);
+                    if (n % 500000 < numReads) {
+                        auto end = std::chrono::steady_clock::now();
+                        auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
+                        auto nsec = sec.count();
+                        auto rate = (nsec > 0) ? n / sec.count() : 0;
+                        std::cerr << "processed " << n << " reads (" << rate << ") reads/s\r\r";
+                    }
+                };
+
+                auto countRead = [&rhash, &mers, &counter](const sailfish::SequenceRecord* read) -> void {
+                    // tell the readhash about this read's length
+                    rhash.appendLength(std::distance(read->seq_s, read->seq_e));
+
+                    // encode the read and count its canonical kmers
+                    mers.canonical(read->seq_s, read->seq_e, qualities(read));
+                    counter.push(mers.fwd(), mers.numKmers());
+                };
+
+                // Each thread gets it's own stream
+                const sailfish::SequenceRecord* read;
+                if (parser) {
+                    sailfish::SequenceReader::Stream stream{parser->new_thread()};
+                    while ( (read = stream.next_read()) ) {
+                        if (!selects(read)) { continue; }
+                        if (full()) { break; }
+                        progress(1);
+                        countRead(read);
+                    } // end parse all reads
+                }
+                if (pairedParser) {
+                    // (a canonical kmer is the same whichever strand it's read from)
+                    const sailfish::SequenceRecord* mate;
+                    sailfish::PairedSequenceReader::Stream stream{pairedParser->new_thread()};
+                    while ( stream.next_pair(read, mate) ) {
+                        if (!selects(read)) { continue; }
+                        if (full()) { break; }
+                        progress(2);
+                        countRead(read);
+                        countRead(mate);
+                    } // end parse all fragments
+                }
+            counter.flush();
+            if (writer) { writer->finish(); }
+            unmappedKmers += counter.numUnmapped();
+        }));
+
+        } else {
+          // If we're hashing kmers in both directions to determine
+          // the "direction" of reads.
+
+            enum class MerDirection : std::int8_t { FORWARD = 1, REVERSE = 2, BOTH = 3 };
+
+            threads.emplace_back(std::thread(
+                [&parser, &pairedParser, &readNum, &rhash, &start, &phi, &unmappedKmers, &partitions, &selects, &full, &libType, threadIdx, merLen, minQuality]() -> void {
+                // The kmers of the current read (or fragment) in each
+                // direction, and their ids in the index
+                sailfish::kmers::KmerStreamT<KmerT> mers(merLen, minQuality);
+                sailfish::kmers::KmerStreamT<KmerT> mateMers(merLen, minQuality);
+                std::vector<KmerT> fragFwd;
+                std::vector<KmerT> fragRev;
+                std::vector<size_t> fwdIds;
+                std::vector<size_t> revIds;
+
+                std::unique_ptr<Writer> writer{nullptr};
+                if (partitions) { writer.reset(new Writer(*partitions, threadIdx)); }
+                auto countIds = [&rhash, &writer](const size_t* ids, size_t n) -> void {
+                    if (writer) { writer->add(ids, n); } else { rhash.incAtIndices(ids, n); }
+                };
+                // counts the kmers of a stranded library, in its one direction
+                BatchedKmerCounterT<KmerT> counter(phi, rhash, writer.get());
+
+                const size_t batchSize = BatchedKmerCounterT<KmerT>::BatchSize;
+                auto INVALID = phi.INVALID;
+                auto numValid = [INVALID](const std::vector<size_t>& ids, size_t s, size_t n) -> size_t {
+                    size_t nv{0};
+                    for (size_t i = s; i < s + n; ++i) { nv += (ids[i] != INVALID); }
+                    return nv;
+                };
+
+                uint64_t localUnmappedKmers{0};
+
+                auto progress = [&readNum, &start](size_t numReads) -> void {
+                    auto n = (readNum += numReads);
+                    if (n % 250000 < numReads) {
+                        auto end = std::chrono::steady_clock::now();
+                        auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
+                        auto nsec = sec.count();
+                        auto rate = (nsec > 0) ? n / sec.count() : 0;
+                        std::cerr << "processed " << n << " reads (" << rate << ") reads/s\r\r";
+                    }
+                };
+
+                // Count the numKmers kmers of a read (or fragment), in
+                // whichever direction more of them are in the index, and
+                // return the vote (> 0 for forward, < 0 for reverse)
+                auto countDirected = [&](const KmerT* fwdMers, const KmerT* revMers, size_t numKmers) -> int {
+                    size_t fCount = 0; size_t rCount = 0;
+                    auto dir = MerDirection::BOTH;
+
+                    if ( numKmers > fwdIds.size()) {
+                        fwdIds.resize(numKmers);
+                        revIds.resize(numKmers);
+                    }
+
+                    // Look the kmers up a batch at a time.  While we're uncertain
+                    // about the direction of the read, we look up both directions;
+                    // once one direction has more hits than the other could possibly
+                    // reach, we only consider the rest of the read in that direction.
+                    for (size_t s = 0; s < numKmers; s += batchSize) {
+                        size_t n = std::min(batchSize, numKmers - s);
+                        size_t numRemaining = numKmers - (s + n);
+
+                        // dispatch on the direction
+                        switch (dir) {
+                          case MerDirection::FORWARD:
+                            rhash.lookup(&fwdMers[s], n, &fwdIds[s]);
+                            fCount += numValid(fwdIds, s, n);
+                            break;
+                          case MerDirection::REVERSE:
+                            rhash.lookup(&revMers[s], n, &revIds[s]);
+                            rCount += numValid(revIds, s, n);
+                            break;
+                          case MerDirection::BOTH:
+                            rhash.lookup(&fwdMers[s], n, &fwdIds[s]);
+                            fCount += numValid(fwdIds, s, n);
+                            rhash.lookup(&revMers[s], n, &revIds[s]);
+                            rCount += numValid(revIds, s, n);
+                            // Determine if we need to continue looking at both directions
+                            dir = (fCount > (rCount + numRemaining)) ? MerDirection::FORWARD :
+                                  (rCount > (fCount + numRemaining)) ? MerDirection::REVERSE : MerDirection::BOTH;
+                            break;
+                        } // end direction switch
+                    }
+
+                    uint64_t count{0};
+                    switch (dir) {
+
+                      // The same number of things mapped in both directions.  In
+                      // this case, we _arbitrarily_ choose the forward kmers.
+                      case MerDirection::BOTH:
+                      // More things mapped in the forward direction
+                      case MerDirection::FORWARD:
+                        countIds(&fwdIds[0], numKmers);
+                        count = fCount; break;
+
+                      // More things mapped in the reverse direction                            
+                      case MerDirection::REVERSE:
+                        countIds(&revIds[0], numKmers);
+                        count = rCount; break;
+                    }
+
+                    // the number of unmapped kmers is just the total kmers in this read
+                    // minus the number that mapped.
+                    localUnmappedKmers += (numKmers - count);
+                    return (fCount > rCount) - (rCount > fCount);
+                };
+
+                // Each thread gets it's own stream
+                const sailfish::SequenceRecord* read;
+                if (parser) {
+                    sailfish::SequenceReader::Stream stream{parser->new_thread()};
+                    while ( (read = stream.next_read()) ) {
+                        if (!selects(read)) { continue; }
+                        if (full()) { break; }
+                        progress(1);
+
+                        uint32_t readLen = std::distance(read->seq_s, read->seq_e);
+
+                        // tell the readhash about this read's length
+                        rhash.appendLength(readLen);
+
+                        // the read must be at least the kmer length
+                        if ( readLen < merLen ) { continue; }
+
+                        // a stranded library's reads are counted in one direction
+                        auto type = libType.type();
+                        if (type == LibType::Forward or type == LibType::Reverse) {
+                            mers.stranded(read->seq_s, read->seq_e, type == LibType::Reverse, qualities(read));
+                            counter.push(mers.fwd(), mers.numKmers());
+                            continue;
+                        }
+
+                        // gather the kmers in both directions
+                        mers.directional(read->seq_s, read->seq_e, qualities(read));
+                        if ( mers.numKmers() == 0 ) { continue; }
+                        int vote = countDirected(mers.fwd(), mers.rev(), mers.numKmers());
+                        if (type == LibType::Unknown) { libType.vote(vote); }
+                    } // end parse all reads
+                }
+
+                if (pairedParser) {
+                    // The two mates of a fragment come from opposite strands, so
+                    // the fragment is forward if mate 1 is forward and mate 2 is
+                    // reverse, and vice versa.  Its kmers are voted on (and
+                    // counted) together, as one read made of mate 1 followed by
+                    // the reverse complement of mate 2; by the time the vote gets
+                    // to mate 2, it has usually been decided.
+                    const sailfish::SequenceRecord* mate;
+                    sailfish::PairedSequenceReader::Stream stream{pairedParser->new_thread()};
+                    while ( stream.next_pair(read, mate) ) {
+                        if (!selects(read)) { continue; }
+                        if (full()) { break; }
+                        progress(2);
+
+                        rhash.appendLength(std::distance(read->seq_s, read->seq_e));
+                        rhash.appendLength(std::distance(mate->seq_s, mate->seq_e));
+
+                        auto type = libType.type();
+                        if (type == LibType::Forward or type == LibType::Reverse) {
+                            mers.stranded(read->seq_s, read->seq_e, type == LibType::Reverse, qualities(read));
+                            counter.push(mers.fwd(), mers.numKmers());
+                            mers.stranded(mate->seq_s, mate->seq_e, type == LibType::Forward, qualities(mate));
+                            counter.push(mers.fwd(), mers.numKmers());
+                            continue;
+                        }
+
+                        mers.directional(read->seq_s, read->seq_e, qualities(read));
+                        mateMers.directional(mate->seq_s, mate->seq_e, qualities(mate));
+                        size_t n1 = mers.numKmers();
+                        size_t numKmers = n1 + mateMers.numKmers();
+                        if ( numKmers == 0 ) { continue; }
+
+                        if ( numKmers > fragFwd.size() ) {
+                            fragFwd.resize(numKmers);
+                            fragRev.resize(numKmers);
+                        }
+                        std::copy(mers.fwd(), mers.fwd() + n1, fragFwd.begin());
+                        std::copy(mateMers.rev(), mateMers.rev() + (numKmers - n1), fragFwd.begin() + n1);
+                        std::copy(mers.rev(), mers.rev() + n1, fragRev.begin());
+                        std::copy(mateMers.fwd(), mateMers.fwd() + (numKmers - n1), fragRev.begin() + n1);
+                        int vote = countDirected(fragFwd.data(), fragRev.data(), numKmers);
+                        if (type == LibType::Unknown) { libType.vote(vote); }
+                    } // end parse all fragments
+                }
+
+            counter.flush();
+            if (writer) { writer->finish(); }
+            unmappedKmers += localUnmappedKmers + counter.numUnmapped();
+        }));
+
+        }
+
+      }   
+
+
+      // Wait for all of the threads to finish
+      for ( auto& thread : threads ){ thread.join(); }
+      // and make sure that all of the input was decompressed (unless we
+      // stopped reading it; the inputs then stop when they're destroyed)
+      bool stoppedEarly = maxReads > 0 and keptReads > maxReads;
+      if (!stoppedEarly) {
+          for ( auto& input : inputs ) { input->finish(); }
+      } else {
+          std::cerr << "\nstopped after counting " << maxReads << (pairedParser ? " fragments\n" : " reads\n");
+      }
+      if (parser) { parser->finish(); }
+      if (pairedParser) { pairedParser->finish(); }
+
+      // Scale the counts of a sample up to estimates for all of the reads; if
+      // maxReads cut the sample short, it's no longer that fraction of them
+      if (!sample.all() and !stoppedEarly) {
+          rhash.scale(1.0 / sample.fraction());
+          unmappedKmers = static_cast<size_t>(std::llround(unmappedKmers / sample.fraction()));
+      } else if (!sample.all()) {
+          std::cerr << "not scaling the counts of the sample, since it was cut short by maxReads\n";
+      }
+
+      auto end = std::chrono::steady_clock::now();
+      auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
+      auto nsec = sec.count();
+      auto rate = (nsec > 0) ? readNum / sec.count() : 0;
+      std::cerr << "\nOverall rate: " << rate << " reads / s\n";
+      std::cerr << "\n" << std::endl;
+      rhash.dumpCountsToFile(countsFile, vm["sparse"].as<bool>());
+
+      // Total kmers
+      size_t totalCount = 0;
+      for (auto i : boost::irange(size_t(0), rhash.size())) {
+          totalCount += rhash.atIndex(i);
+      }
+
+      bfs::path countInfoFilename(countsFile);
+      countInfoFilename.replace_extension(".count_info");
+
+      std::ofstream countInfoFile(countInfoFilename.string());
+      countInfoFile << "total_reads\t" << totalCount << "\n";
+      countInfoFile << "mapped\t" << totalCount - unmappedKmers << "\n";
+      countInfoFile << "unmapped\t" << unmappedKmers << "\n";
+      countInfoFile << "mapped_ratio\t" << 
+                       (totalCount / static_cast<double>(totalCount + unmappedKmers)) << "\n";
+      countInfoFile.close();
+
+      std::cerr << "There were " << totalCount << ", kmers; " << unmappedKmers << " could not be mapped\n";
+      std::cerr << "Mapped " << 
+                   (totalCount / static_cast<double>(totalCount + unmappedKmers)) * 100.0 << "% of the kmers\n";
+      end = std::chrono::steady_clock::now();
+      sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
+      nsec = sec.count();
+
+      std::cerr << "Total counting time [including file i/o]: " << nsec << " seconds.\n";
+
+    }
+}
 
 int mainCount( int argc, char *argv[] ) {
 
@@ -76,9 +646,50 @@ int mainCount( int argc, char *argv[] ) {
     ("version,v", "print version string")
     ("help,h", "produce help message")
     ("index,i", po::value<string>(), "transcript index file [Sailfish format]")
-    ("reads,r", po::value<std::vector<string>>()->multitoken(), "List of files containing reads")
+    ("reads,r", po::value<std::vector<string>>()->multitoken(), "List of files containing reads (\"-\" for standard input; named pipes and gzipped files are streamed)")
+    ("mates1,1", po::value<std::vector<string>>()->multitoken(), "List of files containing the first mates of paired-end reads")
+    ("mates2,2", po::value<std::vector<string>>()->multitoken(), "List of files containing the second mates, in the same order as "
+                                                                  "the first.  The two mates of a fragment are counted as reads from "
+                                                                  "opposite strands of one transcript.")
     ("counts,c", po::value<string>(), "File where Sailfish read count is written")
     ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use when counting kmers")
+    ("partitioned", po::bool_switch(), "Split the kmer id space among the counting threads, so that each count is "
+                                       "only ever updated by a single thread.  This avoids contention on very abundant "
+                                       "kmers when counting with many threads; the resulting counts are identical.")
+    ("hugepages", po::bool_switch(), "Copy the index into memory backed by huge pages rather than using it directly "
+                                     "from the (mapped) index file.  This uses private memory for the index, but "
+                                     "makes its random lookups much less likely to miss in the TLB.")
+    ("interleaved", po::bool_switch(), "Store a copy of each key (or key fingerprint) next to its count, so that "
+                                       "looking up and counting a kmer touches a single cache line rather than "
+                                       "two.  This uses more memory; the counts file is the same either way.")
+    ("countBits", po::value<uint32_t>()->default_value(32), "The width (8, 16 or 32) of each kmer's counter.  Narrower counters "
+                                                          "saturate, and keep the rest of the (rare) large counts in an overflow "
+                                                          "table; this cuts the memory used by the counts, and the size of the "
+                                                          "counts file, by 2-4x without changing the counts.")
+    ("shard", po::value<string>()->default_value("0/1"), "Count only shard i/N of the reads (0 <= i < N), so that a sample can be "
+                                                         "counted by N processes; `sailfish merge-counts` adds up the shards' counts.  "
+                                                         "If there are at least N read files, shard i counts every N-th file starting "
+                                                         "with the i-th; otherwise it counts the reads whose names hash to i.")
+    ("libtype", po::value<string>()->default_value("A"), "The strand protocol of the library: U (unstranded), SF (each read, "
+                                                         "or the first mate of each fragment, is from the transcript's strand), "
+                                                         "SR (from the opposite strand), or A to infer it from the first reads.  "
+                                                         "The reads of a stranded library are looked up in that direction alone.  "
+                                                         "(This only matters if the index isn't canonical.)")
+    ("minQuality", po::value<uint32_t>()->default_value(0), "Don't count kmers that span a base whose (Phred+33) quality "
+                                                             "is below this, e.g. in the error-laden tails of reads.  Only "
+                                                             "FASTQ reads have qualities; 0 disables the masking.")
+    ("sampleFraction", po::value<double>()->default_value(1.0), "Count only this fraction (in (0, 1]) of the reads, and scale the "
+                                                                 "counts (and read lengths) up to match.  The sample is the reads "
+                                                                 "whose names hash below the fraction, so it's the same every time.  "
+                                                                 "For quick, approximate estimates.  The counts aren't scaled if "
+                                                                 "maxReads stops the counting early.")
+    ("maxReads", po::value<uint64_t>()->default_value(0), "Stop after counting this many reads, or fragments of paired reads "
+                                                         "(0 for no limit).  The counted reads are whichever the threads "
+                                                         "reach first, so they can differ between runs; the counts aren't "
+                                                         "scaled (even with sampleFraction).")
+    ("sparse", po::bool_switch(), "Write only the nonzero counts (and their delta-encoded kmer ids) to the counts "
+                                  "file.  Most kmers of a transcriptome are usually not seen in a sample, so this "
+                                  "makes the file much smaller.")
     ;
 
     po::variables_map vm;
@@ -90,8 +701,9 @@ int mainCount( int argc, char *argv[] ) {
             auto hstring = R"(
 count
 ==========
-Counts the kmers in the set of reads [reads] which also occur in
-the Sailfish index [index].  The resulting set of counts relies on the
+Counts the kmers in the set of reads [reads] (and the paired-end
+reads [mates1] and [mates2]) which also occur in the Sailfish index
+[index].  The resulting set of counts relies on the
 same index, and the counts will be written to the file [counts].
 )";
             std::cout << hstring <<"\n";
@@ -102,6 +714,29 @@ same index, and the counts will be written to the file [counts].
 
         string countsFile = vm["counts"].as<string>();
 
+        if (vm.count("mates1") != vm.count("mates2")) {
+            std::cerr << "--mates1 and --mates2 must be given together\n";
+            std::exit(1);
+        }
+        if (!vm.count("reads") and !vm.count("mates1")) {
+            std::cerr << "no reads were given (with --reads, or --mates1 and --mates2)\n";
+            std::exit(1);
+        }
+
+        uint32_t countBits = vm["countBits"].as<uint32_t>();
+        if (countBits != 8 and countBits != 16 and countBits != 32) {
+            std::cerr << "--countBits must be one of 8, 16 or 32\n";
+            std::exit(1);
+        }
+        try {
+            sailfish::ReadShard::parse(vm["shard"].as<string>());
+            parseLibType(vm["libtype"].as<string>());
+            sailfish::ReadSample(vm["sampleFraction"].as<double>());
+        } catch (std::invalid_argument& e) {
+            std::cerr << e.what() << "\n";
+            std::exit(1);
+        }
+
         string sfIndexBase = vm["index"].as<string>();
         string sfTrascriptIndexFile = sfIndexBase+".sfi";
 
@@ -115,404 +750,11 @@ same index, and the counts will be written to the file [counts].
 
 
 
-        std::cerr << "reading index . . . ";
-        auto phi = PerfectHashIndex::fromFile(sfTrascriptIndexFile);
-        std::cerr << "done\n";
-        std::cerr << "index contained " << phi.numKeys() << " kmers\n";
-
-        size_t nkeys = phi.numKeys();
-        size_t merLen = phi.kmerLength();
-
-        size_t numActors = vm["threads"].as<uint32_t>();
-        tbb::task_scheduler_init init(numActors);
-        std::vector<std::thread> threads;
-
-        auto del = []( PerfectHashIndex* h ) -> void { /*do nothing*/; };
-        auto phiPtr = std::shared_ptr<PerfectHashIndex>(&phi, del);
-
-        std::atomic<uint64_t> readNum{0};
-        std::atomic<uint64_t> processedReads{0};
-
-        std::vector<string> readFiles = vm["reads"].as<std::vector<string>>();
-        for( auto rf : readFiles ) {
-            std::cerr << "readFile: " << rf << ", ";
-        }
-        std::cerr << "\n";
-
-        char** fnames = new char*[readFiles.size()];
-        size_t z{0};
-        size_t numFnames{0};
-        for ( auto& s : readFiles ){
-            // Ugly, yes?  But this is not as ugly as the alternatives.
-            // The char*'s contained in fname are owned by the readFiles
-            // vector and need not be manually freed.
-            fnames[numFnames] = const_cast<char*>(s.c_str());
-            ++numFnames;
-        }
-
-        CountDBNew rhash( phiPtr );
-
-        //phi.will_need(0, numActors+1);
-        //rhash.will_need(0, numActors+1);
-
-        // Open up the transcript file for reading
-        // Create a jellyfish parser
-        jellyfish::parse_read parser( fnames, fnames+numFnames, 5000);
-
-        {
-          std::atomic<size_t> unmappedKmers{0};
-          boost::timer::auto_cpu_timer t(std::cerr);
-          auto start = std::chrono::steady_clock::now();
-          bool canonical = phi.canonical();
-          //tbb::concurrent_unordered_set<int> assignedCPUs;
-
-          std::atomic<uint32_t> numPaged{0};
-
-          // Start the desired number of threads to parse the reads
-          // and build our data structure.
-          for (size_t k = 0; k < numActors; ++k) {
-            size_t threadIdx = k;
-            /** Guillaume inspired fast parser **/
-
-            // If we're only hashing canonical kmers
-            if (canonical) {
-                threads.emplace_back(std::thread(
-                    [&parser, &readNum, &rhash, &start, &phi, &unmappedKmers, merLen]() -> void {
-                    // Each thread gets it's own stream
-                    jellyfish::parse_read::read_t* read;
-                    jellyfish::parse_read::thread stream = parser.new_thread();
-
-                    using BinMer =  uint64_t;
-
-                    BinMer lshift(2 * (merLen - 1));
-                    BinMer masq((1UL << (2 * merLen)) - 1);
-                    BinMer cmlen, kmer, rkmer;
-
-                    auto INVALID = phi.INVALID;
-
-                    uint64_t localUnmappedKmers{0};
-
-                    while ( (read = stream.next_read()) ) {
-                        ++readNum;
-                        if (readNum % 500000 == 0) {
-                            auto end = std::chrono::steady_clock::now();
-                            auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
-                            auto nsec = sec.count();
-                            auto rate = (nsec > 0) ? readNum / sec.count() : 0;
-                            std::cerr << "processed " << readNum << " reads (" << rate << ") reads/s\r\r";
-                        }                        
-                        // we iterate over the entire read
-                        const char         *start = read->seq_s;
-                        const char * const  end   = read->seq_e;
-
-                        // reset all of the counts
-                        cmlen = kmer = rkmer = 0;
-
-                        // the maximum number of kmers we'd have to store
-                        uint32_t maxNumKmers = std::distance(start, end);
-
-                        // tell the readhash about this read's length
-                        rhash.appendLength(maxNumKmers);
-
-                        // the read must be at least the kmer length
-                        if ( maxNumKmers < merLen ) { continue; }
-
-                        // iterate over the read base-by-base
-                        while(start < end) {
-                            uint_t     c = jellyfish::dna_codes[static_cast<uint_t>(*start++)];
-
-                            // ***** Potentially consider quality values in the future **** /
-                            // const char q = *start++;
-                            // if(q < q_thresh)
-                            //   c = CODE_RESET;
-
-                            switch(c) {
-                                case jellyfish::CODE_IGNORE: break;
-                                case jellyfish::CODE_COMMENT:
-                                  std::cerr << "ERROR\n";
-                                  //report_bad_input(*(start-1));
-                                // Fall through
-                                case jellyfish::CODE_RESET:
-                                  cmlen = kmer = rkmer = 0;
-                                  break;
-
-                                default:
-                                  // form the new kmer
-                                  kmer = ((kmer << 2) & masq) | c;
-                                  // the new kmer's reverse complement
-                                  rkmer = (rkmer >> 2) | ((0x3 - c) << lshift);
-                                  // count if the kmer is valid in the forward and
-                                  // reverse directions
-                                  if(++cmlen >= merLen) {
-                                    cmlen = merLen;
-                                    auto mmer = (kmer < rkmer) ? kmer : rkmer;
-                                    if ( phi.index(mmer) != INVALID) { rhash.inc(mmer); } else { ++localUnmappedKmers; }
-                                  } // end if
-                            } // end switch
-                        } // end read
-                } // end parse all reads
-                unmappedKmers += localUnmappedKmers;
-            }));
-
-            } else {
-              // If we're hashing kmers in both directions to determine
-              // the "direction" of reads.
-
-                enum class MerDirection : std::int8_t { FORWARD = 1, REVERSE = 2, BOTH = 3 };
-
-          //   cpu_set_t* cpuset;
-          //   pthread_getaffinity_np(threads.back().native_handle(), sizeof(cpu_set_t), cpuset);
-          //   for (size_t cpuID = 0; cpuID < maxThreads; ++cpuID) {
-          //     if (CPU_ISSET(cpuID, cpuset)) {
-          //       if (CPUMap.find(cpuID) == knownCPUs.end()) {
-          //         CPUMap[cpuID] = k;
-          //       }
-          //     }
-          //   }
-          // for (auto& CPUThreadPair : CPUMap ) {
-          //   phi.will_need(k, CPUMap.size());
-          //   rhash.will_need(k, CPUMap.size());
-          // }
-
-                threads.emplace_back(std::thread(
-                    [&parser, &readNum, &rhash, &start, &phi, &unmappedKmers, &k, &numPaged, threadIdx, merLen, numActors]() -> void {
-                      //phi.will_need(threadIdx+1, numActors+1);
-                      //rhash.will_need(threadIdx+1, numActors+1);
-                      ++numPaged;
-                      //while ( numPaged < numActors ) { }
-                      //if (threadIdx == numActors - 1) { start = std::chrono::steady_clock::now(); }
-
-                    // Each thread gets it's own stream
-                    jellyfish::parse_read::read_t* read;
-                    jellyfish::parse_read::thread stream{parser.new_thread()};
-                    
-                    
-
-                    using BinMer = uint64_t;
-                    std::vector<BinMer> fwdMers;
-                    std::vector<BinMer> revMers;
-
-                    BinMer lshift{2 * (merLen - 1)};
-                    BinMer masq{(1UL << (2 * merLen)) - 1};
-                    BinMer cmlen, kmer, rkmer;
-
-                    size_t numKmers = 0;
-                    size_t numRemaining = 0;
-                    size_t fCount = 0; size_t rCount = 0;
-                    auto dir = MerDirection::BOTH;
-
-                    auto INVALID = phi.INVALID;
-
-                    uint64_t localUnmappedKmers{0};
-                    uint64_t locallyProcessedReads{0};
-                    while ( (read = stream.next_read()) ) {
-                        ++readNum; ++locallyProcessedReads;
-                        if (readNum % 250000 == 0) {
-                            auto end = std::chrono::steady_clock::now();
-                            auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
-                            auto nsec = sec.count();
-                            auto rate = (nsec > 0) ? readNum / sec.count() : 0;
-                            std::cerr << "processed " << readNum << " reads (" << rate << ") reads/s\r\r";
-                        }                        
-
-                        // we iterate over the entire read
-                        const char         *start = read->seq_s;
-                        const char * const  end   = read->seq_e;
-
-                        // reset all of the counts
-                        fCount = rCount = numKmers = 0;
-                        cmlen = kmer = rkmer = 0;
-                        dir = MerDirection::BOTH;
-
-                        uint32_t readLen = std::distance(start, end);
-
-                        // the maximum number of kmers we'd have to store
-                        uint32_t maxNumKmers = (readLen >= merLen) ? readLen - merLen + 1 : 0;
-                        numRemaining = maxNumKmers;
-
-                        // tell the readhash about this read's length
-                        rhash.appendLength(readLen);
-
-                        // the read must be at least the kmer length
-                        if ( maxNumKmers == 0 ) { continue; }
-
-                        if ( maxNumKmers > fwdMers.size()) {
-                            fwdMers.resize(maxNumKmers);
-                            revMers.resize(maxNumKmers);
-                        }
-
-                        size_t binMerId{0};
-                        size_t rMerId{0};
-                        // iterate over the read base-by-base
-                        while(start < end) {
-                            uint_t     c = jellyfish::dna_codes[static_cast<uint_t>(*start++)];
-
-                            // ***** Potentially consider quality values in the future **** /
-                            // const char q = *start++;
-                            // if(q < q_thresh)
-                            //   c = CODE_RESET;
-
-                            switch(c) {
-                                case jellyfish::CODE_IGNORE: break;
-                                case jellyfish::CODE_COMMENT:
-                                  std::cerr << "ERROR\n";
-
-                                // Fall through
-                                case jellyfish::CODE_RESET:
-                                  cmlen = kmer = rkmer = 0;
-                                  break;
-
-                                default:
-
-                                  kmer = ((kmer << 2) & masq) | c;
-                                  rkmer = (rkmer >> 2) | ((0x3 - c) << lshift);
-                                  // count if the kmer is valid in the forward and
-                                  // reverse directions
-                                  if(++cmlen >= merLen) {
-                                    cmlen = merLen;
-
-                                    // dispatch on the direction
-                                    switch (dir) {
-                                       // We're certain that more kmers map in the forward direction
-                                       // so we only consider the rest of the read in this direction.
-                                       case MerDirection::FORWARD:
-                                        // get the index of the forward kmer
-                                        binMerId = phi.index(kmer); 
-                                        if (binMerId != INVALID) {
-                                          rhash.incAtIndex(binMerId);
-                                          ++fCount;
-                                        }                                         
-                                        ++numKmers; --numRemaining;
-                                        break;
-                                       // end case FORWARD
-                                       
-                                       // We're certain that more kmers map in the reverse direction
-                                       // so we only consider the rest of the read in this direction.
-                                       case MerDirection::REVERSE:
-                                          // get the index of the forward kmer
-                                          rMerId = phi.index(rkmer);
-                                          if (rMerId != INVALID) {
-                                            rhash.incAtIndex(rMerId);
-                                            ++rCount;
-                                          }
-                                          ++numKmers; --numRemaining;
-                                          break;
-                                       // end case REVERSE
-                                       
-                                       case MerDirection::BOTH:
-                                          // form the new kmer and it's reverse complement
-
-                                          // Find the index of the forward kmer and determine
-                                          // whether or not to count it.
-                                          binMerId = phi.index(kmer);
-                                          fwdMers[fCount] = binMerId;
-                                          fCount += (binMerId != INVALID);
-
-                                          // Find the index of the reverse kmer and determine
-                                          // whether or not to count it.
-                                          rMerId = phi.index(rkmer);
-                                          revMers[rCount] = rMerId;
-                                          rCount += (rMerId != INVALID);
-
-                                          ++numKmers; --numRemaining;
-
-                                          // Determine if we need to continue looking at both directions
-                                          dir = (fCount > (rCount + numRemaining)) ? MerDirection::FORWARD :
-                                                (rCount > (fCount + numRemaining)) ? MerDirection::REVERSE : MerDirection::BOTH;
-
-                                          switch (dir) {
-                                            case MerDirection::FORWARD:
-                                              for (auto i : boost::irange(size_t(0), fCount)) { rhash.incAtIndex(fwdMers[i]); 
-                                              }
-                                              break;
-                                            case MerDirection::REVERSE:
-                                              for (auto i : boost::irange(size_t(0), rCount)) { rhash.incAtIndex(revMers[i]); 
-                                              }
-                                              break;
-                                            default:
-                                              break;
-                                          }                                        
-                                      // end case BOTH
-                                      
-                                    } // end dirction switch
-                                  } // end if
-                            } // end switch
-                        } // end read
-
-                        uint64_t count{0};
-                        switch (dir) {
-
-                          // The same number of things mapped in both directions.  In
-                          // this case, we _arbitrarily_ choose the forward kmers. We haven't 
-                          // actually incremented counts yet, so we do that here.
-                          case MerDirection::BOTH:
-                            if (dir == MerDirection::BOTH) {
-                              for (auto i : boost::irange(size_t(0), fCount)) { rhash.incAtIndex(fwdMers[i]); 
-                              }
-                            }
-                            count = fCount;
-                            break;
-
-                          // More things mapped in the forward direction
-                          case MerDirection::FORWARD:
-                            count = fCount; break;
-
-                          // More things mapped in the reverse direction                            
-                          case MerDirection::REVERSE:
-                            count = rCount; break;
-                        }
-
-                        // the number of unmapped kmers is just the total kmers in this read
-                        // minus the number that mapped.
-                        localUnmappedKmers += (numKmers - count);
-                        
-                } // end parse all reads
-                unmappedKmers += localUnmappedKmers;
-                //std::cerr << "Thread " << k << " processed " << locallyProcessedReads << " reads\n"; 
-            }));
-
-            }
-
-          }   
-
-
-          // Wait for all of the threads to finish
-          for ( auto& thread : threads ){ thread.join(); }
-
-          auto end = std::chrono::steady_clock::now();
-          auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
-          auto nsec = sec.count();
-          auto rate = (nsec > 0) ? readNum / sec.count() : 0;
-          std::cerr << "\nOverall rate: " << rate << " reads / s\n";
-          std::cerr << "\n" << std::endl;
-          rhash.dumpCountsToFile(countsFile);
-
-          // Total kmers
-          size_t totalCount = 0;
-          for (auto i : boost::irange(size_t(0), rhash.kmers().size())) {
-              totalCount += rhash.atIndex(i);
-          }
-
-          bfs::path countInfoFilename(countsFile);
-          countInfoFilename.replace_extension(".count_info");
-
-          std::ofstream countInfoFile(countInfoFilename.string());
-          countInfoFile << "total_reads\t" << totalCount << "\n";
-          countInfoFile << "mapped\t" << totalCount - unmappedKmers << "\n";
-          countInfoFile << "unmapped\t" << unmappedKmers << "\n";
-          countInfoFile << "mapped_ratio\t" << 
-                           (totalCount / static_cast<double>(totalCount + unmappedKmers)) << "\n";
-          countInfoFile.close();
-
-          std::cerr << "There were " << totalCount << ", kmers; " << unmappedKmers << " could not be mapped\n";
-          std::cerr << "Mapped " << 
-                       (totalCount / static_cast<double>(totalCount + unmappedKmers)) * 100.0 << "% of the kmers\n";
-          end = std::chrono::steady_clock::now();
-          sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
-          nsec = sec.count();
-
-          std::cerr << "Total counting time [including file i/o]: " << nsec << " seconds.\n";
-
+        uint32_t indexMerLen = readIndexKmerLength(sfTrascriptIndexFile);
+        if (indexMerLen <= sailfish::kmers::maxKmerLength<uint64_t>()) {
+            countReadKmers<uint64_t>(vm, sfTrascriptIndexFile, countsFile);
+        } else {
+            countReadKmers<sailfish::kmers::Kmer128>(vm, sfTrascriptIndexFile, countsFile);
         }
 
     } catch (po::error &e) {
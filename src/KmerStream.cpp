@@ -0,0 +1,243 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#include <algorithm>
+#include <array>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "KmerStream.hpp"
+
+namespace sailfish {
+namespace kmers {
+
+namespace {
+
+std::array<uint8_t, 256> makeCodeTable() {
+  std::array<uint8_t, 256> t;
+  t.fill(CODE_RESET);
+  t['A'] = t['a'] = CODE_A;
+  t['C'] = t['c'] = CODE_C;
+  t['G'] = t['g'] = CODE_G;
+  t['T'] = t['t'] = CODE_T;
+  t['\n'] = t['\r'] = CODE_IGNORE;
+  return t;
+}
+
+const std::array<uint8_t, 256> codeTable = makeCodeTable();
+
+}
+
+namespace {
+
+/**
+*  Replace the code of every base whose quality in qual is below minQual
+*  with CODE_RESET, a vector at a time, so that the kmer loops need no
+*  branch of their own for qualities.
+**/
+void maskLowQuality(const char* qual, size_t len, char minQual, uint8_t* codes) {
+  size_t i{0};
+#if defined(__AVX2__)
+  const __m256i minQ = _mm256_set1_epi8(minQual), reset = _mm256_set1_epi8(CODE_RESET);
+  for (; i + 32 <= len; i += 32) {
+    __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(qual + i));
+    __m256i low = _mm256_cmpgt_epi8(minQ, q);
+    __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes + i));
+    r = _mm256_or_si256(_mm256_andnot_si256(low, r), _mm256_and_si256(low, reset));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(codes + i), r);
+  }
+#endif
+#if defined(__SSE2__)
+  {
+    const __m128i minQ = _mm_set1_epi8(minQual), reset = _mm_set1_epi8(CODE_RESET);
+    for (; i + 16 <= len; i += 16) {
+      __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(qual + i));
+      __m128i low = _mm_cmpgt_epi8(minQ, q);
+      __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + i));
+      r = _mm_or_si128(_mm_andnot_si128(low, r), _mm_and_si128(low, reset));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(codes + i), r);
+    }
+  }
+#endif
+  for (; i < len; ++i) {
+    codes[i] = (qual[i] < minQual) ? static_cast<uint8_t>(CODE_RESET) : codes[i];
+  }
+}
+
+}
+
+size_t encodeRead(const char* seq, size_t len, uint8_t* codes, const char* qual, char minQual) {
+  size_t i{0};
+  bool sawIgnore{false};
+
+#if defined(__AVX2__)
+  const __m256i caseMask = _mm256_set1_epi8(static_cast<char>(0xDF));
+  const __m256i a = _mm256_set1_epi8('A'), c = _mm256_set1_epi8('C');
+  const __m256i g = _mm256_set1_epi8('G'), t = _mm256_set1_epi8('T');
+  const __m256i nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+  const __m256i one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2);
+  const __m256i three = _mm256_set1_epi8(3), four = _mm256_set1_epi8(4);
+  const __m256i five = _mm256_set1_epi8(5);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(seq + i));
+    __m256i up = _mm256_and_si256(v, caseMask);
+    __m256i isA = _mm256_cmpeq_epi8(up, a), isC = _mm256_cmpeq_epi8(up, c);
+    __m256i isG = _mm256_cmpeq_epi8(up, g), isT = _mm256_cmpeq_epi8(up, t);
+    __m256i isIgn = _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr));
+    __m256i known = _mm256_or_si256(_mm256_or_si256(isA, isC), _mm256_or_si256(isG, isT));
+    __m256i r = _mm256_or_si256(_mm256_and_si256(isC, one), _mm256_and_si256(isG, two));
+    r = _mm256_or_si256(r, _mm256_and_si256(isT, three));
+    r = _mm256_or_si256(r, _mm256_andnot_si256(_mm256_or_si256(known, isIgn), four));
+    r = _mm256_or_si256(r, _mm256_and_si256(isIgn, five));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(codes + i), r);
+    sawIgnore |= (_mm256_movemask_epi8(isIgn) != 0);
+  }
+#endif
+
+#if defined(__SSE2__)
+  {
+    const __m128i caseMask = _mm_set1_epi8(static_cast<char>(0xDF));
+    const __m128i a = _mm_set1_epi8('A'), c = _mm_set1_epi8('C');
+    const __m128i g = _mm_set1_epi8('G'), t = _mm_set1_epi8('T');
+    const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+    const __m128i three = _mm_set1_epi8(3), four = _mm_set1_epi8(4);
+    const __m128i five = _mm_set1_epi8(5);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(seq + i));
+      __m128i up = _mm_and_si128(v, caseMask);
+      __m128i isA = _mm_cmpeq_epi8(up, a), isC = _mm_cmpeq_epi8(up, c);
+      __m128i isG = _mm_cmpeq_epi8(up, g), isT = _mm_cmpeq_epi8(up, t);
+      __m128i isIgn = _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr));
+      __m128i known = _mm_or_si128(_mm_or_si128(isA, isC), _mm_or_si128(isG, isT));
+      __m128i r = _mm_or_si128(_mm_and_si128(isC, one), _mm_and_si128(isG, two));
+      r = _mm_or_si128(r, _mm_and_si128(isT, three));
+      r = _mm_or_si128(r, _mm_andnot_si128(_mm_or_si128(known, isIgn), four));
+      r = _mm_or_si128(r, _mm_and_si128(isIgn, five));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(codes + i), r);
+      sawIgnore |= (_mm_movemask_epi8(isIgn) != 0);
+    }
+  }
+#endif
+
+  // whatever is left (or everything, if we have no vector unit)
+  for (; i < len; ++i) {
+    codes[i] = codeTable[static_cast<uint8_t>(seq[i])];
+    sawIgnore |= (codes[i] == CODE_IGNORE);
+  }
+
+  if (qual != nullptr) { maskLowQuality(qual, len, minQual, codes); }
+
+  // Ignored characters (i.e. newlines) are rare enough in reads that we
+  // just squeeze them out after the fact.
+  if (sawIgnore) {
+    return std::distance(codes, std::remove(codes, codes + len, static_cast<uint8_t>(CODE_IGNORE)));
+  }
+  return len;
+}
+
+template <typename KmerT>
+size_t forwardAndReverseKmers(const uint8_t* codes, size_t n, uint32_t k, KmerT* fwd, KmerT* rev) {
+  const KmerT masq = kmerMask<KmerT>(k);
+  const uint32_t lshift = 2 * (k - 1);
+  KmerT kmer{0}, rkmer{0};
+  uint32_t cmlen{0};
+  size_t numKmers{0};
+  // The loop is branch-free; we always write the current kmer and
+  // only advance the output position if the window is full.
+  for (size_t i = 0; i < n; ++i) {
+    KmerT c = codes[i];
+    bool valid = (c < CODE_RESET);
+    c &= 0x3;
+    kmer = ((kmer << 2) & masq) | c;
+    rkmer = (rkmer >> 2) | ((0x3 - c) << lshift);
+    cmlen = valid ? std::min(cmlen + 1, k) : 0;
+    fwd[numKmers] = kmer;
+    rev[numKmers] = rkmer;
+    numKmers += (cmlen == k);
+  }
+  return numKmers;
+}
+
+template <typename KmerT>
+size_t canonicalKmers(const uint8_t* codes, size_t n, uint32_t k, KmerT* mers) {
+  const KmerT masq = kmerMask<KmerT>(k);
+  const uint32_t lshift = 2 * (k - 1);
+  KmerT kmer{0}, rkmer{0};
+  uint32_t cmlen{0};
+  size_t numKmers{0};
+  for (size_t i = 0; i < n; ++i) {
+    KmerT c = codes[i];
+    bool valid = (c < CODE_RESET);
+    c &= 0x3;
+    kmer = ((kmer << 2) & masq) | c;
+    rkmer = (rkmer >> 2) | ((0x3 - c) << lshift);
+    cmlen = valid ? std::min(cmlen + 1, k) : 0;
+    mers[numKmers] = (kmer < rkmer) ? kmer : rkmer;
+    numKmers += (cmlen == k);
+  }
+  return numKmers;
+}
+
+template <typename KmerT>
+size_t strandKmers(const uint8_t* codes, size_t n, uint32_t k, bool reverse, KmerT* mers) {
+  const KmerT masq = kmerMask<KmerT>(k);
+  const uint32_t lshift = 2 * (k - 1);
+  KmerT kmer{0};
+  uint32_t cmlen{0};
+  size_t numKmers{0};
+  if (reverse) {
+    for (size_t i = 0; i < n; ++i) {
+      KmerT c = codes[i];
+      bool valid = (c < CODE_RESET);
+      c &= 0x3;
+      kmer = (kmer >> 2) | ((0x3 - c) << lshift);
+      cmlen = valid ? std::min(cmlen + 1, k) : 0;
+      mers[numKmers] = kmer;
+      numKmers += (cmlen == k);
+    }
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      KmerT c = codes[i];
+      bool valid = (c < CODE_RESET);
+      c &= 0x3;
+      kmer = ((kmer << 2) & masq) | c;
+      cmlen = valid ? std::min(cmlen + 1, k) : 0;
+      mers[numKmers] = kmer;
+      numKmers += (cmlen == k);
+    }
+  }
+  return numKmers;
+}
+
+template size_t forwardAndReverseKmers<uint64_t>(const uint8_t*, size_t, uint32_t, uint64_t*, uint64_t*);
+template size_t forwardAndReverseKmers<Kmer128>(const uint8_t*, size_t, uint32_t, Kmer128*, Kmer128*);
+template size_t canonicalKmers<uint64_t>(const uint8_t*, size_t, uint32_t, uint64_t*);
+template size_t canonicalKmers<Kmer128>(const uint8_t*, size_t, uint32_t, Kmer128*);
+template size_t strandKmers<uint64_t>(const uint8_t*, size_t, uint32_t, bool, uint64_t*);
+template size_t strandKmers<Kmer128>(const uint8_t*, size_t, uint32_t, bool, Kmer128*);
+
+}
+}
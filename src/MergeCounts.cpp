@@ -0,0 +1,156 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include "tbb/task_scheduler_init.h"
+
+#include "CountDBNew.hpp"
+#include "PerfectHashIndex.hpp"
+
+/**
+*  Add up the partial counts (e.g. those of the shards of a sample counted
+*  with `sailfish count --shard`) in the files vm["partials"], all of which
+*  count the kmers of the index sfIndexFile, and write the total to
+*  vm["counts"].
+**/
+template <typename KmerT>
+void mergeCounts(const boost::program_options::variables_map& vm, const std::string& sfIndexFile,
+                 uint32_t numThreads) {
+    using std::string;
+    using Index = PerfectHashIndexT<KmerT>;
+    using CountDB = CountDBNewT<KmerT>;
+
+    std::cerr << "reading index . . . ";
+    auto phi = Index::fromFile(sfIndexFile);
+    std::cerr << "done\n";
+    auto del = []( Index* h ) -> void { /*do nothing*/; };
+    auto phiPtr = std::shared_ptr<Index>(&phi, del);
+
+    // sum into plain 32-bit counters, which can be added a vector at a time
+    CountDB total(phiPtr);
+    for (auto& partial : vm["partials"].as<std::vector<string>>()) {
+        std::cerr << "adding the counts in [" << partial << "]\n";
+        auto counts = CountDB::fromFile(partial, phiPtr, numThreads);
+        total.addCounts(counts);
+    }
+
+    string countsFile = vm["counts"].as<string>();
+    bool sparse = vm["sparse"].as<bool>();
+    uint32_t countBits = vm["countBits"].as<uint32_t>();
+    std::cerr << "writing the merged counts to [" << countsFile << "]\n";
+    bool written{false};
+    if (countBits == 32) {
+        written = total.dumpCountsToFile(countsFile, sparse);
+    } else {
+        CountDB compact(phiPtr, false, countBits);
+        compact.addCounts(total);
+        written = compact.dumpCountsToFile(countsFile, sparse);
+    }
+    if (!written) {
+        throw std::runtime_error("could not write " + countsFile);
+    }
+}
+
+int mainMergeCounts( int argc, char *argv[] ) {
+    using std::string;
+    namespace po = boost::program_options;
+
+    uint32_t maxThreads = std::thread::hardware_concurrency();
+
+    po::options_description generic("Sailfish merge-counts options");
+    generic.add_options()
+    ("version,v", "print version string")
+    ("help,h", "produce help message")
+    ("index,i", po::value<string>(), "transcript index file [Sailfish format]")
+    ("partials", po::value<std::vector<string>>()->multitoken(), "The counts files to add up")
+    ("counts,c", po::value<string>(), "File where the merged counts are written")
+    ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use when merging")
+    ("countBits", po::value<uint32_t>()->default_value(32), "The width (8, 16 or 32) of the merged counters (see `sailfish count`)")
+    ("sparse", po::bool_switch(), "Write only the nonzero merged counts (see `sailfish count`)")
+    ;
+
+    po::positional_options_description pd;
+    pd.add("partials", -1);
+
+    po::variables_map vm;
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(generic).positional(pd).run(), vm);
+
+        if ( vm.count("help") ) {
+            auto hstring = R"(
+merge-counts
+============
+Adds up the kmer counts in the files [partials], e.g. those written by
+`sailfish count --shard i/N` for each of the N shards of a sample, or by
+separate runs over the lanes of a sample.  All of them must count the kmers
+of the Sailfish index [index]; the total counts, and the total length and
+number of the reads, are written to the file [counts].
+)";
+            std::cout << hstring <<"\n";
+            std::cout << generic << std::endl;
+            std::exit(1);
+        }
+        po::notify(vm);
+
+        uint32_t countBits = vm["countBits"].as<uint32_t>();
+        if (countBits != 8 and countBits != 16 and countBits != 32) {
+            std::cerr << "--countBits must be one of 8, 16 or 32\n";
+            std::exit(1);
+        }
+
+        uint32_t numThreads = vm["threads"].as<uint32_t>();
+        tbb::task_scheduler_init init(numThreads);
+
+        string sfIndexBase = vm["index"].as<string>();
+        string sfTrascriptIndexFile = sfIndexBase+".sfi";
+
+        uint32_t indexMerLen = readIndexKmerLength(sfTrascriptIndexFile);
+        if (indexMerLen <= sailfish::kmers::maxKmerLength<uint64_t>()) {
+            mergeCounts<uint64_t>(vm, sfTrascriptIndexFile, numThreads);
+        } else {
+            mergeCounts<sailfish::kmers::Kmer128>(vm, sfTrascriptIndexFile, numThreads);
+        }
+
+    } catch (po::error &e) {
+        std::cerr << "Program Options Error : [" << e.what() << "]. Exiting.\n";
+        std::exit(1);
+    } catch (std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        std::cerr << "Usage\n";
+        std::cerr << "=====\n";
+        std::cout << generic << std::endl;
+        std::exit(1);
+    }
+
+    return 0;
+}
@@ -34,6 +34,8 @@
 #include <functional>
 #include <memory>
 #include <cassert>
+#include <random>
+#include <cmath>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -51,6 +53,7 @@
 #include "tbb/parallel_for_each.h"
 #include "tbb/parallel_for.h"
 #include "tbb/task_scheduler_init.h"
+#include "tbb/parallel_sort.h"
 
 #include "jellyfish/parse_dna.hpp"
 #include "jellyfish/mapped_file.hpp"
@@ -63,51 +66,78 @@
 
 #include "cmph.h"
 #include "CountDBNew.hpp"
+#include "CompressedFile.hpp"
+#include "MappedFile.hpp"
 // #include "LookUpTableUtils.hpp"
 #include "SailfishUtils.hpp"
 #include "GenomicFeature.hpp"
 #include "PerfectHashIndex.hpp"
+#include "KmerMPHF.hpp"
+#include "KmerStream.hpp"
+#include "KmerWord.hpp"
 
-void buildPerfectHashIndex(bool canonical, std::vector<uint64_t>& keys, std::vector<uint32_t>& counts, 
-                           size_t merLen, const boost::filesystem::path& indexBasePath) {
+// The longest kmers that Jellyfish (1.1) can count; its mer length is at most 31
+constexpr uint32_t JellyfishMaxK = 31;
 
-    namespace bfs = boost::filesystem;
-    size_t nkeys = keys.size();
+/**
+*  Estimate how often a kmer that is *not* in the index would be reported as
+*  present if only fingerprintBits bits of each key were kept, by probing the
+*  index with random kmers.
+**/
+template <typename KmerT>
+double measureFingerprintFPR(const char* packedHash, 
+                             const typename PerfectHashIndexT<KmerT>::KmerVector& orderedMers,
+                             size_t merLen, uint32_t fingerprintBits) {
+    using Index = PerfectHashIndexT<KmerT>;
+    const size_t numProbes = 1000000;
+    KmerT merMask = sailfish::kmers::kmerMask<KmerT>(merLen);
+    uint64_t fpMask = (uint64_t(1) << fingerprintBits) - 1;
+
+    std::mt19937_64 gen(merLen);
+    size_t numAbsent{0}, numFalsePositives{0};
+    for (size_t i = 0; i < numProbes; ++i) {
+        // fill every 64-bit word of the kmer with random bits
+        KmerT k{0};
+        for (size_t w = 0; w < sizeof(KmerT) / sizeof(uint64_t); ++w) { k = ((k << 32) << 32) | KmerT(gen()); }
+        k &= merMask;
+        KmerT slotKey = orderedMers[KmerMPHF::lookup(packedHash, k)];
+        if (slotKey == k) { continue; }
+        ++numAbsent;
+        if (((Index::fingerprint(k) ^ Index::fingerprint(slotKey)) & fpMask) == 0) {
+            ++numFalsePositives;
+        }
+    }
+    return (numAbsent > 0) ? static_cast<double>(numFalsePositives) / numAbsent : 0.0;
+}
 
-    std::vector<uint64_t> orderedMers(nkeys, 0);
+/**
+*  Build an index over keys around a (native) minimal perfect hash function.
+**/
+template <typename KmerT>
+PerfectHashIndexT<KmerT> buildHashedIndex(bool canonical, std::vector<KmerT>& keys, 
+                                          size_t merLen, uint32_t fingerprintBits) {
+    size_t nkeys = keys.size();
 
-    // Source of keys -- oh C, how I love thee
-    cmph_io_adapter_t *source = cmph_io_struct_vector_adapter(static_cast<void *>(&keys[0]),
-                                                              static_cast<cmph_uint32>(sizeof(uint64_t)), 
-                                                              0, sizeof(uint64_t), nkeys);
+    using Index = PerfectHashIndexT<KmerT>;
+    typename Index::KmerVector orderedMers(nkeys, 0);
 
     std::cerr << "Building a perfect hash from the Jellyfish hash.\n";
-    cmph_t *hash = nullptr;
-    size_t i = 0;
+    std::vector<char> hash;
     { 
       boost::timer::auto_cpu_timer t;     
-      //Create minimal perfect hash function using the brz algorithm.
-      cmph_config_t *config = cmph_config_new(source);
-      cmph_config_set_algo(config, CMPH_BDZ);
-      cmph_config_set_memory_availability(config, 1000);
-      cmph_config_set_b(config, 3);
-      cmph_config_set_keys_per_bin(config, 1);
-
-      hash = cmph_new(config);
+      // Create the minimal perfect hash function (in parallel)
+      hash = KmerMPHF::build(keys);
     }
-
-    assert(hash != nullptr);
-    std::unique_ptr<cmph_t, std::function<void(cmph_t*)>> ownedHash(hash, cmph_destroy);
+    std::cerr << "perfect hash uses " << (8.0 * hash.size()) / nkeys << " bits / key\n";
 
     std::cerr << "saving keys in perfect hash . . .";
     auto start = std::chrono::steady_clock::now();
     {
       boost::timer::auto_cpu_timer t;
+      const char* packedHash = &hash[0];
       tbb::parallel_for_each( keys.begin(), keys.end(), 
-        [&ownedHash, &orderedMers]( uint64_t k ) -> void {
-          char *key = (char*)(&k);
-          unsigned int id = cmph_search(ownedHash.get(), key, sizeof(uint64_t));
-          orderedMers[id] = k;
+        [packedHash, &orderedMers]( KmerT k ) -> void {
+          orderedMers[KmerMPHF::lookup(packedHash, k)] = k;
         });
 
     }
@@ -117,15 +147,67 @@ void buildPerfectHashIndex(bool canonical, std::vector<uint64_t>& keys, std::vec
     auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
     std::cerr << "took: " << static_cast<double>(ms.count()) / keys.size() << " us / key\n";
 
-    PerfectHashIndex phi(orderedMers, ownedHash, merLen, canonical);
-    
+    if (fingerprintBits > 0) {
+        double fpr = measureFingerprintFPR<KmerT>(&hash[0], orderedMers, merLen, fingerprintBits);
+        std::cerr << "storing " << fingerprintBits << "-bit key fingerprints; false positive rate: "
+                  << fpr << " measured, " << std::ldexp(1.0, -static_cast<int>(fingerprintBits)) 
+                  << " expected\n";
+    }
+
+    return Index(orderedMers, hash, HashType::NATIVE, merLen, canonical, fingerprintBits);
+}
+
+/**
+*  Build the index over keys, along with the transcript counts (counts), and
+*  write both to indexBasePath.  Short kmers are indexed directly (with a
+*  dense table) rather than through a perfect hash, if there are enough of
+*  them for the table not to dwarf a hashed index (see
+*  PerfectHashIndexT::denseFits) and a succinct (Elias-Fano) index isn't
+*  requested.  Unless filterBits is 0, a hashed or
+*  succinct index also gets a filter of filterBits bits / key, which lets
+*  lookups of absent kmers skip the index.
+**/
+template <typename KmerT>
+void buildPerfectHashIndex(bool canonical, std::vector<KmerT>& keys, std::vector<uint32_t>& counts, 
+                           size_t merLen, uint32_t fingerprintBits, uint32_t filterBits,
+                           bool eliasFano, const boost::filesystem::path& indexBasePath) {
+
+    namespace bfs = boost::filesystem;
+    using Index = PerfectHashIndexT<KmerT>;
+
+    auto buildDenseIndex = [&]() -> Index {
+        std::cerr << "kmers are short enough to index directly; building a dense index of "
+                  << Index::denseTableBytes(merLen) / (1024.0 * 1024.0) << "MB\n";
+        if (fingerprintBits > 0) { std::cerr << "(a dense index stores no keys; ignoring --fingerprint)\n"; }
+        typename Index::KmerVector denseKeys(keys.begin(), keys.end());
+        return Index::denseIndex(denseKeys, merLen, canonical);
+    };
+    auto buildEliasFanoIndex = [&]() -> Index {
+        std::cerr << "building a succinct (Elias-Fano) index\n";
+        if (fingerprintBits > 0) { std::cerr << "(a succinct index stores no keys; ignoring --fingerprint)\n"; }
+        typename Index::KmerVector sortedKeys(keys.begin(), keys.end());
+        Index index = Index::eliasFanoIndex(sortedKeys, merLen, canonical);
+        std::cerr << "the succinct index uses " << (8.0 * index.hashBytes()) / keys.size() << " bits / key\n";
+        return index;
+    };
+    Index phi = eliasFano ? buildEliasFanoIndex() :
+                Index::denseFits(merLen, keys.size()) ? buildDenseIndex() : 
+                                               buildHashedIndex(canonical, keys, merLen, fingerprintBits);
+
+    if (filterBits > 0 and phi.hashType() != HashType::DENSE) {
+        std::vector<char> filter = BlockedBloomFilter::build(keys, filterBits);
+        std::cerr << "built a " << filter.size() / (1024.0 * 1024.0) << "MB filter over the keys ("
+                  << filterBits << " bits / key)\n";
+        phi.setFilter(filter);
+    }
+
     bfs::path transcriptomeIndexPath(indexBasePath); transcriptomeIndexPath /= "transcriptome.sfi";
     std::cerr << "writing index to file " << transcriptomeIndexPath << "\n";
     auto dthread1 = std::thread( [&phi, transcriptomeIndexPath]() -> void { phi.dumpToFile(transcriptomeIndexPath.string()); } );
 
-    auto del = []( PerfectHashIndex* h ) -> void { /*do nothing*/; };
-    auto phiPtr = std::shared_ptr<PerfectHashIndex>(&phi, del);
-    CountDBNew thash( phiPtr );
+    auto del = []( Index* h ) -> void { /*do nothing*/; };
+    auto phiPtr = std::shared_ptr<Index>(&phi, del);
+    CountDBNewT<KmerT> thash( phiPtr );
 
     tbb::parallel_for( size_t{0}, keys.size(),
       [&thash, &keys, &counts]( size_t idx ) {
@@ -221,10 +303,63 @@ int runJellyfish(bool canonical,
     */
 }
 
-void buildLUTs(
+/**
+*  Count the kmers of the transcripts directly (rather than with Jellyfish,
+*  which can't handle kmers longer than 31 bases), filling keys with the
+*  distinct kmers and counts with the number of times each occurs.
+**/
+template <typename KmerT>
+void countTranscriptKmers(bool canonical, uint32_t merLen, uint32_t numThreads,
+                          std::vector<std::string>& transcriptFiles,
+                          std::vector<KmerT>& keys, std::vector<uint32_t>& counts) {
+    std::vector<char*> fnames;
+    for (auto& fn : transcriptFiles) { fnames.push_back(const_cast<char*>(fn.c_str())); }
+    jellyfish::parse_read parser(&fnames[0], &fnames[0] + fnames.size(), 1000);
+
+    std::cerr << "counting the kmers of the transcripts . . . ";
+    std::vector<std::vector<KmerT>> threadMers(numThreads);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&parser, &threadMers, t, merLen, canonical]() -> void {
+            jellyfish::parse_read::thread stream = parser.new_thread();
+            jellyfish::parse_read::read_t* read;
+            sailfish::kmers::KmerStreamT<KmerT> mers(merLen);
+            auto& local = threadMers[t];
+            while ( (read = stream.next_read()) ) {
+                if (canonical) {
+                    mers.canonical(read->seq_s, read->seq_e);
+                } else {
+                    mers.directional(read->seq_s, read->seq_e);
+                }
+                local.insert(local.end(), mers.fwd(), mers.fwd() + mers.numKmers());
+            }
+        });
+    }
+    for (auto& t : threads) { t.join(); }
+
+    std::vector<KmerT> allMers;
+    for (auto& local : threadMers) {
+        allMers.insert(allMers.end(), local.begin(), local.end());
+        std::vector<KmerT>().swap(local);
+    }
+    tbb::parallel_sort(allMers.begin(), allMers.end());
+
+    keys.clear(); counts.clear();
+    for (size_t i = 0; i < allMers.size(); ) {
+        size_t j = i;
+        while (j < allMers.size() and allMers[j] == allMers[i]) { ++j; }
+        keys.push_back(allMers[i]);
+        counts.push_back(static_cast<uint32_t>(j - i));
+        i = j;
+    }
+    std::cerr << "done; " << keys.size() << " distinct kmers\n";
+}
+
+template <typename KmerT>
+int buildLUTs(
   const std::vector<std::string>& transcriptFiles, //!< File from which transcripts are read
-  PerfectHashIndex& transcriptIndex,               //!< Index of transcript kmers
-  CountDBNew& transcriptHash,                      //!< Count of kmers in transcripts
+  PerfectHashIndexT<KmerT>& transcriptIndex,       //!< Index of transcript kmers
+  CountDBNewT<KmerT>& transcriptHash,              //!< Count of kmers in transcripts
   TranscriptGeneMap& tgmap,                        //!< Transcript => Gene map
   const std::string& tlutfname,                    //!< Transcript lookup table filename
   const std::string& klutfname,                    //!< Kmer lookup table filename
@@ -236,6 +371,65 @@ int computeBiasFeatures(
     boost::filesystem::path outFilePath,
     size_t numThreads);
 
+/**
+*  Replace the file at path with its compressed container (see
+*  CompressedFile.hpp), compressing on numThreads threads.
+**/
+void compressIndexFile(const boost::filesystem::path& path, uint32_t numThreads) {
+    namespace bfs = boost::filesystem;
+    bfs::path tmpPath(path); tmpPath += ".tmp";
+    uint64_t rawSize{0}, compressedSize{0};
+    {
+        sailfish::MappedFile raw(path.string());
+        rawSize = raw.size();
+        compressedSize = sailfish::compressed::compress(raw.base(), raw.size(), tmpPath.string(), numThreads);
+    }
+    bfs::rename(tmpPath, path);
+    std::cerr << "compressed " << path << " with " 
+              << sailfish::compressed::codecName(sailfish::compressed::DefaultCodec) << ": "
+              << rawSize << " -> " << compressedSize << " bytes\n";
+}
+
+/**
+*  Build the index over (and the transcript counts of) the given kmers, then
+*  build the lookup tables from the files that were written.  If compress is
+*  true, the index and the lookup tables are finally compressed.
+**/
+template <typename KmerT>
+void buildIndexAndLUTs(bool canonical, std::vector<KmerT>& keys, std::vector<uint32_t>& counts,
+                       uint32_t merLen, uint32_t fingerprintBits, uint32_t filterBits,
+                       bool eliasFano, TranscriptGeneMap& tgmap,
+                       std::vector<std::string>& transcriptFiles, 
+                       const boost::filesystem::path& outputPath, uint32_t numThreads,
+                       bool compress) {
+    namespace bfs = boost::filesystem;
+    using Index = PerfectHashIndexT<KmerT>;
+
+    buildPerfectHashIndex(canonical, keys, counts, merLen, fingerprintBits, filterBits, eliasFano, outputPath);
+
+    bfs::path sfIndexPath(outputPath); sfIndexPath /= "transcriptome.sfi";
+    std::cerr << "Reading transcript index from [" << sfIndexPath << "] . . .";
+    auto sfIndex = Index::fromFile( sfIndexPath.string() );
+    auto del = []( Index* h ) -> void { /*do nothing*/; };
+    auto sfIndexPtr = std::shared_ptr<Index>( &sfIndex, del );
+    std::cerr << "done\n";
+
+    bfs::path sfCountPath(outputPath); sfCountPath /= "transcriptome.sfc";
+    std::cerr << "Reading transcript counts from [" << sfCountPath.string() << "] . . .";
+    auto sfTranscriptCountIndex = CountDBNewT<KmerT>::fromFile(sfCountPath.string(), sfIndexPtr);
+    std::cerr << "done\n";
+
+    bfs::path tlutPath(outputPath); tlutPath /= "transcriptome.tlut";
+    bfs::path klutPath(outputPath); klutPath /= "transcriptome.klut";
+
+    buildLUTs(transcriptFiles, sfIndex, sfTranscriptCountIndex, 
+              tgmap, tlutPath.string(), klutPath.string(), numThreads);
+
+    if (compress) {
+        for (auto& path : {sfIndexPath, tlutPath, klutPath}) { compressIndexFile(path, numThreads); }
+    }
+}
+
 int mainIndex( int argc, char *argv[] ) {
     using std::string;
     namespace po = boost::program_options;
@@ -248,7 +442,7 @@ int mainIndex( int argc, char *argv[] ) {
     ("help,h", "produce help message")
     ("transcripts,t", po::value<std::vector<string>>()->multitoken(), "Transcript fasta file(s)." )
     ("tgmap,m", po::value<string>(), "file that maps transcripts to genes")
-    ("kmerSize,k", po::value<uint32_t>()->required(), "Kmer size.")
+    ("kmerSize,k", po::value<uint32_t>()->required(), "Kmer size (at most 64; kmers longer than 32 bases use 128-bit words).")
     ("out,o", po::value<string>(), "Output stem [all files needed by Sailfish will be of the form stem.*].")
     ("canonical,c", po::bool_switch(), "Passing this flag in forces all processing to be done on canonical kmers.\n"
                                        "This means transcripts will be mapped to their canonical kmer multiset and\n"
@@ -260,6 +454,22 @@ int mainIndex( int argc, char *argv[] ) {
     //("index,i", po::value<string>(), "transcript index file [Sailfish format]")
     ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use concurrently.")
     ("force,f", po::bool_switch(), "" )
+    ("fingerprint", po::value<uint32_t>()->default_value(0), "Store an 8, 16 or 32-bit fingerprint of each kmer in the index\n"
+                                                            "rather than the kmer itself.  This makes the index much smaller, but\n"
+                                                            "a kmer that is not in the index will be counted as if it were with\n"
+                                                            "probability 2^-(fingerprint bits).  The default (0) stores the full kmers.\n")
+    ("filterBits", po::value<uint32_t>()->default_value(8), "The size, in bits per kmer, of the Bloom filter stored with the index.\n"
+                                                           "When counting, kmers that the filter rejects (e.g. those containing\n"
+                                                           "sequencing errors) are discarded without consulting the index.  0\n"
+                                                           "disables the filter.\n")
+    ("eliasFano", po::bool_switch(), "Build a succinct index, which stores the sorted kmers as an Elias-Fano\n"
+                                     "sequence in place of the perfect hash and the kmers themselves.  This\n"
+                                     "takes several times less memory than the default index, but lookups\n"
+                                     "are slower.  Kmers must be at most 32 bases long.\n")
+    ("compress", po::bool_switch(), "Compress the index and the lookup tables.  Loading them then reads\n"
+                                    "less data, and decompresses on all cores, which is faster when they\n"
+                                    "are on slow (e.g. network) storage; on local disks, leave them\n"
+                                    "uncompressed.\n")
     ;
 
     po::variables_map vm;
@@ -287,6 +497,25 @@ the Jellyfish database [thash] of the transcripts.
         uint32_t numThreads = vm["threads"].as<uint32_t>();
         bool force = vm["force"].as<bool>();
         bool canonical = vm["canonical"].as<bool>();
+        if (merLen == 0 or merLen > sailfish::kmers::maxKmerLength<sailfish::kmers::Kmer128>()) {
+            std::cerr << "The kmer size must be between 1 and " 
+                      << sailfish::kmers::maxKmerLength<sailfish::kmers::Kmer128>() << "\n";
+            std::exit(1);
+        }
+        uint32_t fingerprintBits = vm["fingerprint"].as<uint32_t>();
+        if (fingerprintBits != 0 and fingerprintBits != 8 and 
+            fingerprintBits != 16 and fingerprintBits != 32) {
+            std::cerr << "--fingerprint must be one of 0, 8, 16 or 32\n";
+            std::exit(1);
+        }
+        uint32_t filterBits = vm["filterBits"].as<uint32_t>();
+        bool eliasFano = vm["eliasFano"].as<bool>();
+        bool compress = vm["compress"].as<bool>();
+        if (eliasFano and merLen > sailfish::kmers::maxKmerLength<uint64_t>()) {
+            std::cerr << "--eliasFano requires a kmer size of at most " 
+                      << sailfish::kmers::maxKmerLength<uint64_t>() << "\n";
+            std::exit(1);
+        }
 
         // Check to make sure that the specified output directory either doesn't exist, or is
         // a valid path (e.g. not a file)
@@ -321,7 +550,11 @@ the Jellyfish database [thash] of the transcripts.
 
         bfs::path jfHashFile(outputPath); jfHashFile /= "jf.counts_0";
 
-        mustRecompute = (force or !boost::filesystem::exists(jfHashFile));
+        // Kmers longer than Jellyfish can count are counted without it, so
+        // there is no Jellyfish hash to check for
+        bfs::path sfIndexFile(outputPath); sfIndexFile /= "transcriptome.sfi";
+        bool useJellyfish = (merLen <= JellyfishMaxK);
+        mustRecompute = (force or !boost::filesystem::exists(useJellyfish ? jfHashFile : sfIndexFile));
 
         if (!mustRecompute) {
             // Check that the jellyfish has at the given location 
@@ -330,41 +563,6 @@ the Jellyfish database [thash] of the transcripts.
         }
 
         if (mustRecompute) {
-            std::cerr << "Running Jellyfish on transcripts\n";
-            runJellyfish(canonical, merLen, numThreads, outputStem, transcriptFiles);
-
-            std::cerr << "Jellyfish finished\n";
-
-            bfs::path thashFile = jfHashFile;//vm["thash"].as<string>();
-            bool recomputePerfectIndex = mustRecompute;
-
-            // Read in the Jellyfish hash of the transcripts
-            mapped_file transcriptDB(thashFile.c_str());
-            transcriptDB.random().will_need();
-            char typeTrans[8];
-            memcpy(typeTrans, transcriptDB.base(), sizeof(typeTrans));
-
-            hash_query_t transcriptHash(thashFile.c_str());
-            std::cerr << "transcriptHash size is " << transcriptHash.get_distinct() << "\n";
-            size_t nkeys = transcriptHash.get_distinct();
-            size_t merLen = transcriptHash.get_mer_len();
-
-            std::vector<uint64_t> keys(nkeys,0);
-            std::vector<uint32_t> counts(nkeys,0);
-
-            tbb::task_scheduler_init init(numThreads);
-            auto it = transcriptHash.iterator_all();
-            size_t i = 0;
-            while ( it.next() ) {
-                keys[i] = it.get_key();
-                counts[i] = it.get_val();
-                ++i;
-            }
-
-            bfs::path sfIndexBase(outputPath);
-            bfs::path sfIndexFile(sfIndexBase); sfIndexFile /= "transcriptome.sfi";
-            buildPerfectHashIndex(canonical, keys, counts, merLen, sfIndexBase);
-
             TranscriptGeneMap tgmap;
             if (vm.count("tgmap") ) { // if we have a GTF file
                 string transcriptGeneMap = vm["tgmap"].as<string>();
@@ -380,7 +578,6 @@ the Jellyfish database [thash] of the transcripts.
                 std::cerr << "done\n";
             }
 
-
             { // save transcript <-> gene map to archive
                 bfs::path tgmOutPath(outputPath); tgmOutPath /= "transcriptome.tgm";
                 std::cerr << "Saving transcritpt to gene map to [" << tgmOutPath << "]\n";
@@ -390,23 +587,58 @@ the Jellyfish database [thash] of the transcripts.
                 oa << tgmap;
             } // archive and stream closed when destructors are called
 
-            bfs::path sfIndexPath(outputPath); sfIndexPath /= "transcriptome.sfi";
-            std::cerr << "Reading transcript index from [" << sfIndexPath << "] . . .";
-            auto sfIndex = PerfectHashIndex::fromFile( sfIndexPath.string() );
-            auto del = []( PerfectHashIndex* h ) -> void { /*do nothing*/; };
-            auto sfIndexPtr = std::shared_ptr<PerfectHashIndex>( &sfIndex, del );
-            std::cerr << "done\n";
-
-            bfs::path sfCountPath(outputPath); sfCountPath /= "transcriptome.sfc";
-            std::cerr << "Reading transcript counts from [" << sfCountPath.string() << "] . . .";
-            auto sfTranscriptCountIndex = CountDBNew::fromFile(sfCountPath.string(), sfIndexPtr);
-            std::cerr << "done\n";
-
-            bfs::path tlutPath(outputPath); tlutPath /= "transcriptome.tlut";
-            bfs::path klutPath(outputPath); klutPath /= "transcriptome.klut";
+            tbb::task_scheduler_init init(numThreads);
 
-            buildLUTs(transcriptFiles, sfIndex, sfTranscriptCountIndex, 
-                      tgmap, tlutPath.string(), klutPath.string(), numThreads);
+            if (useJellyfish) {
+                std::cerr << "Running Jellyfish on transcripts\n";
+                runJellyfish(canonical, merLen, numThreads, outputStem, transcriptFiles);
+
+                std::cerr << "Jellyfish finished\n";
+
+                bfs::path thashFile = jfHashFile;//vm["thash"].as<string>();
+
+                // Read in the Jellyfish hash of the transcripts
+                mapped_file transcriptDB(thashFile.c_str());
+                transcriptDB.random().will_need();
+                char typeTrans[8];
+                memcpy(typeTrans, transcriptDB.base(), sizeof(typeTrans));
+
+                hash_query_t transcriptHash(thashFile.c_str());
+                std::cerr << "transcriptHash size is " << transcriptHash.get_distinct() << "\n";
+                size_t nkeys = transcriptHash.get_distinct();
+                size_t merLen = transcriptHash.get_mer_len();
+
+                std::vector<uint64_t> keys(nkeys,0);
+                std::vector<uint32_t> counts(nkeys,0);
+
+                auto it = transcriptHash.iterator_all();
+                size_t i = 0;
+                while ( it.next() ) {
+                    keys[i] = it.get_key();
+                    counts[i] = it.get_val();
+                    ++i;
+                }
+
+                buildIndexAndLUTs(canonical, keys, counts, merLen, fingerprintBits, filterBits, eliasFano, tgmap,
+                                  transcriptFiles, outputPath, numThreads, compress);
+            } else if (merLen <= sailfish::kmers::maxKmerLength<uint64_t>()) {
+                // Jellyfish can't count 32-mers, but they still fit in a 64-bit word
+                std::vector<uint64_t> keys;
+                std::vector<uint32_t> counts;
+                countTranscriptKmers(canonical, merLen, numThreads, transcriptFiles, keys, counts);
+
+                buildIndexAndLUTs(canonical, keys, counts, merLen, fingerprintBits, filterBits, eliasFano, tgmap,
+                                  transcriptFiles, outputPath, numThreads, compress);
+            } else {
+                // Longer kmers need 128-bit words
+                using sailfish::kmers::Kmer128;
+                std::vector<Kmer128> keys;
+                std::vector<uint32_t> counts;
+                countTranscriptKmers(canonical, merLen, numThreads, transcriptFiles, keys, counts);
+
+                buildIndexAndLUTs(canonical, keys, counts, merLen, fingerprintBits, filterBits, eliasFano, tgmap,
+                                  transcriptFiles, outputPath, numThreads, compress);
+            }
 
         } else {
             std::cerr << "All index files seem up-to-date.\n";
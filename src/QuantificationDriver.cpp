@@ -22,6 +22,7 @@
 
 #include <cstdio>
 #include <iostream>
+#include <iomanip>
 #include <cstdlib>
 #include <fstream>
 #include <vector>
@@ -46,6 +47,12 @@ int runKmerCounter(const std::string& sfCommand,
                    uint32_t numThreads,
                    const std::string& indexBase, 
                    const std::vector<string>& readFiles, 
+                   const std::vector<string>& mates1, 
+                   const std::vector<string>& mates2, 
+                   const std::string& libType, 
+                   uint32_t minQuality, 
+                   double sampleFraction, 
+                   uint64_t maxReads, 
                    const std::string& countFileOut) {
 
     std::stringstream argStream;
@@ -53,10 +60,23 @@ int runKmerCounter(const std::string& sfCommand,
     argStream << "--index " << indexBase << " ";
     argStream << "--counts " << countFileOut << " ";
     argStream << "--threads " << numThreads << " ";
-
-    argStream << "--reads ";
-    for (auto& rfile : readFiles) {
-        argStream << rfile << " ";
+    argStream << "--libtype " << libType << " ";
+    argStream << "--minQuality " << minQuality << " ";
+    // (all 17 digits, so that count draws exactly the same sample)
+    argStream << "--sampleFraction " << std::setprecision(17) << sampleFraction << " ";
+    argStream << "--maxReads " << maxReads << " ";
+
+    if (!readFiles.empty()) {
+        argStream << "--reads ";
+        for (auto& rfile : readFiles) {
+            argStream << rfile << " ";
+        }
+    }
+    if (!mates1.empty()) {
+        argStream << "--mates1 ";
+        for (auto& rfile : mates1) { argStream << rfile << " "; }
+        argStream << "--mates2 ";
+        for (auto& rfile : mates2) { argStream << rfile << " "; }
     }
 
     std::string argString = argStream.str();
@@ -169,7 +189,17 @@ int mainQuantify( int argc, char *argv[] ) {
     ("version,v", "print version string")
     ("help,h", "produce help message")
     ("index,i", po::value<string>(), "Sailfish index [output of the \"Sailfish index\" command")        
-    ("reads,r", po::value<std::vector<string>>()->multitoken(), "List of files containing reads")
+    ("reads,r", po::value<std::vector<string>>()->multitoken(), "List of files containing reads (\"-\" for standard input; named pipes and gzipped files are streamed)")
+    ("mates1,1", po::value<std::vector<string>>()->multitoken(), "List of files containing the first mates of paired-end reads")
+    ("mates2,2", po::value<std::vector<string>>()->multitoken(), "List of files containing the second mates, in the same order as the first")
+    ("libtype", po::value<string>()->default_value("A"), "The strand protocol of the library: U (unstranded), SF or SR "
+                                                         "(stranded, forward or reverse), or A to infer it from the first reads")
+    ("minQuality", po::value<uint32_t>()->default_value(0), "Don't count kmers that span a base whose (Phred+33) quality is below this")
+    ("sampleFraction", po::value<double>()->default_value(1.0), "Count only this fraction (in (0, 1]) of the reads, for a quick estimate; "
+                                                                 "the counts are scaled up to match, unless maxReads stops the counting early")
+    ("maxReads", po::value<uint64_t>()->default_value(0), "Stop after counting this many reads, or fragments of paired reads "
+                                                         "(0 for no limit).  Which reads are counted can differ between runs, "
+                                                         "and the counts are not scaled")
     ("no_bias_correct", po::value(&noBiasCorrect)->zero_tokens(), "turn off bias correction")    
     //("tgmap,m", po::value<string>(), "file that maps transcripts to genes")
     ("out,o", po::value<string>(), "Basename of file where estimates are written")
@@ -197,7 +227,18 @@ int mainQuantify( int argc, char *argv[] ) {
         //string tgmap = vm["tgmap"].as<string>();
         //string tgmap = indexBase+".tgm";
         uint32_t numThreads = vm["threads"].as<uint32_t>();
-        std::vector<string> readFiles = vm["reads"].as<std::vector<string>>();
+        std::vector<string> readFiles, mates1, mates2;
+        if (vm.count("reads")) { readFiles = vm["reads"].as<std::vector<string>>(); }
+        if (vm.count("mates1")) { mates1 = vm["mates1"].as<std::vector<string>>(); }
+        if (vm.count("mates2")) { mates2 = vm["mates2"].as<std::vector<string>>(); }
+        if (mates1.empty() != mates2.empty()) {
+            std::cerr << "--mates1 and --mates2 must be given together\n";
+            std::exit(1);
+        }
+        if (readFiles.empty() and mates1.empty()) {
+            std::cerr << "no reads were given (with --reads, or --mates1 and --mates2)\n";
+            std::exit(1);
+        }
         bool force = vm["force"].as<bool>();
 
         /*
@@ -234,7 +275,9 @@ int mainQuantify( int argc, char *argv[] ) {
 
         mustRecount = (force or !boost::filesystem::exists(countFilePath));
         if (mustRecount) {
-            runKmerCounter(sfCommand, numThreads, indexPath.string(), readFiles, countFilePath.string());
+            runKmerCounter(sfCommand, numThreads, indexPath.string(), readFiles, mates1, mates2, 
+                           vm["libtype"].as<string>(), vm["minQuality"].as<uint32_t>(), 
+                           vm["sampleFraction"].as<double>(), vm["maxReads"].as<uint64_t>(), countFilePath.string());
         }
 
         /*
@@ -35,6 +35,7 @@
 #include <unordered_map>
 #include <mutex>
 #include <thread>
+#include <future>
 #include <chrono>
 #include <iomanip>
 
@@ -66,6 +67,93 @@ int performBiasCorrection(boost::filesystem::path featPath,
                           boost::filesystem::path outPath,
                           size_t numThreads);
 
+/**
+*  Load the index and read counts (whose kmers are packed into words of type
+*  KmerT) and estimate the transcript abundances from them.  The transcript
+*  <-> gene map (tgmFuture) is being loaded concurrently; the kmer and
+*  transcript lookup tables are loaded in the background as well, while the
+*  index and counts are read, and the optimizer waits for each only when it
+*  first needs it.
+**/
+template <typename KmerT>
+void estimateAbundances(const boost::program_options::variables_map& vm,
+                        const std::string& sfIndexFile, const std::string& hashFile,
+                        std::future<TranscriptGeneMap>& tgmFuture, uint32_t numThreads, bool poisson,
+                        const std::string& klutfname, const std::string& tlutfname,
+                        double minMean, const boost::filesystem::path& outputFilePath,
+                        const std::string& commandLine) {
+    using std::string;
+    using Index = PerfectHashIndexT<KmerT>;
+    using CountDB = CountDBNewT<KmerT>;
+
+    std::future<std::vector<LUTTools::TranscriptList>> klut;
+    std::future<std::vector<LUTTools::Length>> transcriptLengths;
+    if ( !poisson ) {
+      std::cerr << "Reading the kmer and transcript lookup tables in the background\n";
+      klut = std::async(std::launch::async, [&klutfname]() -> std::vector<LUTTools::TranscriptList> {
+          std::vector<LUTTools::TranscriptList> transcriptsForKmer;
+          LUTTools::readKmerLUT(klutfname, transcriptsForKmer);
+          return transcriptsForKmer;
+      });
+      transcriptLengths = std::async(std::launch::async, [&tlutfname]() -> std::vector<LUTTools::Length> {
+          return LUTTools::readTranscriptLengths(tlutfname);
+      });
+    }
+
+    std::cerr << "Reading transcript index from [" << sfIndexFile << "] . . .";
+    auto sfIndex = Index::fromFile( sfIndexFile );
+    auto del = []( Index* h ) -> void { /*do nothing*/; };
+    auto sfIndexPtr = std::shared_ptr<Index>( &sfIndex, del );
+    std::cerr << "done\n";
+
+    /*
+    std::cerr << "Reading transcript counts from [" << sfTrascriptCountFile << "] . . .";
+    auto transcriptHash = CountDB::fromFile(sfTrascriptCountFile, sfIndexPtr);
+    std::cerr << "done\n";
+    */
+   
+    // the READ hash
+    std::cerr << "Reading read counts from [" << hashFile << "] . . .";
+    auto hash = CountDB::fromFile( hashFile, sfIndexPtr, numThreads );
+    std::cerr << "done\n";
+    //const std::vector<string>& geneFiles{genesFile};
+    auto merLen = sfIndex.kmerLength();
+    
+    BiasIndex bidx = vm.count("bias") ? BiasIndex( vm["bias"].as<string>() ) : BiasIndex();
+
+    auto tgm = tgmFuture.get();
+
+    std::cerr << "Creating optimizer . . .";
+    CollapsedIterativeOptimizer<CountDB> solver(hash, tgm, bidx, numThreads);
+    // IterativeOptimizer<CountDBNew, CountDBNew> solver( hash, transcriptHash, tgm, bidx );
+    std::cerr << "done\n";
+
+    if ( poisson ) {
+      std::cerr << "optimizing using Poisson model\n";
+      // for IterativeOptimizer
+      // solver.optimizePoisson( geneFiles, outputFile );
+    } else {
+      size_t numIter = vm["iterations"].as<size_t>();
+      std::cerr << "optimizing using iterative optimization [" << numIter << "] iterations";
+      // for CollapsedIterativeOptimizer (EM algorithm)
+
+      solver.optimize(klut, transcriptLengths, numIter, minMean );
+
+      std::stringstream headerLines;
+      headerLines << "# [sailfish version]\t" << Sailfish::version << "\n";
+      headerLines << "# [kmer length]\t" << sfIndex.kmerLength() << "\n";
+      headerLines << "# [using canonical kmers]\t" << (sfIndex.canonical() ? "true" : "false") << "\n";
+      headerLines << "# [command]\t" << commandLine << "\n";
+
+      solver.writeAbundances(outputFilePath, headerLines.str());
+
+      // for LASSO Iterative Optimizer
+      //solver.optimizeNNLASSO(klutfname, tlutfname, outputFile, numIter, minMean );
+      // for IterativeOptimizer
+      // solver.optimize( geneFiles, outputFile, numIter, minMean );
+    }
+}
+
 int runIterativeOptimizer(int argc, char* argv[] ) {
   using std::string;
   namespace bfs = boost::filesystem;
@@ -151,65 +239,33 @@ int runIterativeOptimizer(int argc, char* argv[] ) {
     auto tlutfname = lutprefix + ".tlut";
     auto klutfname = lutprefix + ".klut";
 
-    TranscriptGeneMap tgm;
-    { // read the serialized transcript <-> gene map from file
-      string tgmFile = sfIndexBase+".tgm";
+    // read the serialized transcript <-> gene map from file, while the
+    // other inputs are loaded
+    string tgmFile = sfIndexBase+".tgm";
+    auto tgm = std::async(std::launch::async, [tgmFile]() -> TranscriptGeneMap {
       std::cerr << "Reading the transcript <-> gene map from [" <<
                    tgmFile << "]\n";
+      TranscriptGeneMap map;
       std::ifstream ifs(tgmFile, std::ios::binary);
       boost::archive::binary_iarchive ia(ifs);
-      ia >> tgm;
-      std::cerr << "done\n";
-    }
-
-    std::cerr << "Reading transcript index from [" << sfIndexFile << "] . . .";
-    auto sfIndex = PerfectHashIndex::fromFile( sfIndexFile );
-    auto del = []( PerfectHashIndex* h ) -> void { /*do nothing*/; };
-    auto sfIndexPtr = std::shared_ptr<PerfectHashIndex>( &sfIndex, del );
-    std::cerr << "done\n";
-
-    /*
-    std::cerr << "Reading transcript counts from [" << sfTrascriptCountFile << "] . . .";
-    auto transcriptHash = CountDBNew::fromFile(sfTrascriptCountFile, sfIndexPtr);
-    std::cerr << "done\n";
-    */
-   
-    // the READ hash
-    std::cerr << "Reading read counts from [" << hashFile << "] . . .";
-    auto hash = CountDBNew::fromFile( hashFile, sfIndexPtr );
-    std::cerr << "done\n";
-    //const std::vector<string>& geneFiles{genesFile};
-    auto merLen = sfIndex.kmerLength();
-    
-    BiasIndex bidx = vm.count("bias") ? BiasIndex( vm["bias"].as<string>() ) : BiasIndex();
-
-    std::cerr << "Creating optimizer . . .";
-    CollapsedIterativeOptimizer<CountDBNew> solver(hash, tgm, bidx, numThreads);
-    // IterativeOptimizer<CountDBNew, CountDBNew> solver( hash, transcriptHash, tgm, bidx );
-    std::cerr << "done\n";
+      ia >> map;
+      std::cerr << "done reading the transcript <-> gene map\n";
+      return map;
+    });
 
-    if ( poisson ) {
-      std::cerr << "optimizing using Poisson model\n";
-      // for IterativeOptimizer
-      // solver.optimizePoisson( geneFiles, outputFile );
+    // the kmer length recorded in the index determines the kmer word type
+    std::stringstream commandLine;
+    for (size_t i : boost::irange(size_t(0), static_cast<size_t>(argc))) { commandLine << argv[i] << " "; }
+    if (readIndexKmerLength(sfIndexFile) <= sailfish::kmers::maxKmerLength<uint64_t>()) {
+      estimateAbundances<uint64_t>(vm, sfIndexFile, hashFile, tgm, numThreads, poisson,
+                                   klutfname, tlutfname, minMean, outputFilePath, commandLine.str());
     } else {
-      size_t numIter = vm["iterations"].as<size_t>();
-      std::cerr << "optimizing using iterative optimization [" << numIter << "] iterations";
-      // for CollapsedIterativeOptimizer (EM algorithm)
-
-      solver.optimize(klutfname, tlutfname, numIter, minMean );
-
-      std::stringstream headerLines;
-      headerLines << "# [sailfish version]\t" << Sailfish::version << "\n";
-      headerLines << "# [kmer length]\t" << sfIndex.kmerLength() << "\n";
-      headerLines << "# [using canonical kmers]\t" << (sfIndex.canonical() ? "true" : "false") << "\n";
-      headerLines << "# [command]\t";
-      for (size_t i : boost::irange(size_t(0), static_cast<size_t>(argc))) { headerLines << argv[i] << " "; }
-      headerLines << "\n";
+      estimateAbundances<sailfish::kmers::Kmer128>(vm, sfIndexFile, hashFile, tgm, numThreads, poisson,
+                                                   klutfname, tlutfname, minMean, outputFilePath, 
+                                                   commandLine.str());
+    }
 
-      solver.writeAbundances(outputFilePath, headerLines.str());
-      
-     
+    if ( !poisson ) {
       if (computeBiasCorrection) {
         sfIndexBasePath.remove_filename();
         outputFilePath.remove_filename();        
@@ -221,11 +277,6 @@ int runIterativeOptimizer(int argc, char* argv[] ) {
         std::cerr << "biasCorrectedFile = " << biasCorrectedFile << "\n";                
         performBiasCorrection(biasFeatPath, expressionFilePath, biasCorrectedFile, numThreads);
       }
-
-      // for LASSO Iterative Optimizer
-      //solver.optimizeNNLASSO(klutfname, tlutfname, outputFile, numIter, minMean );
-      // for IterativeOptimizer
-      // solver.optimize( geneFiles, outputFile, numIter, minMean );
     }
 
     
@@ -281,6 +332,7 @@ int mainIndex(int argc, char* argv[]);
 int mainCount(int argc, char* argv[]);
 int mainQuantify(int argc, char* argv[]);
 int mainBuildLUT(int argc, char* argv[] );
+int mainMergeCounts(int argc, char* argv[]);
 
 int main( int argc, char* argv[] ) {  
   using std::string;
@@ -333,6 +385,7 @@ int main( int argc, char* argv[] ) {
       {"buildlut", mainBuildLUT},
       {"quant", mainQuantify},
       {"count", mainCount},
+      {"merge-counts", mainMergeCounts},
       {"sf", mainSailfish}
     });
 
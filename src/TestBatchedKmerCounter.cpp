@@ -0,0 +1,163 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that BatchedKmerCounter counts a stream of kmers exactly as
+*  looking up and incrementing each kmer on its own would, whatever the
+*  count layout, however the stream is split into batches, and when many
+*  threads count into the same counts at once.
+**/
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "BatchedKmerCounter.hpp"
+#include "CountDBNew.hpp"
+#include "KmerMPHF.hpp"
+#include "PerfectHashIndex.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+using Index = PerfectHashIndexT<uint64_t>;
+using Counts = CountDBNewT<uint64_t>;
+using Counter = BatchedKmerCounterT<uint64_t>;
+
+const uint32_t MerSize = 20;
+
+// A hashed index over numKeys random 20-mers, which are also returned in keys
+std::shared_ptr<Index> makeIndex(size_t numKeys, std::vector<uint64_t>& keys) {
+  std::mt19937_64 gen(3);
+  Index::KmerVector kmers;
+  for (size_t i = 0; i < numKeys; ++i) { kmers.push_back(gen() & ((uint64_t(1) << (2 * MerSize)) - 1)); }
+  std::sort(kmers.begin(), kmers.end());
+  kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+  auto hash = KmerMPHF::build(kmers);
+  // the keys must be in the order of their ids
+  Index::KmerVector ordered(kmers.size());
+  for (auto k : kmers) { ordered[KmerMPHF::lookup(hash.data(), k)] = k; }
+  keys.assign(ordered.begin(), ordered.end());
+  return std::make_shared<Index>(ordered, hash, HashType::NATIVE, MerSize, false);
+}
+
+/**
+*  A stream of kmers in which key i occurs i % 4 times, mixed with kmers
+*  that aren't in the index (whose number is returned in numAbsent).
+**/
+std::vector<uint64_t> makeStream(const std::vector<uint64_t>& keys, size_t& numAbsent) {
+  std::mt19937_64 gen(5);
+  std::vector<uint64_t> stream;
+  numAbsent = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    for (size_t c = 0; c < i % 4; ++c) { stream.push_back(keys[i]); }
+    if (i % 3 == 0) {
+      // (the top bit is never set in a 20-mer, so this kmer can't be a key)
+      stream.push_back(keys[i] | (uint64_t(1) << 63));
+      ++numAbsent;
+    }
+  }
+  std::shuffle(stream.begin(), stream.end(), gen);
+  return stream;
+}
+
+void testCounter(std::shared_ptr<Index>& index, const std::vector<uint64_t>& keys) {
+  size_t numAbsent{0};
+  auto stream = makeStream(keys, numAbsent);
+
+  for (bool interleaved : {false, true}) {
+    for (uint32_t countBits : {32u, 8u}) {
+      // one kmer at a time, in pieces that don't line up with the batches,
+      // and by a number of threads at once
+      Counts one(index, interleaved, countBits);
+      Counter counter(*index, one);
+      for (size_t i = 0; i < stream.size(); ++i) { counter.push(stream[i]); }
+      counter.flush();
+      CHECK(counter.numUnmapped() == numAbsent);
+
+      Counts pieces(index, interleaved, countBits);
+      Counter pieceCounter(*index, pieces);
+      for (size_t i = 0; i < stream.size(); i += 37) {
+        pieceCounter.push(&stream[i], std::min(size_t(37), stream.size() - i));
+      }
+      pieceCounter.flush();
+      CHECK(pieceCounter.numUnmapped() == numAbsent);
+
+      const size_t numThreads = 4;
+      Counts shared(index, interleaved, countBits);
+      std::vector<uint64_t> unmapped(numThreads, 0);
+      std::vector<std::thread> threads;
+      for (size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() -> void {
+          Counter threadCounter(*index, shared);
+          for (size_t i = t; i < stream.size(); i += numThreads) { threadCounter.push(stream[i]); }
+          threadCounter.flush();
+          unmapped[t] = threadCounter.numUnmapped();
+        });
+      }
+      for (auto& thread : threads) { thread.join(); }
+      CHECK(unmapped[0] + unmapped[1] + unmapped[2] + unmapped[3] == numAbsent);
+
+      bool same{true};
+      for (size_t i = 0; i < keys.size(); ++i) {
+        size_t id = index->index(keys[i]);
+        uint32_t expected = i % 4;
+        same = same and one.atIndex(id) == expected and pieces.atIndex(id) == expected and 
+                        shared.atIndex(id) == expected;
+      }
+      CHECK(same);
+    }
+  }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    std::vector<uint64_t> keys;
+    auto index = makeIndex(50000, keys);
+    testCounter(index, keys);
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
@@ -0,0 +1,120 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that BlockedBloomFilter passes every key it was built over, and
+*  that it lets through no more of the other kmers than its width promises.
+**/
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "BlockedBloomFilter.hpp"
+#include "KmerWord.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+using sailfish::kmers::Kmer128;
+
+// n random keys, sorted
+template <typename Key>
+std::vector<Key> randomKeys(size_t n, uint64_t seed) {
+  std::mt19937_64 gen(seed);
+  std::vector<Key> keys;
+  for (size_t i = 0; i < n; ++i) {
+    Key k{0};
+    for (size_t w = 0; w < sizeof(Key) / sizeof(uint64_t); ++w) { k = ((k << 32) << 32) | Key(gen()); }
+    keys.push_back(k);
+  }
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+/**
+*  Build a filter of bitsPerKey bits / key over n keys, check that all of
+*  them pass it, and return the fraction of other keys that pass as well.
+**/
+template <typename Key>
+double falsePositiveRate(size_t n, uint32_t bitsPerKey) {
+  auto keys = randomKeys<Key>(n, n);
+  auto packed = BlockedBloomFilter::build(keys, bitsPerKey);
+  bool allPass{true};
+  for (auto k : keys) {
+    BlockedBloomFilter::prefetch(packed.data(), k);
+    allPass = allPass and BlockedBloomFilter::mayContain(packed.data(), k);
+  }
+  CHECK(allPass);
+
+  size_t numAbsent{0}, numPassed{0};
+  for (auto k : randomKeys<Key>(500000, n + 1)) {
+    if (!std::binary_search(keys.begin(), keys.end(), k)) {
+      ++numAbsent;
+      numPassed += BlockedBloomFilter::mayContain(packed.data(), k);
+    }
+  }
+  return static_cast<double>(numPassed) / numAbsent;
+}
+
+template <typename Key>
+void testFilters() {
+  // (an empty filter passes nothing)
+  CHECK(falsePositiveRate<Key>(0, 8) == 0.0);
+  falsePositiveRate<Key>(1, 8);
+  falsePositiveRate<Key>(100, 1);
+  // at 8 bits / key about 2.4% of other keys get through, at 10 about 1%
+  // and at 16 about 0.1%
+  CHECK(falsePositiveRate<Key>(200000, 8) < 0.03);
+  CHECK(falsePositiveRate<Key>(200000, 10) < 0.015);
+  CHECK(falsePositiveRate<Key>(200000, 16) < 0.003);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    testFilters<uint64_t>();
+    testFilters<Kmer128>();
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
@@ -0,0 +1,186 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that files in the compressed container format (see
+*  CompressedFile.hpp) read back as the files that were compressed.
+**/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "CompressedFile.hpp"
+#include "MappedFile.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+template <typename F>
+bool throws(F f) {
+  try { f(); } catch (std::exception&) { return true; }
+  return false;
+}
+
+using sailfish::compressed::Header;
+using sailfish::compressed::FrameInfo;
+
+// Contents that compress, but not to nothing
+std::vector<char> contents(size_t size) {
+  std::vector<char> data(size);
+  uint32_t seed{1};
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    data[i] = "ACGT"[(seed >> 16) & 3];
+  }
+  return data;
+}
+
+std::vector<char> readFile(const std::string& fname) {
+  std::vector<char> data;
+  FILE* in = fopen(fname.c_str(), "r");
+  char buffer[1 << 16];
+  size_t got;
+  while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) { data.insert(data.end(), buffer, buffer + got); }
+  fclose(in);
+  return data;
+}
+
+void writeFile(const std::string& fname, const std::vector<char>& data) {
+  FILE* out = fopen(fname.c_str(), "w");
+  fwrite(data.data(), 1, data.size(), out);
+  fclose(out);
+}
+
+void testRoundTrip(const std::string& fname) {
+  const uint64_t frameSize = Header::FrameSize;
+  for (uint64_t size : {uint64_t(0), uint64_t(1), frameSize, 2 * frameSize + 12345}) {
+    auto data = contents(size);
+    uint64_t containerSize = sailfish::compressed::compress(data.data(), data.size(), fname, 3);
+    CHECK(containerSize == readFile(fname).size());
+
+    sailfish::MappedFile mapped(fname);
+    CHECK(mapped.decompressed());
+    CHECK(mapped.size() == size);
+    CHECK(size == 0 or std::memcmp(mapped.base(), data.data(), size) == 0);
+
+    char prefix[100];
+    size_t numRead = sailfish::compressed::readPrefix(fname, prefix, sizeof(prefix));
+    CHECK(numRead == std::min(size, uint64_t(sizeof(prefix))));
+    CHECK(numRead == 0 or std::memcmp(prefix, data.data(), numRead) == 0);
+  }
+
+  // files that aren't compressed are mapped as they are
+  auto data = contents(1000);
+  writeFile(fname, data);
+  sailfish::MappedFile mapped(fname);
+  CHECK(!mapped.decompressed());
+  CHECK(mapped.size() == data.size() and std::memcmp(mapped.base(), data.data(), data.size()) == 0);
+}
+
+/**
+*  Containers whose frame tables are corrupt must be rejected rather than
+*  leave part of the decompressed file uninitialized (or read past the end
+*  of the container).
+**/
+void testCorrupt(const std::string& fname) {
+  auto data = contents(2 * Header::FrameSize + 12345);
+  sailfish::compressed::compress(data.data(), data.size(), fname, 2);
+  const auto container = readFile(fname);
+
+  auto rejects = [&](std::function<void(Header&, FrameInfo*)> corrupt) -> bool {
+    auto bytes = container;
+    corrupt(*reinterpret_cast<Header*>(bytes.data()), reinterpret_cast<FrameInfo*>(bytes.data() + sizeof(Header)));
+    writeFile(fname, bytes);
+    return throws([&]() { sailfish::MappedFile mapped(fname); }) and 
+           throws([&]() { sailfish::compressed::rawSize(bytes.data(), bytes.size()); });
+  };
+  // too few frames
+  CHECK(rejects([](Header& h, FrameInfo* frames) { --h.numFrames; }));
+  // a frame that isn't the last is short
+  CHECK(rejects([](Header& h, FrameInfo* frames) { --frames[0].rawSize; }));
+  CHECK(rejects([](Header& h, FrameInfo* frames) { ++frames[2].rawSize; }));
+  // the original file is claimed to be longer than the frames
+  CHECK(rejects([](Header& h, FrameInfo* frames) { h.rawSize += Header::FrameSize; }));
+  // a frame table that would overflow when its size is computed
+  CHECK(rejects([](Header& h, FrameInfo* frames) { h.numFrames = uint64_t(1) << 60; }));
+  // frames past the end of the container
+  CHECK(rejects([](Header& h, FrameInfo* frames) { frames[1].offset = uint64_t(1) << 40; }));
+  CHECK(rejects([](Header& h, FrameInfo* frames) { frames[1].compressedSize = ~uint64_t(0); }));
+  CHECK(rejects([](Header& h, FrameInfo* frames) { h.codec = 7; }));
+
+  // the first frame is all that readPrefix reads, so it must be checked too
+  auto bytes = container;
+  reinterpret_cast<FrameInfo*>(bytes.data() + sizeof(Header))[0].rawSize = uint64_t(1) << 40;
+  writeFile(fname, bytes);
+  char prefix[100];
+  CHECK(throws([&]() { sailfish::compressed::readPrefix(fname, prefix, sizeof(prefix)); }));
+  bytes = container;
+  reinterpret_cast<FrameInfo*>(bytes.data() + sizeof(Header))[0].compressedSize = bytes.size();
+  writeFile(fname, bytes);
+  CHECK(throws([&]() { sailfish::compressed::readPrefix(fname, prefix, sizeof(prefix)); }));
+
+  // a container too short to hold its header
+  CHECK(throws([&]() { sailfish::compressed::rawSize(container.data(), sizeof(Header) - 1); }));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  char dir[] = "/tmp/sailfishTestXXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::cerr << "could not make a temporary directory\n";
+    return 1;
+  }
+  std::string fname = std::string(dir) + "/container.sfz";
+  try {
+    testRoundTrip(fname);
+    testCorrupt(fname);
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  std::remove(fname.c_str());
+  rmdir(dir);
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
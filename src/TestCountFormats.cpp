@@ -0,0 +1,163 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that the counts written by CountDBNew read back unchanged in each
+*  of the count file formats (see SFCHeader): plain 32-bit counts, compact
+*  8 and 16-bit cells with their overflow, and the sparse encodings of each.
+**/
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "CountDBNew.hpp"
+#include "PerfectHashIndex.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+template <typename F>
+bool throws(F f) {
+  try { f(); } catch (std::exception&) { return true; }
+  return false;
+}
+
+using Index = PerfectHashIndexT<uint64_t>;
+using Counts = CountDBNewT<uint64_t>;
+
+/**
+*  The count of the kmer with id i.  Most counts are small, some are zero,
+*  and a few overflow 8 and 16-bit cells; there are enough nonzero counts
+*  to fill more than one block of a sparse file.
+**/
+uint32_t countOf(size_t i) {
+  if (i % 5 == 0) { return 0; }
+  if (i % 997 == 1) { return 70000 + i; }
+  if (i % 101 == 2) { return 300 + i % 1000; }
+  return i % 7 + 1;
+}
+
+std::shared_ptr<Index> makeIndex() {
+  // every third 9-mer
+  const uint32_t merSize = 9;
+  Index::KmerVector kmers;
+  for (uint64_t k = 0; k < (uint64_t(1) << (2 * merSize)); k += 3) { kmers.push_back(k); }
+  return std::make_shared<Index>(Index::denseIndex(kmers, merSize, false));
+}
+
+uint64_t fileSize(const std::string& fname) {
+  FILE* in = fopen(fname.c_str(), "r");
+  fseek(in, 0, SEEK_END);
+  uint64_t size = ftell(in);
+  fclose(in);
+  return size;
+}
+
+void truncate(const std::string& fname, uint64_t size) {
+  if (::truncate(fname.c_str(), size) != 0) { throw std::runtime_error("could not truncate " + fname); }
+}
+
+void testRoundTrip(std::shared_ptr<Index>& index, const std::string& fname) {
+  size_t numKeys = index->numKeys();
+  for (uint32_t countBits : {32u, 16u, 8u}) {
+    for (bool sparse : {false, true}) {
+      Counts counts(index, false, countBits);
+      for (size_t i = 0; i < numKeys; ++i) {
+        if (countOf(i) > 0) { counts.incAtIndex(i, countOf(i)); }
+      }
+      counts.appendLength(100, 3);
+      CHECK(counts.dumpCountsToFile(fname, sparse));
+      if (countBits == 32 and !sparse) {
+        // the original format: the lengths and then a uint32_t per kmer
+        CHECK(fileSize(fname) == 2 * sizeof(uint64_t) + sizeof(uint32_t) * numKeys);
+      }
+
+      for (uint32_t numThreads : {1u, 4u}) {
+        auto loaded = Counts::fromFile(fname, index, numThreads);
+        CHECK(loaded.countBits() == countBits);
+        CHECK(loaded.totalLength() == 100 and loaded.numLengths() == 3);
+        bool same{true};
+        for (size_t i = 0; i < numKeys; ++i) { same = same and loaded.atIndex(i) == countOf(i); }
+        CHECK(same);
+        // the nonzero counts of a sparse file are listed as they're read
+        size_t numNonzero{0};
+        bool nonzero{true};
+        loaded.forEachNonzero([&](size_t i) -> void { ++numNonzero; nonzero = nonzero and countOf(i) > 0; });
+        CHECK(nonzero);
+        CHECK(sparse or numNonzero > 0);
+      }
+
+      // a truncated file is an error, not a source of zeros
+      truncate(fname, fileSize(fname) - 1);
+      CHECK(throws([&]() { Counts::fromFile(fname, index); }));
+    }
+  }
+
+  // counts for a different index
+  Counts counts(index, false, 16);
+  CHECK(counts.dumpCountsToFile(fname, true));
+  Index::KmerVector kmers{1, 2, 3};
+  auto other = std::make_shared<Index>(Index::denseIndex(kmers, 9, false));
+  CHECK(throws([&]() { Counts::fromFile(fname, other); }));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  char dir[] = "/tmp/sailfishTestXXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::cerr << "could not make a temporary directory\n";
+    return 1;
+  }
+  std::string fname = std::string(dir) + "/reads.sfc";
+  try {
+    auto index = makeIndex();
+    testRoundTrip(index, fname);
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  std::remove(fname.c_str());
+  rmdir(dir);
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
@@ -0,0 +1,131 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that EliasFano gives each key of a sorted set its rank in the
+*  set, and reports every other key as NotFound, for sets that are sparse,
+*  dense, clustered and at the ends of the 64-bit range.
+**/
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "EliasFano.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+const uint64_t MaxKey = std::numeric_limits<uint64_t>::max();
+
+// Is key one of the (sorted) keys?
+bool isKey(const std::vector<uint64_t>& keys, uint64_t key) {
+  return std::binary_search(keys.begin(), keys.end(), key);
+}
+
+/**
+*  Encode keys (which are made sorted and distinct) and check the rank of
+*  each of them, of their neighbours and of numRandom random values.
+**/
+void testRanks(std::vector<uint64_t> keys, size_t numRandom = 1000) {
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  auto packed = EliasFano::build(keys);
+
+  bool ranked{true};
+  for (size_t i = 0; i < keys.size(); ++i) { ranked = ranked and EliasFano::rank(packed.data(), keys[i]) == i; }
+  CHECK(ranked);
+
+  std::vector<uint64_t> others{0, 1, MaxKey - 1, MaxKey};
+  for (auto k : keys) {
+    others.push_back(k - 1);
+    others.push_back(k + 1);
+  }
+  std::mt19937_64 gen(keys.size());
+  for (size_t i = 0; i < numRandom; ++i) {
+    others.push_back(gen());
+    // (and values within the range of the keys)
+    if (!keys.empty() and keys.back() < MaxKey) { others.push_back(gen() % (keys.back() + 1)); }
+  }
+  bool notFound{true};
+  for (auto k : others) {
+    if (!isKey(keys, k)) { notFound = notFound and EliasFano::rank(packed.data(), k) == EliasFano::NotFound; }
+  }
+  CHECK(notFound);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    std::mt19937_64 gen(1);
+    // no keys, and a single key at either end of the range
+    testRanks({});
+    testRanks({0});
+    testRanks({MaxKey});
+    testRanks({0, MaxKey});
+    // every value in a range, so that no low bits are stored
+    {
+      std::vector<uint64_t> keys;
+      for (uint64_t k = 0; k < 5000; ++k) { keys.push_back(k); }
+      testRanks(keys);
+    }
+    // sparse random 64-bit keys and random 20-mers
+    for (uint64_t mask : {MaxKey, (uint64_t(1) << 40) - 1}) {
+      std::vector<uint64_t> keys(100000);
+      for (auto& k : keys) { k = gen() & mask; }
+      testRanks(keys);
+    }
+    // runs of keys that share a high part, separated by gaps that span many
+    // samples of the upper bits
+    {
+      std::vector<uint64_t> keys;
+      for (uint64_t run = 0; run < 50; ++run) {
+        uint64_t start = gen() >> 8;
+        for (uint64_t k = 0; k < 1000; ++k) { keys.push_back(start + k); }
+      }
+      testRanks(keys);
+    }
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
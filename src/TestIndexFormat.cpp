@@ -0,0 +1,292 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that indices in the mappable format (see SFIHeader) load as they
+*  were written, and that a truncated or corrupt index is rejected when it
+*  is loaded rather than read past the end of its mapping, and that an
+*  index of key fingerprints finds its keys and admits other kmers at about
+*  the rate its fingerprint width implies.
+**/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "PerfectHashIndex.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+template <typename F>
+bool throws(F f) {
+  try { f(); } catch (std::exception&) { return true; }
+  return false;
+}
+
+using Index = PerfectHashIndexT<uint64_t>;
+
+const uint32_t MerSize = 20;
+
+// Distinct random kmers
+Index::KmerVector randomKmers(size_t n, uint32_t merSize = MerSize) {
+  std::mt19937_64 gen(1);
+  std::vector<uint64_t> kmers(n);
+  for (auto& k : kmers) { k = gen() & ((uint64_t(1) << (2 * merSize)) - 1); }
+  std::sort(kmers.begin(), kmers.end());
+  kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+  std::shuffle(kmers.begin(), kmers.end(), gen);
+  return Index::KmerVector(kmers.begin(), kmers.end());
+}
+
+std::vector<char> readFile(const std::string& fname) {
+  std::vector<char> data;
+  FILE* in = fopen(fname.c_str(), "r");
+  char buffer[1 << 16];
+  size_t got;
+  while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) { data.insert(data.end(), buffer, buffer + got); }
+  fclose(in);
+  return data;
+}
+
+void writeFile(const std::string& fname, const std::vector<char>& data) {
+  FILE* out = fopen(fname.c_str(), "w");
+  fwrite(data.data(), 1, data.size(), out);
+  fclose(out);
+}
+
+// Every kmer of keys has its own id in index, and the kmers after them don't
+bool looksUp(Index& index, const Index::KmerVector& keys, size_t numAbsent) {
+  std::vector<bool> seen(keys.size());
+  for (auto k : keys) {
+    size_t id = index.index(k);
+    if (id >= keys.size() or seen[id]) { return false; }
+    seen[id] = true;
+  }
+  std::vector<size_t> ids(keys.size());
+  index.index(keys.data(), keys.size(), ids.data());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (ids[i] != index.index(keys[i])) { return false; }
+  }
+  auto absent = randomKmers(keys.size() + numAbsent, index.kmerLength());
+  size_t numFound{0};
+  for (size_t i = keys.size(); i < absent.size(); ++i) {
+    if (std::find(keys.begin(), keys.end(), absent[i]) == keys.end()) { numFound += (index.index(absent[i]) != index.INVALID); }
+  }
+  return numFound == 0;
+}
+
+void testCorruptions(const std::string& fname, 
+                     const std::vector<std::function<void(SFIHeader&)>>& corruptions);
+
+/**
+*  Write index to fname, and check that it reads back with the same
+*  lookups, and that each way of corrupting its header is caught.
+**/
+void testIndex(Index index, const Index::KmerVector& keys, const std::string& fname,
+               const std::vector<std::function<void(SFIHeader&)>>& corruptions) {
+  index.dumpToFile(fname);
+  {
+    auto loaded = Index::fromFile(fname);
+    CHECK(loaded.numKeys() == keys.size());
+    CHECK(loaded.hashType() == index.hashType());
+    CHECK(loaded.hasFilter() == index.hasFilter());
+    CHECK(looksUp(loaded, keys, 1000));
+    loaded.copyFromMapping();
+    CHECK(looksUp(loaded, keys, 1000));
+  }
+  testCorruptions(fname, corruptions);
+}
+
+// Check that the index in fname is rejected when cut short or corrupted
+void testCorruptions(const std::string& fname, 
+                     const std::vector<std::function<void(SFIHeader&)>>& corruptions) {
+  const auto file = readFile(fname);
+  // a file cut off anywhere after the header
+  for (size_t size : {size_t(SFIHeader::Alignment + 8), file.size() / 2, file.size() - 1}) {
+    writeFile(fname, std::vector<char>(file.begin(), file.begin() + size));
+    CHECK(throws([&]() { Index::fromFile(fname); }));
+  }
+  for (auto& corrupt : corruptions) {
+    auto bytes = file;
+    corrupt(*reinterpret_cast<SFIHeader*>(bytes.data()));
+    writeFile(fname, bytes);
+    CHECK(throws([&]() { Index::fromFile(fname); }));
+  }
+}
+
+/**
+*  Check that the index of fingerprints in fname finds the keys (in the
+*  order of their ids), and lets through other kmers at a rate of about
+*  2^-bits.
+**/
+void testFingerprints(const std::string& fname, Index::KmerVector inOrder, uint32_t bits) {
+  auto loaded = Index::fromFile(fname);
+  CHECK(loaded.fingerprintBits() == bits);
+  bool found{true};
+  for (size_t i = 0; i < inOrder.size(); ++i) { found = found and loaded.index(inOrder[i]) == i; }
+  CHECK(found);
+  auto absent = randomKmers(inOrder.size() + 400000);
+  std::sort(inOrder.begin(), inOrder.end());
+  size_t numAbsent{0}, numFound{0};
+  for (size_t i = inOrder.size(); i < absent.size(); ++i) {
+    if (!std::binary_search(inOrder.begin(), inOrder.end(), absent[i])) {
+      ++numAbsent;
+      numFound += (loaded.index(absent[i]) != loaded.INVALID);
+    }
+  }
+  double expected = numAbsent * std::ldexp(1.0, -static_cast<int>(bits));
+  CHECK(numFound <= 2 * expected + 10);
+  CHECK(bits != 8 or numFound >= expected / 2);
+}
+
+void testIndices(const std::string& fname) {
+  auto keys = randomKmers(20000);
+  const uint64_t huge = uint64_t(1) << 62;
+  std::vector<std::function<void(SFIHeader&)>> common{
+    [=](SFIHeader& h) { h.hashOffset = huge; },
+    [=](SFIHeader& h) { h.hashSize = huge; },
+    [=](SFIHeader& h) { h.hashType = 9; },
+  };
+  auto withFilter = common;
+  withFilter.push_back([=](SFIHeader& h) { h.filterOffset = huge; });
+  withFilter.push_back([=](SFIHeader& h) { h.filterSize = huge; });
+  withFilter.push_back([=](SFIHeader& h) { h.filterSize = 8; });
+
+  // a native hash over the full keys, with a filter
+  {
+    auto keyed = withFilter;
+    keyed.push_back([=](SFIHeader& h) { h.numKeys = huge; });
+    keyed.push_back([=](SFIHeader& h) { h.keysOffset = huge; });
+    keyed.push_back([=](SFIHeader& h) { h.fingerprintBits = 12; });
+    Index::KmerVector kmers(keys);
+    auto hash = KmerMPHF::build(kmers);
+    auto filter = BlockedBloomFilter::build(kmers, 8);
+    // the keys must be in the order of their ids
+    Index::KmerVector ordered(kmers.size());
+    for (auto k : kmers) { ordered[KmerMPHF::lookup(hash.data(), k)] = k; }
+    Index index(ordered, hash, HashType::NATIVE, MerSize, false);
+    index.setFilter(filter);
+    Index::KmerVector inOrder(index.kmers(), index.kmers() + index.numKeys());
+    testIndex(std::move(index), inOrder, fname, keyed);
+  }
+
+  // a native hash that stores only fingerprints of its keys
+  for (uint32_t bits : {8, 16, 32}) {
+    Index::KmerVector kmers(keys);
+    auto hash = KmerMPHF::build(kmers);
+    Index::KmerVector ordered(kmers.size());
+    for (auto k : kmers) { ordered[KmerMPHF::lookup(hash.data(), k)] = k; }
+    Index::KmerVector inOrder(ordered);
+    Index index(ordered, hash, HashType::NATIVE, MerSize, false, bits);
+    CHECK(index.fingerprintBits() == bits);
+    bool stored{true};
+    for (size_t i = 0; i < inOrder.size(); ++i) {
+      stored = stored and index.storedFingerprint(i) == 
+                          static_cast<uint32_t>(Index::fingerprint(inOrder[i]) & ((uint64_t(1) << bits) - 1));
+    }
+    CHECK(stored);
+    index.dumpToFile(fname);
+    testFingerprints(fname, inOrder, bits);
+    auto fingerprinted = common;
+    fingerprinted.push_back([=](SFIHeader& h) { h.numKeys = huge; });
+    fingerprinted.push_back([=](SFIHeader& h) { h.fingerprintBits = 24; });
+    testCorruptions(fname, fingerprinted);
+  }
+
+  // a succinct (keyless) index, with a filter
+  {
+    Index::KmerVector kmers(keys);
+    auto filter = BlockedBloomFilter::build(kmers, 8);
+    auto index = Index::eliasFanoIndex(kmers, MerSize, false);
+    index.setFilter(filter);
+    testIndex(std::move(index), keys, fname, withFilter);
+  }
+
+  // a dense table, which must have an entry for every kmer
+  {
+    const uint32_t merSize = 9;
+    Index::KmerVector kmers;
+    for (uint64_t k = 0; k < (uint64_t(1) << (2 * merSize)); k += 7) { kmers.push_back(k); }
+    Index::KmerVector shortKeys(kmers);
+    auto dense = common;
+    dense.push_back([](SFIHeader& h) { h.hashSize /= 2; });
+    dense.push_back([](SFIHeader& h) { h.merSize = 8; });
+    auto index = Index::denseIndex(kmers, merSize, false);
+    index.dumpToFile(fname);
+    auto loaded = Index::fromFile(fname);
+    bool same{true};
+    for (size_t i = 0; i < shortKeys.size(); ++i) { same = same and loaded.index(shortKeys[i]) == i; }
+    CHECK(same);
+    CHECK(loaded.index(uint64_t(1)) == loaded.INVALID);
+    testIndex(std::move(index), shortKeys, fname, dense);
+  }
+
+  // a dense table is only chosen when it isn't much larger than the keys
+  CHECK(Index::denseFits(9, 1));
+  CHECK(!Index::denseFits(14, 1000));
+  CHECK(Index::denseFits(14, size_t(1) << 25));
+  CHECK(!Index::denseFits(Index::DenseMaxK + 1, size_t(1) << 40));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  char dir[] = "/tmp/sailfishTestXXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::cerr << "could not make a temporary directory\n";
+    return 1;
+  }
+  std::string fname = std::string(dir) + "/transcriptome.sfi";
+  try {
+    testIndices(fname);
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  std::remove(fname.c_str());
+  rmdir(dir);
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
@@ -0,0 +1,137 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that KmerMPHF maps the keys it was built over one-to-one onto
+*  [0, # keys), for 64 and 128-bit kmers, including the keys that no level
+*  could place and that are stored explicitly.
+**/
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "KmerMPHF.hpp"
+#include "KmerWord.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+using sailfish::kmers::Kmer128;
+
+// n distinct random keys
+template <typename Key>
+std::vector<Key> randomKeys(size_t n, uint64_t seed) {
+  std::mt19937_64 gen(seed);
+  std::vector<Key> keys;
+  for (size_t i = 0; i < n; ++i) {
+    Key k{0};
+    for (size_t w = 0; w < sizeof(Key) / sizeof(uint64_t); ++w) { k = ((k << 32) << 32) | Key(gen()); }
+    keys.push_back(k);
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  std::shuffle(keys.begin(), keys.end(), gen);
+  return keys;
+}
+
+KmerMPHF::Header headerOf(const std::vector<char>& packed) {
+  KmerMPHF::Header header;
+  std::memcpy(&header, packed.data(), sizeof(header));
+  return header;
+}
+
+/**
+*  Build the function over n keys (with the given gamma) and check that it
+*  is a bijection onto [0, n); returns the number of keys it had to store
+*  explicitly.
+**/
+template <typename Key>
+uint64_t testKeys(size_t n, double gamma) {
+  auto keys = randomKeys<Key>(n, n + 1);
+  auto packed = KmerMPHF::build(keys, gamma);
+  auto header = headerOf(packed);
+  CHECK(header.numKeys == keys.size());
+
+  std::vector<bool> seen(keys.size(), false);
+  bool inRange{true}, distinct{true};
+  for (auto k : keys) {
+    uint64_t id = KmerMPHF::lookup(packed.data(), k);
+    inRange = inRange and id < keys.size();
+    if (id < keys.size()) {
+      distinct = distinct and !seen[id];
+      seen[id] = true;
+    }
+  }
+  CHECK(inRange);
+  CHECK(distinct);
+
+  // other keys get an arbitrary id, but still one that can index the keys
+  if (!keys.empty()) {
+    bool absentInRange{true};
+    for (auto k : randomKeys<Key>(1000, n + 2)) {
+      absentInRange = absentInRange and KmerMPHF::lookup(packed.data(), k) < keys.size();
+    }
+    CHECK(absentInRange);
+  }
+  return header.numFallback;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    for (size_t n : {size_t(0), size_t(1), size_t(2), size_t(1000), size_t(300000)}) {
+      testKeys<uint64_t>(n, 2.0);
+      testKeys<Kmer128>(n, 2.0);
+    }
+    // the function should take a few bits / key at the default gamma
+    auto keys = randomKeys<uint64_t>(300000, 9);
+    CHECK(8.0 * KmerMPHF::build(keys).size() / keys.size() < 6.0);
+    // with far too few bits per level, most keys are never placed and
+    // must be found among the explicitly stored ones
+    CHECK(testKeys<uint64_t>(5000, 0.01) > 0);
+    CHECK(testKeys<Kmer128>(5000, 0.01) > 0);
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
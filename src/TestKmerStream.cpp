@@ -0,0 +1,280 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks the (vectorized) read encoder and the kmer builders of
+*  KmerStream against a plain, base-by-base reading of the same sequence,
+*  with and without the masking of low quality bases.
+**/
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "KmerStream.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+using namespace sailfish::kmers;
+
+// The code of a single character, as the encoder should produce it
+uint8_t codeOf(char c) {
+  switch (c) {
+    case 'A': case 'a': return CODE_A;
+    case 'C': case 'c': return CODE_C;
+    case 'G': case 'g': return CODE_G;
+    case 'T': case 't': return CODE_T;
+    case '\n': case '\r': return CODE_IGNORE;
+    default: return CODE_RESET;
+  }
+}
+
+// The codes of seq, with the ignored characters left out
+std::vector<uint8_t> expectedCodes(const std::string& seq) {
+  std::vector<uint8_t> codes;
+  for (char c : seq) {
+    if (codeOf(c) != CODE_IGNORE) { codes.push_back(codeOf(c)); }
+  }
+  return codes;
+}
+
+std::vector<uint8_t> encode(const std::string& seq) {
+  std::vector<uint8_t> codes(seq.size() + 1);
+  codes.resize(encodeRead(seq.data(), seq.size(), codes.data()));
+  return codes;
+}
+
+/**
+*  A random read of len characters: mostly bases (of either case), with
+*  some 'N's, line breaks and other bytes (including ones with the high bit
+*  set, which a signed comparison could mistake for something else).
+**/
+std::string randomRead(size_t len, std::mt19937& gen) {
+  const std::string alphabet = "ACGTACGTACGTacgtNn\n\r.-\x80\xC1\xFF";
+  std::string read;
+  for (size_t i = 0; i < len; ++i) { read += alphabet[gen() % alphabet.size()]; }
+  return read;
+}
+
+// The kmers of codes, window by window, as (forward, reverse complement) pairs
+template <typename KmerT>
+std::vector<std::pair<KmerT, KmerT>> expectedKmers(const std::vector<uint8_t>& codes, uint32_t k) {
+  std::vector<std::pair<KmerT, KmerT>> kmers;
+  for (size_t i = 0; i + k <= codes.size(); ++i) {
+    KmerT fwd{0}, rev{0};
+    bool valid{true};
+    for (size_t j = 0; j < k; ++j) {
+      uint8_t c = codes[i + j];
+      valid = valid and c < CODE_RESET;
+      fwd = (fwd << 2) | KmerT(c & 0x3);
+      rev = rev | (KmerT(0x3 - (c & 0x3)) << (2 * j));
+    }
+    if (valid) { kmers.emplace_back(fwd, rev); }
+  }
+  return kmers;
+}
+
+void testEncoding() {
+  std::mt19937 gen(7);
+  // every length up to a few vectors, so each vector width and its tail is covered
+  bool same{true};
+  for (size_t len = 0; len < 200; ++len) {
+    for (size_t rep = 0; rep < 20; ++rep) {
+      auto read = randomRead(len, gen);
+      same = same and encode(read) == expectedCodes(read);
+    }
+  }
+  CHECK(same);
+  CHECK(encode("ACGTacgt") == (std::vector<uint8_t>{0, 1, 2, 3, 0, 1, 2, 3}));
+  CHECK(encode("AC\nG\r\nT") == (std::vector<uint8_t>{0, 1, 2, 3}));
+  CHECK(encode("ANT") == (std::vector<uint8_t>{0, CODE_RESET, 3}));
+}
+
+// The expected codes of a read of bases, with those below minQual reset
+std::vector<uint8_t> maskedCodes(const std::string& seq, const std::string& qual, char minQual) {
+  auto codes = expectedCodes(seq);
+  for (size_t i = 0; i < codes.size(); ++i) { codes[i] = (qual[i] < minQual) ? CODE_RESET : codes[i]; }
+  return codes;
+}
+
+// A random read of bases (and a few 'N's), and a quality string for it
+std::pair<std::string, std::string> randomQualityRead(size_t len, std::mt19937& gen) {
+  std::string read, qual;
+  for (size_t i = 0; i < len; ++i) {
+    read += "ACGTACGTACGTN"[gen() % 13];
+    // qualities from '!' (0) to 'J' (41), mostly high
+    qual += static_cast<char>((gen() % 4 == 0) ? '!' + gen() % 42 : 'F' + gen() % 5);
+  }
+  return {read, qual};
+}
+
+void testMasking() {
+  std::mt19937 gen(13);
+  bool same{true};
+  for (size_t len = 0; len < 200; ++len) {
+    for (char minQual : {'!', '+', '5', 'J', 'K'}) {
+      auto read = randomQualityRead(len, gen);
+      std::vector<uint8_t> codes(len + 1);
+      codes.resize(encodeRead(read.first.data(), len, codes.data(), read.second.data(), minQual));
+      same = same and codes == maskedCodes(read.first, read.second, minQual);
+    }
+  }
+  CHECK(same);
+
+  // kmers that span a base below the minimum quality (here, 20) are dropped,
+  // but only if the read comes with its qualities and masking is on
+  std::string read = "ACGTACGT", qual = "IIII#III";
+  KmerStreamT<uint64_t> masked(3, 20), unmasked(3);
+  masked.directional(read.data(), read.data() + read.size(), qual.data());
+  CHECK(masked.numKmers() == 3);
+  CHECK(masked.fwd()[0] == 0x6 and masked.fwd()[1] == 0x1B and masked.fwd()[2] == 0x1B);
+  masked.directional(read.data(), read.data() + read.size());
+  CHECK(masked.numKmers() == 6);
+  unmasked.directional(read.data(), read.data() + read.size(), qual.data());
+  CHECK(unmasked.numKmers() == 6);
+  // (a base of exactly the minimum quality is kept)
+  qual = "IIII5III";
+  masked.directional(read.data(), read.data() + read.size(), qual.data());
+  CHECK(masked.numKmers() == 6);
+
+  // and for every builder, against the masked codes
+  for (uint32_t k : {1u, 5u, 20u, 31u}) {
+    KmerStreamT<uint64_t> mers(k, 20);
+    bool directional{true}, canonical{true}, stranded{true};
+    for (size_t rep = 0; rep < 200; ++rep) {
+      auto read = randomQualityRead(gen() % 200, gen);
+      auto expected = expectedKmers<uint64_t>(maskedCodes(read.first, read.second, 33 + 20), k);
+      const char* s = read.first.data();
+      const char* e = s + read.first.size();
+      const char* q = read.second.data();
+
+      mers.directional(s, e, q);
+      bool ok = (mers.numKmers() == expected.size());
+      for (size_t i = 0; ok and i < expected.size(); ++i) {
+        ok = mers.fwd()[i] == expected[i].first and mers.rev()[i] == expected[i].second;
+      }
+      directional = directional and ok;
+
+      mers.canonical(s, e, q);
+      ok = (mers.numKmers() == expected.size());
+      for (size_t i = 0; ok and i < expected.size(); ++i) {
+        ok = mers.fwd()[i] == std::min(expected[i].first, expected[i].second);
+      }
+      canonical = canonical and ok;
+
+      mers.stranded(s, e, true, q);
+      ok = (mers.numKmers() == expected.size());
+      for (size_t i = 0; ok and i < expected.size(); ++i) { ok = mers.fwd()[i] == expected[i].second; }
+      stranded = stranded and ok;
+    }
+    CHECK(directional);
+    CHECK(canonical);
+    CHECK(stranded);
+  }
+}
+
+template <typename KmerT>
+void testKmers(uint32_t k) {
+  std::mt19937 gen(11 + k);
+  bool directional{true}, canonical{true}, forward{true}, reverse{true};
+  KmerStreamT<KmerT> mers(k);
+  for (size_t rep = 0; rep < 300; ++rep) {
+    auto read = randomRead(gen() % 300, gen);
+    // (mostly bases, so that there are long runs of valid kmers)
+    for (auto& c : read) { if (gen() % 4 != 0) { c = "ACGT"[gen() % 4]; } }
+    auto expected = expectedKmers<KmerT>(expectedCodes(read), k);
+    const char* s = read.data();
+    const char* e = s + read.size();
+
+    mers.directional(s, e);
+    bool ok = (mers.numKmers() == expected.size());
+    for (size_t i = 0; ok and i < expected.size(); ++i) {
+      ok = mers.fwd()[i] == expected[i].first and mers.rev()[i] == expected[i].second;
+    }
+    directional = directional and ok;
+
+    mers.canonical(s, e);
+    ok = (mers.numKmers() == expected.size());
+    for (size_t i = 0; ok and i < expected.size(); ++i) {
+      ok = mers.fwd()[i] == std::min(expected[i].first, expected[i].second);
+    }
+    canonical = canonical and ok;
+
+    mers.stranded(s, e, false);
+    ok = (mers.numKmers() == expected.size());
+    for (size_t i = 0; ok and i < expected.size(); ++i) { ok = mers.fwd()[i] == expected[i].first; }
+    forward = forward and ok;
+
+    mers.stranded(s, e, true);
+    ok = (mers.numKmers() == expected.size());
+    for (size_t i = 0; ok and i < expected.size(); ++i) { ok = mers.fwd()[i] == expected[i].second; }
+    reverse = reverse and ok;
+  }
+  CHECK(directional);
+  CHECK(canonical);
+  CHECK(forward);
+  CHECK(reverse);
+
+  // reads with no kmers at all
+  KmerStreamT<KmerT> fresh(k);
+  std::string shortRead(k - 1, 'A');
+  fresh.canonical(shortRead.data(), shortRead.data());
+  CHECK(fresh.numKmers() == 0);
+  fresh.directional(shortRead.data(), shortRead.data() + shortRead.size());
+  CHECK(fresh.numKmers() == 0);
+  fresh.stranded(shortRead.data(), shortRead.data() + shortRead.size(), true);
+  CHECK(fresh.numKmers() == 0);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    testEncoding();
+    testMasking();
+    for (uint32_t k : {1u, 5u, 20u, 31u, 32u}) { testKmers<uint64_t>(k); }
+    for (uint32_t k : {33u, 50u, 64u}) { testKmers<Kmer128>(k); }
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
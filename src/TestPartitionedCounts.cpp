@@ -0,0 +1,159 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that counting through PartitionedCounts (each thread routing ids
+*  to the owner of their partition) gives the same counts as incrementing
+*  them in place.
+**/
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "BatchedKmerCounter.hpp"
+#include "CountDBNew.hpp"
+#include "PartitionedCounts.hpp"
+#include "PerfectHashIndex.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+using Index = PerfectHashIndexT<uint64_t>;
+using Counts = CountDBNewT<uint64_t>;
+using Partitioned = PartitionedCountsT<uint64_t>;
+
+const uint32_t MerSize = 9;
+
+// A dense index over every other 9-mer
+std::shared_ptr<Index> makeIndex() {
+  Index::KmerVector kmers;
+  for (uint64_t k = 0; k < (uint64_t(1) << (2 * MerSize)); k += 2) { kmers.push_back(k); }
+  return std::make_shared<Index>(Index::denseIndex(kmers, MerSize, false));
+}
+
+/**
+*  Count ids with numThreads threads, each routing its share of them
+*  through a Writer (so each thread owns one partition), and check the
+*  counts against a plain tally.
+**/
+void testIds(std::shared_ptr<Index>& index, uint32_t numThreads, uint32_t countBits) {
+  std::mt19937_64 gen(numThreads);
+  std::vector<size_t> ids(200000);
+  std::vector<uint32_t> expected(index->numKeys(), 0);
+  for (auto& id : ids) {
+    // skewed towards the low ids, so a few counters are hit very often
+    id = (gen() % 4 == 0) ? gen() % 16 : gen() % index->numKeys();
+    if (gen() % 10 == 0) { id = index->INVALID; } else { ++expected[id]; }
+  }
+
+  Counts counts(index, false, countBits);
+  Partitioned partitioned(counts, numThreads);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < numThreads; ++t) {
+    threads.emplace_back([&, t]() -> void {
+      Partitioned::Writer writer(partitioned, t);
+      // each thread takes its own slice of the ids, and adds it in pieces of
+      // a different size (so the buffers fill at different times)
+      size_t begin = ids.size() * t / numThreads, end = ids.size() * (t + 1) / numThreads;
+      size_t piece = 1 + 17 * t;
+      for (size_t i = begin; i < end; i += piece) { writer.add(&ids[i], std::min(piece, end - i)); }
+      writer.finish();
+    });
+  }
+  for (auto& thread : threads) { thread.join(); }
+
+  bool same{true};
+  for (size_t i = 0; i < expected.size(); ++i) { same = same and counts.atIndex(i) == expected[i]; }
+  CHECK(same);
+}
+
+// The same, with the ids found by BatchedKmerCounters writing to the partitions
+void testCounter(std::shared_ptr<Index>& index, uint32_t numThreads) {
+  std::mt19937_64 gen(numThreads + 100);
+  std::vector<uint64_t> kmers(100000);
+  // (odd kmers aren't in the index)
+  for (auto& k : kmers) { k = gen() % (uint64_t(1) << (2 * MerSize)); }
+
+  Counts counts(index);
+  Partitioned partitioned(counts, numThreads);
+  std::vector<uint64_t> unmapped(numThreads, 0);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < numThreads; ++t) {
+    threads.emplace_back([&, t]() -> void {
+      Partitioned::Writer writer(partitioned, t);
+      BatchedKmerCounterT<uint64_t> counter(*index, counts, &writer);
+      for (size_t i = t; i < kmers.size(); i += numThreads) { counter.push(kmers[i]); }
+      counter.flush();
+      writer.finish();
+      unmapped[t] = counter.numUnmapped();
+    });
+  }
+  for (auto& thread : threads) { thread.join(); }
+
+  std::vector<uint32_t> expected(index->numKeys(), 0);
+  uint64_t numOdd{0};
+  for (auto k : kmers) {
+    if (k % 2 == 1) { ++numOdd; } else { ++expected[k / 2]; }
+  }
+  uint64_t numUnmapped{0};
+  for (auto u : unmapped) { numUnmapped += u; }
+  CHECK(numUnmapped == numOdd);
+  bool same{true};
+  for (size_t i = 0; i < expected.size(); ++i) { same = same and counts.atIndex(i) == expected[i]; }
+  CHECK(same);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    auto index = makeIndex();
+    for (uint32_t numThreads : {1u, 3u, 8u}) {
+      for (uint32_t countBits : {32u, 16u, 8u}) { testIds(index, numThreads, countBits); }
+      testCounter(index, numThreads);
+    }
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
@@ -0,0 +1,188 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that shards of a read set are parsed as "i/N", and that every
+*  read (and every read file) belongs to exactly one of the N shards, with
+*  both ends of a pair in the same one; and that a sample of a fraction of
+*  the reads is about that size, is the same every time, and keeps or
+*  drops the two ends of a pair together.
+**/
+
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ReadShard.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+template <typename F>
+bool throws(F f) {
+  try { f(); } catch (std::exception&) { return true; }
+  return false;
+}
+
+using sailfish::ReadShard;
+using sailfish::ReadSample;
+
+// The header of the i-th read of a run, as Illumina reads are named
+std::string readName(size_t i, const std::string& suffix = "") {
+  return "SRR0000001." + std::to_string(i) + suffix + " " + std::to_string(i) + " length=100";
+}
+
+void testParse() {
+  auto shard = ReadShard::parse("3/8");
+  CHECK(shard.index() == 3 and shard.count() == 8);
+  CHECK(!shard.all());
+  CHECK(ReadShard::parse("0/1").all());
+  CHECK(ReadShard().all());
+  CHECK(ReadShard::parse("4294967294/4294967295").count() == 4294967295u);
+  for (std::string bad : {"", "/", "1", "3/", "/8", "8/8", "9/8", "0/0", "-1/8", "1/-8", "+1/8", 
+                          "1/8x", "a/8", "1 /8", "1/2/8", "0/4294967296", "0/99999999999999999999"}) {
+    CHECK(throws([&]() { ReadShard::parse(bad); }));
+  }
+}
+
+void testOwnership() {
+  for (uint32_t count : {1, 2, 3, 8, 64}) {
+    std::vector<ReadShard> shards;
+    for (uint32_t i = 0; i < count; ++i) { shards.push_back(ReadShard::parse(std::to_string(i) + "/" + std::to_string(count))); }
+
+    // with at least as many files as shards, each shard takes whole files
+    CHECK(shards[0].byFile(count) == (count > 1));
+    CHECK(!shards[0].byFile(count - 1));
+    bool oneFileOwner{true};
+    for (size_t f = 0; f < 100; ++f) {
+      size_t owners{0};
+      for (auto& s : shards) { owners += s.ownsFile(f); }
+      oneFileOwner = oneFileOwner and owners == 1;
+    }
+    CHECK(oneFileOwner);
+
+    // otherwise each takes the reads whose name hashes to it
+    const size_t numReads = 30000;
+    std::vector<size_t> perShard(count, 0);
+    bool oneReadOwner{true}, matesTogether{true};
+    for (size_t r = 0; r < numReads; ++r) {
+      auto name = readName(r), first = readName(r, "/1"), second = readName(r, "/2");
+      size_t owners{0};
+      for (uint32_t i = 0; i < count; ++i) {
+        bool owns = shards[i].ownsRead(name.c_str(), name.size());
+        owners += owns;
+        perShard[i] += owns;
+        matesTogether = matesTogether and 
+                        shards[i].ownsRead(first.c_str(), first.size()) == owns and 
+                        shards[i].ownsRead(second.c_str(), second.size()) == owns;
+      }
+      oneReadOwner = oneReadOwner and owners == 1;
+    }
+    CHECK(oneReadOwner);
+    CHECK(matesTogether);
+    // and the shards are about the same size
+    bool balanced{true};
+    for (auto n : perShard) { balanced = balanced and n > 0.8 * numReads / count and n < 1.2 * numReads / count; }
+    CHECK(balanced);
+  }
+
+  // only the name (up to the first white space) and not its pair suffix
+  // decides the shard
+  auto shard = ReadShard::parse("1/2");
+  std::string a = "read7 first comment", b = "read7\tother comment", c = "read7/2";
+  CHECK(sailfish::readNameHash(a.c_str(), a.size()) == sailfish::readNameHash(b.c_str(), b.size()));
+  CHECK(sailfish::readNameHash(a.c_str(), a.size()) == sailfish::readNameHash(c.c_str(), c.size()));
+  CHECK(shard.ownsRead(a.c_str(), a.size()) == shard.ownsRead(c.c_str(), c.size()));
+  std::string d = "read7/3", e = "read7";
+  CHECK(sailfish::readNameHash(d.c_str(), d.size()) != sailfish::readNameHash(e.c_str(), e.size()));
+}
+
+}
+
+void testSample() {
+  for (double bad : {0.0, -0.5, 1.5, std::nan("")}) { CHECK(throws([=]() { ReadSample sample(bad); })); }
+  CHECK(ReadSample().all());
+  CHECK(ReadSample(1.0).all());
+  CHECK(!ReadSample(0.999).all());
+  CHECK(ReadSample(0.25).fraction() == 0.25);
+
+  const size_t numReads = 50000;
+  auto shard = ReadShard::parse("0/2");
+  for (double fraction : {0.01, 0.1, 0.5, 0.9, 1.0}) {
+    ReadSample sample(fraction), again(fraction), smaller(fraction / 2);
+    size_t numKept{0}, numInShard{0}, numKeptInShard{0};
+    bool same{true}, matesTogether{true}, nested{true};
+    for (size_t r = 0; r < numReads; ++r) {
+      auto name = readName(r), first = readName(r, "/1"), second = readName(r, "/2");
+      bool keeps = sample.keeps(name.c_str(), name.size());
+      numKept += keeps;
+      same = same and again.keeps(name.c_str(), name.size()) == keeps;
+      matesTogether = matesTogether and 
+                      sample.keeps(first.c_str(), first.size()) == keeps and 
+                      sample.keeps(second.c_str(), second.size()) == keeps;
+      // a smaller sample is part of a larger one
+      nested = nested and (keeps or !smaller.keeps(name.c_str(), name.size()));
+      if (shard.ownsRead(name.c_str(), name.size())) {
+        ++numInShard;
+        numKeptInShard += keeps;
+      }
+    }
+    CHECK(same);
+    CHECK(matesTogether);
+    CHECK(nested);
+    // the sample is about the right size, and (being independent of the
+    // shards) about the same fraction of a shard
+    double expected = fraction * numReads;
+    CHECK(std::abs(numKept - expected) <= 0.05 * expected + 20);
+    CHECK(std::abs(numKeptInShard - fraction * numInShard) <= 0.05 * fraction * numInShard + 20);
+    CHECK(fraction != 1.0 or numKept == numReads);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    testParse();
+    testOwnership();
+    testSample();
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    ++numFailures;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}
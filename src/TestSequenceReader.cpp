@@ -0,0 +1,272 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+/**
+*  Checks that SequenceReader and PairedSequenceReader yield the same
+*  records however their input is cut up: mapped or streamed (gzipped),
+*  and with chunks of any size.
+**/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "SequenceReader.hpp"
+
+namespace {
+
+int numFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+      ++numFailures; \
+    } \
+  } while (0)
+
+template <typename F>
+bool throws(F f) {
+  try { f(); } catch (std::exception&) { return true; }
+  return false;
+}
+
+struct Record {
+  std::string name;
+  std::string seq;
+  std::string qual;
+  bool operator==(const Record& o) const { return name == o.name and seq == o.seq and qual == o.qual; }
+};
+
+// The files written by a test, which are removed when it ends
+class TempFiles {
+  public:
+   TempFiles() {
+    char dir[] = "/tmp/sailfishTestXXXXXX";
+    if (mkdtemp(dir) == nullptr) { throw std::runtime_error("could not make a temporary directory"); }
+    dir_ = dir;
+   }
+   ~TempFiles() {
+    for (auto& f : files_) { std::remove(f.c_str()); }
+    rmdir(dir_.c_str());
+   }
+
+   std::string write(const std::string& name, const std::string& contents) {
+    std::string path = add_(name);
+    FILE* out = fopen(path.c_str(), "w");
+    fwrite(contents.data(), 1, contents.size(), out);
+    fclose(out);
+    return path;
+   }
+
+   std::string writeGzip(const std::string& name, const std::string& contents) {
+    std::string path = add_(name);
+    gzFile out = gzopen(path.c_str(), "wb");
+    gzwrite(out, contents.data(), contents.size());
+    gzclose(out);
+    return path;
+   }
+
+  private:
+   std::string add_(const std::string& name) {
+    files_.push_back(dir_ + "/" + name);
+    return files_.back();
+   }
+
+   std::string dir_;
+   std::vector<std::string> files_;
+};
+
+Record toRecord(const sailfish::SequenceRecord& read) {
+  Record r{std::string(read.header, read.hlen), "", std::string(read.qual_s, read.qual_e)};
+  // (the line breaks of a multi-line record aren't part of its sequence)
+  std::remove_copy_if(read.seq_s, read.seq_e, std::back_inserter(r.seq), 
+                      [](char c) { return c == '\n' or c == '\r'; });
+  return r;
+}
+
+std::vector<Record> readAll(const std::vector<std::string>& fnames, size_t chunkSize) {
+  sailfish::SequenceReader reader(fnames, chunkSize);
+  auto stream = reader.new_thread();
+  std::vector<Record> records;
+  while (auto read = stream.next_read()) { records.push_back(toRecord(*read)); }
+  reader.finish();
+  return records;
+}
+
+// A sequence of n bases, which is the same for the same seed
+std::string bases(size_t n, uint32_t seed) {
+  std::string s;
+  for (size_t i = 0; i < n; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    s += "ACGT"[(seed >> 16) & 3];
+  }
+  return s;
+}
+
+// num records with multi-line sequences, and the FASTA that holds them
+std::vector<Record> fastaRecords(size_t num, std::string& fasta) {
+  std::vector<Record> records;
+  for (size_t i = 0; i < num; ++i) {
+    // (a '>' in a header doesn't begin another record)
+    Record r{"t" + std::to_string(i) + " a>b >" + std::to_string(i % 3), bases(1 + (i * 37) % 150, i), ""};
+    fasta += ">" + r.name + "\n";
+    for (size_t b = 0; b < r.seq.size(); b += 60) { fasta += r.seq.substr(b, 60) + "\n"; }
+    records.push_back(r);
+  }
+  return records;
+}
+
+// num records whose qualities begin with '@' or '+', and the FASTQ that holds them
+std::vector<Record> fastqRecords(size_t num, std::string& fastq) {
+  std::vector<Record> records;
+  for (size_t i = 0; i < num; ++i) {
+    Record r{"r" + std::to_string(i) + "/1", bases(1 + (i * 13) % 90, i + 7), ""};
+    for (size_t b = 0; b < r.seq.size(); ++b) { r.qual += "@+I#5"[(b + i) % 5]; }
+    fastq += "@" + r.name + "\n" + r.seq + "\n+\n" + r.qual + "\n";
+    records.push_back(r);
+  }
+  return records;
+}
+
+const std::vector<size_t> ChunkSizes{1, 7, 16, 64, 1000, size_t(1) << 23};
+
+void testFasta(TempFiles& files) {
+  std::string fasta;
+  auto expected = fastaRecords(200, fasta);
+  auto plain = files.write("reads.fa", fasta);
+  auto gzipped = files.writeGzip("reads.fa.gz", fasta);
+  for (auto chunkSize : ChunkSizes) {
+    CHECK(readAll({plain}, chunkSize) == expected);
+    CHECK(readAll({gzipped}, chunkSize) == expected);
+  }
+  // files are read one after another
+  auto twice = expected;
+  twice.insert(twice.end(), expected.begin(), expected.end());
+  CHECK(readAll({plain, gzipped}, 16) == twice);
+}
+
+void testFastq(TempFiles& files) {
+  std::string fastq;
+  auto expected = fastqRecords(200, fastq);
+  auto plain = files.write("reads.fq", fastq);
+  auto gzipped = files.writeGzip("reads.fq.gz", fastq);
+  auto crlf = fastq;
+  for (size_t p = 0; (p = crlf.find('\n', p)) != std::string::npos; p += 2) { crlf.insert(p, "\r"); }
+  auto windows = files.write("windows.fq", crlf);
+  for (auto chunkSize : ChunkSizes) {
+    CHECK(readAll({plain}, chunkSize) == expected);
+    CHECK(readAll({gzipped}, chunkSize) == expected);
+    CHECK(readAll({windows}, chunkSize) == expected);
+  }
+}
+
+void testMalformed(TempFiles& files) {
+  // the qualities are shorter than the sequence
+  auto fastq = files.write("short.fq", "@r0\nACGT\n+\nIII\n");
+  auto gzipped = files.writeGzip("short.fq.gz", "@r0\nACGT\n+\nIII\n");
+  auto neither = files.write("neither.txt", "ACGT\n");
+  CHECK(throws([&]() { readAll({fastq}, 16); }));
+  CHECK(throws([&]() { readAll({gzipped}, 16); }));
+  CHECK(throws([&]() { readAll({neither}, 16); }));
+  auto empty = files.write("empty.fa", "\n\n");
+  CHECK(readAll({empty}, 16).empty());
+  // a streamed input of nothing but white space has no records (and no
+  // format), and mustn't hold up the inputs after it
+  auto blank = files.writeGzip("blank.fa.gz", "\n");
+  auto blanks = files.writeGzip("blanks.fq.gz", "\n \r\n\n");
+  std::string fasta;
+  auto expected = fastaRecords(3, fasta);
+  auto after = files.writeGzip("after.fa.gz", fasta);
+  for (size_t chunkSize : {1, 16}) {
+    CHECK(readAll({blank}, chunkSize).empty());
+    CHECK(readAll({blanks}, chunkSize).empty());
+    CHECK(readAll({blank, blanks, after}, chunkSize) == expected);
+  }
+}
+
+void testPaired(TempFiles& files) {
+  std::string fastq1, fastq2;
+  auto mates1 = fastqRecords(100, fastq1);
+  auto mates2 = fastqRecords(100, fastq2);
+  // the second list is split over two files, one of them gzipped
+  size_t half = 0;
+  for (int i = 0; i < 40 * 4; ++i) { half = fastq2.find('\n', half) + 1; }
+  auto m1 = files.write("mates_1.fq", fastq1);
+  auto m2a = files.write("mates_2a.fq", fastq2.substr(0, half));
+  auto m2b = files.writeGzip("mates_2b.fq.gz", fastq2.substr(half));
+  auto truncated = files.write("truncated_2.fq", fastq2.substr(0, half));
+
+  for (size_t perChunk : {size_t(1), size_t(3), size_t(64)}) {
+    for (size_t readSize : {size_t(16), size_t(1) << 22}) {
+      sailfish::PairedSequenceReader reader({m1}, {m2a, m2b}, perChunk, readSize);
+      auto stream = reader.new_thread();
+      const sailfish::SequenceRecord* r1;
+      const sailfish::SequenceRecord* r2;
+      size_t n{0};
+      bool inOrder{true};
+      while (stream.next_pair(r1, r2)) {
+        inOrder = inOrder and n < mates1.size() and toRecord(*r1) == mates1[n] and toRecord(*r2) == mates2[n];
+        ++n;
+      }
+      reader.finish();
+      CHECK(inOrder);
+      CHECK(n == mates1.size());
+    }
+  }
+
+  // the lists must hold the same number of records
+  sailfish::PairedSequenceReader reader({m1}, {truncated}, 8, 64);
+  auto stream = reader.new_thread();
+  const sailfish::SequenceRecord* r1;
+  const sailfish::SequenceRecord* r2;
+  while (stream.next_pair(r1, r2)) {}
+  CHECK(throws([&]() { reader.finish(); }));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    TempFiles files;
+    testFasta(files);
+    testFastq(files);
+    testMalformed(files);
+    testPaired(files);
+  } catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << "\n";
+    return 1;
+  }
+  if (numFailures > 0) {
+    std::cerr << numFailures << " checks failed\n";
+    return 1;
+  }
+  std::cerr << "all checks passed\n";
+  return 0;
+}